@@ -0,0 +1,97 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_CATALOG_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_CATALOG_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "./dump_reader.h"
+
+namespace dump {
+
+/* Catalog of the inodes of a dump, as newline delimited JSON: one object per
+ * inode, for example
+ *
+ *   {"inode":12,"type":"file","size":5,"mode":420,"uid":0,"gid":0,
+ *    "nlink":2,"atime_us":...,"mtime_us":...,"ctime_us":...,
+ *    "paths":["/a/b","/c"]}
+ *
+ * on a single line. Names are written as the bytes found in the dump, only
+ * '"', '\' and control characters are escaped. */
+class CatalogWriter {
+ public:
+  /* Append the line of `inode`, with its names `paths`, to `out`. */
+  static void AppendLine(const Inode& inode, const std::vector<Path>& paths,
+                         std::string* out) {
+    out->append("{\"inode\":").append(std::to_string(inode.inode_id));
+    out->append(",\"type\":\"").append(TypeName(inode.mode.type));
+    out->append("\",\"size\":").append(std::to_string(inode.size));
+    out->append(",\"mode\":").append(std::to_string(inode.mode.perms_value));
+    out->append(",\"uid\":").append(std::to_string(inode.uid));
+    out->append(",\"gid\":").append(std::to_string(inode.gid));
+    out->append(",\"nlink\":").append(std::to_string(inode.hardlink_cnt));
+    out->append(",\"atime_us\":").append(std::to_string(inode.atime_us));
+    out->append(",\"mtime_us\":").append(std::to_string(inode.mtime_us));
+    out->append(",\"ctime_us\":").append(std::to_string(inode.ctime_us));
+    out->append(",\"paths\":[");
+    for (size_t i = 0; i < paths.size(); ++i) {
+      if (i) {
+        out->push_back(',');
+      }
+      out->push_back('"');
+      AppendEscaped(paths[i].directory, paths[i].directory_len, out);
+      AppendEscaped(paths[i].name, paths[i].name_len, out);
+      out->push_back('"');
+    }
+    out->append("]}\n");
+  }
+
+ private:
+  static const char* TypeName(Mode::Type type) {
+    switch (type) {
+      case Mode::Type::SOCKET: return "socket";
+      case Mode::Type::LINK: return "symlink";
+      case Mode::Type::REGULAR: return "file";
+      case Mode::Type::BLOCK_DEV: return "block";
+      case Mode::Type::DIRECTORY: return "dir";
+      case Mode::Type::CHAR_DEV: return "char";
+      case Mode::Type::FIFO: return "fifo";
+    }
+    return "unknown";
+  }
+
+  static void AppendEscaped(const char* data, size_t size, std::string* out) {
+    static const char HEX[] = "0123456789abcdef";
+    for (size_t i = 0; i < size; ++i) {
+      const unsigned char c = data[i];
+      if (c == '"' || c == '\\') {
+        out->push_back('\\');
+        out->push_back(c);
+      } else if (c < 0x20) {
+        out->append("\\u00");
+        out->push_back(HEX[c >> 4]);
+        out->push_back(HEX[c & 0xF]);
+      } else {
+        out->push_back(c);
+      }
+    }
+  }
+};
+
+}  // namespace dump
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_CATALOG_H_
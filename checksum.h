@@ -0,0 +1,195 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_CHECKSUM_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_CHECKSUM_H_
+
+#include <endian.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __x86_64__
+#define DUMP2TAR_CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+namespace checksum {
+
+/* Sums of the dump records and tar headers checksums.
+ *
+ * Both are plain additions, computed 16 or 32 bytes at a time with SSE4.1 or
+ * AVX2 when the CPU has them, picked once at runtime. The scalar versions are
+ * the reference, the vector ones give the exact same results. */
+
+/* Sum of `size / 4` big-endian 32 bits words, wrapping around. */
+inline uint32_t SumBigEndian32Scalar(const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  uint32_t sum = 0;
+  for (size_t i = 0; i + 4 <= size; i += 4) {
+    uint32_t v;
+    memcpy(&v, p + i, sizeof v);
+    sum += be32toh(v);
+  }
+  return sum;
+}
+
+/* Sum of `size` unsigned bytes. */
+inline uint64_t SumBytesScalar(const void* data, size_t size) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  uint64_t sum = 0;
+  for (size_t i = 0; i < size; ++i) {
+    sum += p[i];
+  }
+  return sum;
+}
+
+#ifdef DUMP2TAR_CHECKSUM_X86
+
+__attribute__((target("sse4.1")))
+inline uint32_t SumBigEndian32Sse41(const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                      11, 10, 9, 8, 15, 14, 13, 12);
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi8(v, bswap));
+  }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  return uint32_t(_mm_cvtsi128_si32(acc))
+       + SumBigEndian32Scalar(p + i, size - i);
+}
+
+__attribute__((target("sse4.1")))
+inline uint64_t SumBytesSse41(const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    // Two 64 bits sums of 8 bytes each.
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+  }
+  return uint64_t(_mm_extract_epi64(acc, 0))
+       + uint64_t(_mm_extract_epi64(acc, 1))
+       + SumBytesScalar(p + i, size - i);
+}
+
+__attribute__((target("avx2")))
+inline uint32_t SumBigEndian32Avx2(const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                         11, 10, 9, 8, 15, 14, 13, 12,
+                                         3, 2, 1, 0, 7, 6, 5, 4,
+                                         11, 10, 9, 8, 15, 14, 13, 12);
+  __m256i acc0 = _mm256_setzero_si256();
+  __m256i acc1 = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    const __m256i v0 = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(p + i));
+    const __m256i v1 = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(p + i + 32));
+    acc0 = _mm256_add_epi32(acc0, _mm256_shuffle_epi8(v0, bswap));
+    acc1 = _mm256_add_epi32(acc1, _mm256_shuffle_epi8(v1, bswap));
+  }
+  acc0 = _mm256_add_epi32(acc0, acc1);
+  __m128i acc = _mm_add_epi32(_mm256_castsi256_si128(acc0),
+                              _mm256_extracti128_si256(acc0, 1));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  return uint32_t(_mm_cvtsi128_si32(acc))
+       + SumBigEndian32Sse41(p + i, size - i);
+}
+
+__attribute__((target("avx2")))
+inline uint64_t SumBytesAvx2(const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc0 = _mm256_setzero_si256();
+  __m256i acc1 = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    const __m256i v0 = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(p + i));
+    const __m256i v1 = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(p + i + 32));
+    acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(v0, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(v1, zero));
+  }
+  acc0 = _mm256_add_epi64(acc0, acc1);
+  const __m128i acc = _mm_add_epi64(_mm256_castsi256_si128(acc0),
+                                    _mm256_extracti128_si256(acc0, 1));
+  return uint64_t(_mm_extract_epi64(acc, 0))
+       + uint64_t(_mm_extract_epi64(acc, 1))
+       + SumBytesSse41(p + i, size - i);
+}
+
+#endif  // DUMP2TAR_CHECKSUM_X86
+
+enum class Kernel {
+  SCALAR,
+  SSE41,
+  AVX2,
+};
+
+/* The best kernel for this CPU. */
+inline Kernel BestKernel() {
+#ifdef DUMP2TAR_CHECKSUM_X86
+  static const Kernel kernel = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return Kernel::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+      return Kernel::SSE41;
+    }
+    return Kernel::SCALAR;
+  }();
+  return kernel;
+#else
+  return Kernel::SCALAR;
+#endif
+}
+
+inline uint32_t SumBigEndian32(const void* data, size_t size,
+                               Kernel kernel = BestKernel()) {
+  switch (kernel) {
+#ifdef DUMP2TAR_CHECKSUM_X86
+    case Kernel::AVX2:  return SumBigEndian32Avx2(data, size);
+    case Kernel::SSE41: return SumBigEndian32Sse41(data, size);
+#endif
+    default:            return SumBigEndian32Scalar(data, size);
+  }
+}
+
+inline uint64_t SumBytes(const void* data, size_t size,
+                         Kernel kernel = BestKernel()) {
+  switch (kernel) {
+#ifdef DUMP2TAR_CHECKSUM_X86
+    case Kernel::AVX2:  return SumBytesAvx2(data, size);
+    case Kernel::SSE41: return SumBytesSse41(data, size);
+#endif
+    default:            return SumBytesScalar(data, size);
+  }
+}
+
+}  // namespace checksum
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_CHECKSUM_H_
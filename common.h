@@ -16,7 +16,17 @@
 #ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_COMMON_H_
 #define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_COMMON_H_
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <iostream>
 
 union Permissions {
   uint16_t raw;
@@ -49,4 +59,78 @@ union Permissions {
   }
 };
 
+/* Write all of `data` to `fd`, again when interrupted. Abort on error, the
+ * message starts with `what`. */
+inline void WriteAll(int fd, const void* data, size_t size, const char* what) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    const ssize_t r = write(fd, p, size);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << what << " write error: " << strerror(errno) << std::endl;
+      abort();
+    }
+    p += r;
+    size -= r;
+  }
+}
+
+/* A whole file mapped read-only in memory, unmapped on destruction. */
+class MappedFile {
+ public:
+  ~MappedFile() {
+    Close();
+  }
+
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  /* Return false if the file cannot be mapped, or is smaller than
+   * `min_size`. */
+  bool Open(const char* path, size_t min_size) {
+    Close();
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < min_size
+        || st.st_size == 0) {
+      close(fd);
+      return false;
+    }
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      return false;
+    }
+    _data = static_cast<char*>(addr);
+    _size = st.st_size;
+    return true;
+  }
+
+  void Close() {
+    if (_data) {
+      munmap(_data, _size);
+      _data = nullptr;
+      _size = 0;
+    }
+  }
+
+  const char* data() const {
+    return _data;
+  }
+
+  size_t size() const {
+    return _size;
+  }
+
+ private:
+  char*  _data = nullptr;
+  size_t _size = 0;
+};
+
 #endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_COMMON_H_
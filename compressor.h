@@ -0,0 +1,519 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_COMPRESSOR_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_COMPRESSOR_H_
+
+#include <endian.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef DUMP2TAR_ZSTD
+#include <zstd.h>
+#endif
+
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "./spsc_ring.h"
+
+namespace io {
+
+enum class Codec {
+  GZIP,
+#ifdef DUMP2TAR_ZSTD
+  ZSTD,
+#endif
+};
+
+class CompressingWriter;
+
+/* The worker threads compressing the chunks of one or more
+ * CompressingWriters, in the order they are published.
+ *
+ * Every chunk is compressed on its own, as one or more complete gzip members
+ * or zstd frames, so they can be compressed in parallel and simply written
+ * one after the other: the concatenation is a valid multi-member gzip or
+ * multi-frame zstd stream.
+ *
+ * Chunks are looked at by SEGMENT_SIZE segments. Segments that look already
+ * compressed, because their bytes are close to random, are stored as is in
+ * the gzip or zstd format instead of being compressed again.
+ *
+ * The writers of the shards of an archive share one pool, so that the shards
+ * still being written do not add threads of their own. */
+class CompressorPool {
+ public:
+  static constexpr const size_t SEGMENT_SIZE = 256 << 10;
+
+  CompressorPool(Codec codec, int level, size_t workers)
+      : _codec(codec), _level(level) {
+    assert(workers > 0);
+    for (size_t i = 0; i < workers; ++i) {
+      _workers.emplace_back(&CompressorPool::WorkerLoop, this);
+    }
+  }
+
+  /* Once every writer using the pool is closed. */
+  ~CompressorPool() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closed = true;
+    }
+    _ready.notify_all();
+    for (auto& worker : _workers) {
+      worker.join();
+    }
+  }
+
+  CompressorPool(const CompressorPool&) = delete;
+  CompressorPool& operator=(const CompressorPool&) = delete;
+
+  size_t workers() const {
+    return _workers.size();
+  }
+
+ private:
+  friend class CompressingWriter;
+
+  /* The state of one worker, kept across chunks. */
+  struct Compressor {
+    z_stream deflate;
+    z_stream store;
+#ifdef DUMP2TAR_ZSTD
+    ZSTD_CCtx* zstd = nullptr;
+#endif
+  };
+
+  /* A chunk of `writer` to compress. */
+  struct Job {
+    CompressingWriter* writer;
+    size_t             slot;
+  };
+
+  void Queue(CompressingWriter* writer, size_t slot) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _queue.push_back(Job{ writer, slot });
+    }
+    _ready.notify_one();
+  }
+
+  // Defined after CompressingWriter.
+  void WorkerLoop();
+
+  void InitCompressor(Compressor* c) {
+    switch (_codec) {
+      case Codec::GZIP:
+        memset(&c->deflate, 0, sizeof c->deflate);
+        memset(&c->store, 0, sizeof c->store);
+        // 16 + 15 bits window: gzip wrapper around the deflate stream.
+        if (deflateInit2(&c->deflate, _level, Z_DEFLATED, 16 + 15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK
+            || deflateInit2(&c->store, 0, Z_DEFLATED, 16 + 15, 8,
+                            Z_DEFAULT_STRATEGY) != Z_OK) {
+          std::cerr << "Cannot initialize zlib" << std::endl;
+          abort();
+        }
+        break;
+#ifdef DUMP2TAR_ZSTD
+      case Codec::ZSTD:
+        c->zstd = ZSTD_createCCtx();
+        if (!c->zstd) {
+          std::cerr << "Cannot initialize zstd" << std::endl;
+          abort();
+        }
+        break;
+#endif
+    }
+  }
+
+  void FreeCompressor(Compressor* c) {
+    switch (_codec) {
+      case Codec::GZIP:
+        deflateEnd(&c->deflate);
+        deflateEnd(&c->store);
+        break;
+#ifdef DUMP2TAR_ZSTD
+      case Codec::ZSTD:
+        ZSTD_freeCCtx(c->zstd);
+        break;
+#endif
+    }
+  }
+
+  /* Compress `data` into `out`, by runs of segments that look the same.
+   * Return the number of bytes stored as is. */
+  size_t Compress(Compressor* c, const char* data, size_t size,
+                  std::vector<char>* out) {
+    out->clear();
+    size_t stored = 0;
+    size_t begin = 0;
+    bool store = LooksCompressed(data, std::min(size, SEGMENT_SIZE));
+    while (begin < size) {
+      size_t end = std::min(size, begin + SEGMENT_SIZE);
+      bool next_store = store;
+      while (end < size) {
+        const size_t next_end = std::min(size, end + SEGMENT_SIZE);
+        next_store = LooksCompressed(data + end, next_end - end);
+        if (next_store != store) {
+          break;
+        }
+        end = next_end;
+      }
+      AppendFrame(c, store, data + begin, end - begin, out);
+      if (store) {
+        stored += end - begin;
+      }
+      begin = end;
+      store = next_store;
+    }
+    return stored;
+  }
+
+  /* Whether the bytes look random, like compressed or encrypted data:
+   * about 8 bits of entropy per byte, over samples spread in `data`. */
+  static bool LooksCompressed(const char* data, size_t size) {
+    constexpr const size_t SAMPLES = 16;
+    constexpr const size_t SAMPLE_SIZE = 1024;
+    constexpr const double MIN_BITS_PER_BYTE = 7.9;
+    if (size < SAMPLES * SAMPLE_SIZE) {
+      return false;  // Too short to tell, and cheap to compress anyway.
+    }
+    uint32_t counts[256] = {};
+    const size_t stride = size / SAMPLES;
+    for (size_t i = 0; i < SAMPLES; ++i) {
+      const uint8_t* p = reinterpret_cast<const uint8_t*>(data + i * stride);
+      for (size_t j = 0; j < SAMPLE_SIZE; ++j) {
+        ++counts[p[j]];
+      }
+    }
+    constexpr const double total = SAMPLES * SAMPLE_SIZE;
+    double bits = 0;
+    for (const uint32_t count : counts) {
+      if (count) {
+        const double p = count / total;
+        bits -= p * std::log2(p);
+      }
+    }
+    return bits >= MIN_BITS_PER_BYTE;
+  }
+
+  /* Append one complete gzip member or zstd frame holding `data`. */
+  void AppendFrame(Compressor* c, bool store, const char* data, size_t size,
+                   std::vector<char>* out) {
+    const size_t offset = out->size();
+    switch (_codec) {
+      case Codec::GZIP: {
+        z_stream* z = store ? &c->store : &c->deflate;
+        out->resize(offset + deflateBound(z, size));
+        z->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        z->avail_in = size;
+        z->next_out = reinterpret_cast<Bytef*>(&(*out)[offset]);
+        z->avail_out = out->size() - offset;
+        if (deflate(z, Z_FINISH) != Z_STREAM_END) {
+          std::cerr << "Compression error: " << (z->msg ? z->msg : "zlib")
+                    << std::endl;
+          abort();
+        }
+        out->resize(out->size() - z->avail_out);
+        deflateReset(z);
+        break;
+      }
+#ifdef DUMP2TAR_ZSTD
+      case Codec::ZSTD: {
+        if (store) {
+          AppendZstdRawFrame(data, size, out);
+          break;
+        }
+        out->resize(offset + ZSTD_compressBound(size));
+        const size_t r = ZSTD_compressCCtx(c->zstd, &(*out)[offset],
+                                           out->size() - offset, data, size,
+                                           _level);
+        if (ZSTD_isError(r)) {
+          std::cerr << "Compression error: " << ZSTD_getErrorName(r)
+                    << std::endl;
+          abort();
+        }
+        out->resize(offset + r);
+        break;
+      }
+#endif
+    }
+  }
+
+#ifdef DUMP2TAR_ZSTD
+  /* A zstd frame made of raw blocks, see RFC 8878: the bytes are copied,
+   * nothing is compressed. */
+  static void AppendZstdRawFrame(const char* data, size_t size,
+                                 std::vector<char>* out) {
+    constexpr const size_t MAX_BLOCK_SIZE = 128 << 10;
+    const size_t blocks = std::max<size_t>(1, (size + MAX_BLOCK_SIZE - 1)
+                                              / MAX_BLOCK_SIZE);
+    size_t offset = out->size();
+    out->resize(offset + 4 + 1 + 8 + blocks * 3 + size);
+    uint8_t* p = reinterpret_cast<uint8_t*>(&(*out)[offset]);
+    const uint32_t magic = htole32(0xFD2FB528);
+    memcpy(p, &magic, 4);
+    // Single segment, 8 bytes content size, no checksum, no dictionary.
+    p[4] = 0xE0;
+    const uint64_t content_size = htole64(size);
+    memcpy(p + 5, &content_size, 8);
+    p += 13;
+    size_t done = 0;
+    do {
+      const size_t block = std::min(size - done, MAX_BLOCK_SIZE);
+      const uint32_t last = done + block == size;
+      // Last block flag, block type 0 (raw) and size, little-endian.
+      const uint32_t header = last | uint32_t(block) << 3;
+      p[0] = header;
+      p[1] = header >> 8;
+      p[2] = header >> 16;
+      memcpy(p + 3, data + done, block);
+      p += 3 + block;
+      done += block;
+    } while (done < size);
+  }
+#endif
+
+  const Codec              _codec;
+  const int                _level;
+  std::vector<std::thread> _workers;
+
+  std::mutex               _mutex;
+  std::condition_variable  _ready;  // A job in _queue, or closed.
+  std::deque<Job>          _queue;
+  bool                     _closed = false;
+};
+
+/* Compresses the output on the workers of a CompressorPool. A writer thread
+ * writes the compressed chunks in order.
+ *
+ * There are `workers + 2` chunks, one being filled, one being written and
+ * one per worker of the pool: memory is bounded to about twice that many
+ * chunks. */
+class CompressingWriter: public ChunkSink {
+ public:
+  CompressingWriter(int fd, std::shared_ptr<CompressorPool> pool,
+                    size_t chunk_size)
+      : _fd(fd), _pool(std::move(pool)), _slots(_pool->workers() + 2) {
+    for (auto& slot : _slots) {
+      slot.input.reset(new char[chunk_size]);
+    }
+    _writer = std::thread(&CompressingWriter::WriterLoop, this);
+  }
+
+  ~CompressingWriter() {
+    Close();
+  }
+
+  bool AcquireFree(Chunk* chunk) override {
+    std::unique_lock<std::mutex> lock(_mutex);
+    Slot& slot = _slots[_published % _slots.size()];
+    if (slot.state != Slot::FREE) {
+      ++_producer_stalls;
+      _changed.wait(lock, [&] { return slot.state == Slot::FREE; });
+    }
+    slot.state = Slot::FILLING;
+    *chunk = Chunk{ slot.input.get(), 0 };
+    return true;
+  }
+
+  void Publish(const Chunk& chunk) override {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const size_t index = _published % _slots.size();
+    Slot& slot = _slots[index];
+    assert(slot.state == Slot::FILLING && slot.input.get() == chunk.data);
+    slot.input_size = chunk.size;
+    slot.state = Slot::QUEUED;
+    ++_published;
+    _pool->Queue(this, index);
+  }
+
+  void Close() override {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closed = true;
+      _changed.notify_all();
+    }
+    if (_writer.joinable()) {
+      _writer.join();
+    }
+  }
+
+  /* Bytes given to and out of the compressors, and stored as is. Only valid
+   * after Close(). */
+  uint64_t bytes_in() const {
+    return _bytes_in;
+  }
+
+  uint64_t bytes_out() const {
+    return _bytes_out;
+  }
+
+  uint64_t bytes_stored() const {
+    return _bytes_stored;
+  }
+
+  /* Where a compressed chunk starts, in the uncompressed and compressed
+   * streams. Decompression can start there. */
+  struct FrameOffset {
+    uint64_t uncompressed;
+    uint64_t compressed;
+  };
+
+  /* Every chunk, in order. Only valid after Close(). */
+  const std::vector<FrameOffset>& frames() const {
+    return _frames;
+  }
+
+  /* Times the producer waited for a free chunk: compression is the
+   * bottleneck. */
+  uint64_t producer_stalls() const {
+    return _producer_stalls;
+  }
+
+  /* Times the writer waited for a chunk to be compressed. */
+  uint64_t writer_stalls() const {
+    return _writer_stalls;
+  }
+
+ private:
+  friend class CompressorPool;
+
+  struct Slot {
+    enum State {
+      FREE,
+      FILLING,
+      QUEUED,      // Waiting for a worker, or being compressed.
+      COMPRESSED,  // Waiting for the writer, or being written.
+    };
+
+    std::unique_ptr<char[]> input;
+    size_t                  input_size = 0;
+    std::vector<char>       output;
+    size_t                  stored = 0;
+    State                   state = FREE;
+  };
+
+  /* Called by a worker of the pool once the chunk of slot `index` is in its
+   * output. */
+  void Compressed(size_t index) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _slots[index].state = Slot::COMPRESSED;
+    _changed.notify_all();
+  }
+
+  void WriterLoop() {
+    for (uint64_t written = 0;; ++written) {
+      Slot* slot = &_slots[written % _slots.size()];
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto ready = [&] {
+          return slot->state == Slot::COMPRESSED
+              || (_closed && written == _published);
+        };
+        if (!ready()) {
+          ++_writer_stalls;
+          _changed.wait(lock, ready);
+        }
+        if (slot->state != Slot::COMPRESSED) {
+          return;  // Closed, and everything is written.
+        }
+      }
+      _frames.push_back(FrameOffset{ _bytes_in, _bytes_out });
+      WriteAll(slot->output.data(), slot->output.size());
+      _bytes_in += slot->input_size;
+      _bytes_out += slot->output.size();
+      _bytes_stored += slot->stored;
+
+      std::lock_guard<std::mutex> lock(_mutex);
+      slot->state = Slot::FREE;
+      _changed.notify_all();
+    }
+  }
+
+  void WriteAll(const char* data, size_t size) {
+    while (size > 0) {
+      const ssize_t r = write(_fd, data, size);
+      if (r < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        std::cerr << "Write error: " << strerror(errno) << std::endl;
+        abort();
+      }
+      data += r;
+      size -= r;
+    }
+  }
+
+  const int                       _fd;
+  std::shared_ptr<CompressorPool> _pool;
+  std::vector<Slot>               _slots;
+  std::thread                     _writer;
+
+  std::mutex                      _mutex;
+  std::condition_variable         _changed;
+  uint64_t                        _published = 0;  // Chunks handed to us.
+  bool                            _closed = false;
+
+  uint64_t                        _producer_stalls = 0;
+  uint64_t                        _writer_stalls = 0;
+  uint64_t                        _bytes_in = 0;
+  uint64_t                        _bytes_out = 0;
+  uint64_t                        _bytes_stored = 0;
+  std::vector<FrameOffset>        _frames;
+};
+
+inline void CompressorPool::WorkerLoop() {
+  Compressor compressor;
+  InitCompressor(&compressor);
+  for (;;) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _ready.wait(lock, [this] { return !_queue.empty() || _closed; });
+      if (_queue.empty()) {
+        break;
+      }
+      job = _queue.front();
+      _queue.pop_front();
+    }
+    CompressingWriter::Slot& slot = job.writer->_slots[job.slot];
+    slot.stored = Compress(&compressor, slot.input.get(), slot.input_size,
+                           &slot.output);
+    job.writer->Compressed(job.slot);
+  }
+  FreeCompressor(&compressor);
+}
+
+// Taken by reference by std::min() in Compress().
+constexpr const size_t CompressorPool::SEGMENT_SIZE;
+
+}  // namespace io
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_COMPRESSOR_H_
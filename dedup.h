@@ -0,0 +1,229 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DEDUP_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DEDUP_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace digest {
+
+/* Fingerprints of the regular files written to an archive, so that a later
+ * file with the same content is written as a hardlink to the first one.
+ *
+ * Files are grouped by their size, owner, permissions and a hash of their
+ * first PREFIX_SIZE bytes, all cheap to get before the headers of a file
+ * are written. Only a
+ * file whose group already has a member needs its full digest that early;
+ * the digest of any other file is computed as its content is copied, and
+ * given with Hashed() once known.
+ *
+ * Digests are kept in binary and paths in one string table. Once the table
+ * uses about `budget` bytes, no more members are added: later files are
+ * still matched against the members already there. */
+class DedupTable {
+ public:
+  /* Bytes hashed for the prefilter. */
+  static constexpr const uint64_t PREFIX_SIZE = 4096;
+
+  /* Smaller files are written as they are, their headers would take most of
+   * what a hardlink saves. */
+  static constexpr const uint64_t MIN_SIZE = 16 << 10;
+
+  /* What a file must share with a member to be linked to it: its size and
+   * prefix, and the owner and permissions a hardlink gets from its target
+   * when extracted. */
+  struct Key {
+    uint64_t size;
+    uint64_t prefix;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t perms;
+  };
+
+  /* For digests of `digest_size` bytes. */
+  DedupTable(size_t budget, size_t digest_size)
+      : _budget(budget), _digest_size(digest_size) {
+  }
+
+  /* Whether a member has this key. */
+  bool MayMatch(const Key& key) const {
+    return _groups.count(GroupKey(key)) > 0;
+  }
+
+  /* Whether some members are still waiting for their Hashed(). */
+  bool pending() const {
+    return !_pending.empty();
+  }
+
+  /* The path of a member with this key and hexadecimal digest, or nullptr.
+   * Members still pending are not matched. The `location` given to Add() is
+   * stored in `location`, for the caller to compare the content. */
+  const char* Find(const Key& key, const std::string& hex, size_t* path_len,
+                   uint64_t* location) const {
+    char digest[MAX_DIGEST_SIZE];
+    if (!FromHex(hex, digest)) {
+      return nullptr;
+    }
+    const auto group = _groups.find(GroupKey(key));
+    if (group == _groups.end()) {
+      return nullptr;
+    }
+    for (uint32_t i = group->second; i != NONE; i = _members[i].next) {
+      const Member& member = _members[i];
+      const char* data = &_strings[member.offset];
+      if (member.hashed && SameKey(member.key, key)
+          && memcmp(data, digest, _digest_size) == 0) {
+        *path_len = member.path_len;
+        *location = member.location;
+        return data + _digest_size;
+      }
+    }
+    return nullptr;
+  }
+
+  /* Add the file `path`, with its digest `hex` or, if empty, one given later
+   * with Hashed(). `location` is opaque, returned by Find(). Return false if
+   * the table is full. */
+  bool Add(const Key& key, const std::string& path, const std::string& hex,
+           uint64_t location) {
+    const auto group = _groups.find(GroupKey(key));
+    const size_t cost = sizeof (Member) + _digest_size + path.size()
+                      + (group == _groups.end() ? GROUP_COST : 0);
+    if (_used + cost > _budget || _members.size() == NONE
+        || path.size() > UINT16_MAX) {
+      ++_rejected;
+      return false;
+    }
+    _used += cost;
+    Member member;
+    member.key = key;
+    member.location = location;
+    member.offset = _strings.size();
+    member.next = group == _groups.end() ? NONE : group->second;
+    member.path_len = path.size();
+    member.hashed = !hex.empty();
+    _strings.resize(_strings.size() + _digest_size);
+    if (member.hashed && !FromHex(hex, &_strings[member.offset])) {
+      member.hashed = false;  // Never matched.
+    }
+    _strings.append(path);
+    _groups[GroupKey(key)] = _members.size();
+    if (hex.empty()) {
+      _pending[path] = _members.size();
+    }
+    _members.push_back(member);
+    return true;
+  }
+
+  /* The digest of `path`, added without one. Other paths are ignored. */
+  void Hashed(const std::string& path, const std::string& hex) {
+    const auto it = _pending.find(path);
+    if (it == _pending.end()) {
+      return;
+    }
+    Member& member = _members[it->second];
+    member.hashed = FromHex(hex, &_strings[member.offset]);
+    _pending.erase(it);
+  }
+
+  size_t size() const {
+    return _members.size();
+  }
+
+  /* Bytes used, about. */
+  size_t used() const {
+    return _used;
+  }
+
+  /* Files not added, the table being full. */
+  uint64_t rejected() const {
+    return _rejected;
+  }
+
+ private:
+  static constexpr const uint32_t NONE = UINT32_MAX;
+  static constexpr const size_t MAX_DIGEST_SIZE = 64;
+  // A node of _groups.
+  static constexpr const size_t GROUP_COST = 4 * sizeof (void*);
+
+  struct Member {
+    Key      key;
+    uint64_t location;
+    uint64_t offset;    // In _strings, of the digest then the path.
+    uint32_t next;      // In the same group, added before.
+    uint16_t path_len;
+    bool     hashed;
+  };
+
+  static uint64_t GroupKey(const Key& key) {
+    return key.prefix ^ (key.size * 0x9E3779B97F4A7C15ULL)
+        ^ ((uint64_t(key.uid) << 32 | key.gid) * 0xC2B2AE3D27D4EB4FULL)
+        ^ (uint64_t(key.perms) * 0x165667B19E3779F9ULL);
+  }
+
+  static bool SameKey(const Key& a, const Key& b) {
+    return a.size == b.size && a.prefix == b.prefix && a.uid == b.uid
+        && a.gid == b.gid && a.perms == b.perms;
+  }
+
+  bool FromHex(const std::string& hex, char* out) const {
+    if (hex.size() != 2 * _digest_size) {
+      return false;
+    }
+    for (size_t i = 0; i < _digest_size; ++i) {
+      const int high = HexValue(hex[2 * i]);
+      const int low = HexValue(hex[2 * i + 1]);
+      if (high < 0 || low < 0) {
+        return false;
+      }
+      out[i] = char(high << 4 | low);
+    }
+    return true;
+  }
+
+  static int HexValue(char c) {
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+      return c - 'a' + 10;
+    }
+    return -1;
+  }
+
+  const size_t                              _budget;
+  const size_t                              _digest_size;
+  std::vector<Member>                       _members;
+  std::string                               _strings;
+  // Last member added of every group.
+  std::unordered_map<uint64_t, uint32_t>    _groups;
+  // Members by path, until Hashed().
+  std::unordered_map<std::string, uint32_t> _pending;
+  size_t                                    _used = 0;
+  uint64_t                                  _rejected = 0;
+};
+
+constexpr const uint64_t DedupTable::PREFIX_SIZE;
+constexpr const uint64_t DedupTable::MIN_SIZE;
+constexpr const uint32_t DedupTable::NONE;
+constexpr const size_t DedupTable::GROUP_COST;
+
+}  // namespace digest
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DEDUP_H_
@@ -0,0 +1,511 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DIGEST_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DIGEST_H_
+
+#ifdef DUMP2TAR_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace digest {
+
+enum class Algorithm {
+  XXH64,
+#ifdef DUMP2TAR_OPENSSL
+  SHA256,
+#endif
+};
+
+inline const char* Name(Algorithm algorithm) {
+  switch (algorithm) {
+    case Algorithm::XXH64: return "xxh64";
+#ifdef DUMP2TAR_OPENSSL
+    case Algorithm::SHA256: return "sha256";
+#endif
+  }
+  return "unknown";
+}
+
+/* Bytes of a digest of `algorithm`. */
+inline size_t Size(Algorithm algorithm) {
+  switch (algorithm) {
+    case Algorithm::XXH64: return 8;
+#ifdef DUMP2TAR_OPENSSL
+    case Algorithm::SHA256: return 32;
+#endif
+  }
+  return 0;
+}
+
+/* XXH64 with a seed of 0, as printed by `xxh64sum`. */
+class Xxh64 {
+ public:
+  void Update(const char* data, size_t size) {
+    const auto* p = reinterpret_cast<const uint8_t*>(data);
+    _total += size;
+    if (_buffered + size < sizeof _buffer) {
+      memcpy(_buffer + _buffered, p, size);
+      _buffered += size;
+      return;
+    }
+    if (_buffered) {
+      const size_t fill = sizeof _buffer - _buffered;
+      memcpy(_buffer + _buffered, p, fill);
+      Stripe(_buffer);
+      p += fill;
+      size -= fill;
+      _buffered = 0;
+    }
+    for (; size >= sizeof _buffer; size -= sizeof _buffer) {
+      Stripe(p);
+      p += sizeof _buffer;
+    }
+    memcpy(_buffer, p, size);
+    _buffered = size;
+  }
+
+  uint64_t Final() const {
+    uint64_t h;
+    if (_total >= sizeof _buffer) {
+      h = Rotl(_v[0], 1) + Rotl(_v[1], 7) + Rotl(_v[2], 12) + Rotl(_v[3], 18);
+      for (const uint64_t v : _v) {
+        h ^= Round(0, v);
+        h = h * PRIME_1 + PRIME_4;
+      }
+    } else {
+      h = PRIME_5;
+    }
+    h += _total;
+    const uint8_t* p = _buffer;
+    size_t size = _buffered;
+    for (; size >= 8; p += 8, size -= 8) {
+      h ^= Round(0, Read64(p));
+      h = Rotl(h, 27) * PRIME_1 + PRIME_4;
+    }
+    if (size >= 4) {
+      h ^= uint64_t(Read32(p)) * PRIME_1;
+      h = Rotl(h, 23) * PRIME_2 + PRIME_3;
+      p += 4;
+      size -= 4;
+    }
+    for (; size > 0; ++p, --size) {
+      h ^= *p * PRIME_5;
+      h = Rotl(h, 11) * PRIME_1;
+    }
+    h ^= h >> 33;
+    h *= PRIME_2;
+    h ^= h >> 29;
+    h *= PRIME_3;
+    h ^= h >> 32;
+    return h;
+  }
+
+ private:
+  static constexpr const uint64_t PRIME_1 = 0x9E3779B185EBCA87ULL;
+  static constexpr const uint64_t PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+  static constexpr const uint64_t PRIME_3 = 0x165667B19E3779F9ULL;
+  static constexpr const uint64_t PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+  static constexpr const uint64_t PRIME_5 = 0x27D4EB2F165667C5ULL;
+
+  static uint64_t Rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  static uint64_t Round(uint64_t acc, uint64_t input) {
+    return Rotl(acc + input * PRIME_2, 31) * PRIME_1;
+  }
+
+  // Little-endian hosts only, like the rest of the tool.
+  static uint64_t Read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+  }
+
+  static uint32_t Read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+  }
+
+  void Stripe(const uint8_t* p) {
+    for (int i = 0; i < 4; ++i) {
+      _v[i] = Round(_v[i], Read64(p + 8 * i));
+    }
+  }
+
+  uint64_t _v[4] = { PRIME_1 + PRIME_2, PRIME_2, 0, 0 - PRIME_1 };
+  uint64_t _total = 0;
+  uint8_t  _buffer[32];
+  size_t   _buffered = 0;
+};
+
+/* A running digest of one stream of bytes. */
+class Digest {
+ public:
+  explicit Digest(Algorithm algorithm) : _algorithm(algorithm) {
+#ifdef DUMP2TAR_OPENSSL
+    if (_algorithm == Algorithm::SHA256) {
+      _sha256 = EVP_MD_CTX_new();
+      if (!_sha256 || !EVP_DigestInit_ex(_sha256, EVP_sha256(), nullptr)) {
+        std::cerr << "Cannot initialize SHA-256" << std::endl;
+        abort();
+      }
+    }
+#endif
+  }
+
+  ~Digest() {
+#ifdef DUMP2TAR_OPENSSL
+    EVP_MD_CTX_free(_sha256);
+#endif
+  }
+
+  Digest(const Digest&) = delete;
+  Digest& operator=(const Digest&) = delete;
+
+  void Update(const char* data, size_t size) {
+    switch (_algorithm) {
+      case Algorithm::XXH64:
+        _xxh64.Update(data, size);
+        break;
+#ifdef DUMP2TAR_OPENSSL
+      case Algorithm::SHA256:
+        EVP_DigestUpdate(_sha256, data, size);
+        break;
+#endif
+    }
+  }
+
+  void UpdateZeros(uint64_t size) {
+    static const char zeros[64 << 10] = {};
+    while (size > 0) {
+      const size_t amount = std::min<uint64_t>(size, sizeof zeros);
+      Update(zeros, amount);
+      size -= amount;
+    }
+  }
+
+  /* The digest in hexadecimal. No Update() after this. */
+  std::string Hex() {
+    unsigned char bytes[64];
+    unsigned size = 0;
+    switch (_algorithm) {
+      case Algorithm::XXH64: {
+        // Big-endian, as xxh64sum prints it.
+        const uint64_t h = _xxh64.Final();
+        for (; size < 8; ++size) {
+          bytes[size] = h >> (56 - 8 * size);
+        }
+        break;
+      }
+#ifdef DUMP2TAR_OPENSSL
+      case Algorithm::SHA256:
+        EVP_DigestFinal_ex(_sha256, bytes, &size);
+        break;
+#endif
+    }
+    static const char HEX[] = "0123456789abcdef";
+    std::string hex;
+    for (unsigned i = 0; i < size; ++i) {
+      hex.push_back(HEX[bytes[i] >> 4]);
+      hex.push_back(HEX[bytes[i] & 0xF]);
+    }
+    return hex;
+  }
+
+ private:
+  const Algorithm _algorithm;
+  Xxh64           _xxh64;
+#ifdef DUMP2TAR_OPENSSL
+  EVP_MD_CTX*     _sha256 = nullptr;
+#endif
+};
+
+/* The line of `path` in a manifest checked with `sha256sum -c` or
+ * `xxh64sum -c`, the path as tar extracts it, without its leading '/'. Like
+ * these tools, a path with '\n' or '\\' is escaped and the line starts with
+ * '\\'. */
+inline std::string ManifestLine(const std::string& digest,
+                                const std::string& path) {
+  std::string name;
+  bool escaped = false;
+  for (size_t i = path[0] == '/' ? 1 : 0; i < path.size(); ++i) {
+    if (path[i] == '\n') {
+      name += "\\n";
+      escaped = true;
+    } else if (path[i] == '\\') {
+      name += "\\\\";
+      escaped = true;
+    } else {
+      name += path[i];
+    }
+  }
+  return (escaped ? "\\" : "") + digest + "  " + name + "\n";
+}
+
+/* Hashes streams of bytes on a pool of worker threads.
+ *
+ * Update() copies the bytes into chunks owned by the pool, so the caller
+ * can reuse its buffer right away. At most CHUNKS_PER_WORKER chunks per
+ * worker are waiting to be hashed: past that, Update() waits for one. The
+ * digest of a stream is sequential, each stream is hashed by one worker,
+ * the least busy one when it is begun, while the caller moves on to the
+ * next streams. The digests come out of Drain() in the order the streams
+ * were begun. */
+class HashPool {
+ public:
+  static constexpr const size_t CHUNK_SIZE = 1 << 20;
+  static constexpr const size_t CHUNKS_PER_WORKER = 4;
+
+  HashPool(Algorithm algorithm, size_t workers)
+      : _algorithm(algorithm), _queues(workers), _queued(workers),
+        _max_chunks(CHUNKS_PER_WORKER * workers) {
+    assert(workers > 0);
+    for (size_t i = 0; i < workers; ++i) {
+      _workers.emplace_back(&HashPool::WorkerLoop, this, i);
+    }
+  }
+
+  ~HashPool() {
+    Close();
+  }
+
+  /* Start the stream `name`, the following Update() calls go to it. */
+  void Begin(const std::string& name) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const size_t worker = std::min_element(_queued.begin(), _queued.end())
+                        - _queued.begin();
+    _streams.emplace_back(name, _algorithm, worker);
+    _current = &_streams.back();
+  }
+
+  /* Hash a copy of `size` bytes, which need not stay valid. */
+  void Update(const char* data, size_t size) {
+    while (size > 0) {
+      if (!_filling) {
+        _filling = AcquireChunk();
+      }
+      const size_t amount = std::min(size, CHUNK_SIZE - _filled);
+      memcpy(_filling + _filled, data, amount);
+      _filled += amount;
+      data += amount;
+      size -= amount;
+      if (_filled == CHUNK_SIZE) {
+        QueueFilling();
+      }
+    }
+  }
+
+  /* Hash `size` bytes in place, without a copy: they must stay valid until
+   * Close(), like the bytes of a mapped input. */
+  void UpdateInPlace(const char* data, size_t size) {
+    QueueFilling();
+    Queue(Task{ _current, data, size, nullptr, false });
+  }
+
+  /* Hash `size` zero bytes. */
+  void UpdateZeros(uint64_t size) {
+    QueueFilling();
+    Queue(Task{ _current, nullptr, size, nullptr, false });
+  }
+
+  void End() {
+    QueueFilling();
+    Queue(Task{ _current, nullptr, 0, nullptr, true });
+    _current = nullptr;
+  }
+
+  /* Add the stream `name` whose digest is already known. */
+  void Add(const std::string& name, const std::string& digest) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _streams.emplace_back(name, _algorithm, 0);
+    _streams.back().hex = digest;
+    _streams.back().done = true;
+  }
+
+  /* Wait until all the bytes given so far are hashed. */
+  void Wait() {
+    QueueFilling();
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_pending) {
+      ++_stalls;
+      _changed.wait(lock, [this] { return _pending == 0; });
+    }
+  }
+
+  /* Call `f(name, digest)` for the streams ended and hashed so far, in the
+   * order they were begun, stopping at the first one still being hashed. */
+  template <typename F>
+  void Drain(F f) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_streams.empty() && _streams.front().done) {
+      const Stream& stream = _streams.front();
+      f(stream.name, stream.hex);
+      _streams.pop_front();
+    }
+  }
+
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closed = true;
+      _changed.notify_all();
+    }
+    for (auto& worker : _workers) {
+      if (worker.joinable()) {
+        worker.join();
+      }
+    }
+  }
+
+  /* Times Update() waited for a chunk, or Wait() for the workers. */
+  uint64_t stalls() const {
+    return _stalls;
+  }
+
+  Algorithm algorithm() const {
+    return _algorithm;
+  }
+
+ private:
+  struct Stream {
+    Stream(const std::string& name, Algorithm algorithm, size_t worker)
+        : name(name), digest(algorithm), worker(worker) {
+    }
+
+    std::string name;
+    Digest      digest;  // Only touched by its worker.
+    size_t      worker;
+    std::string hex;     // Set once done.
+    bool        done = false;
+  };
+
+  struct Task {
+    Stream*     stream;
+    const char* data;   // nullptr for zeroes.
+    uint64_t    size;
+    char*       chunk;  // Owned by the pool, given back once hashed.
+    bool        end;
+  };
+
+  char* AcquireChunk() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_free.empty() && _chunks.size() == _max_chunks) {
+      ++_stalls;
+      _changed.wait(lock, [this] { return !_free.empty(); });
+    }
+    if (_free.empty()) {
+      _chunks.emplace_back(new char[CHUNK_SIZE]);
+      return _chunks.back().get();
+    }
+    char* chunk = _free.back();
+    _free.pop_back();
+    return chunk;
+  }
+
+  /* Queue the chunk being filled, if any. */
+  void QueueFilling() {
+    if (_filled) {
+      Queue(Task{ _current, _filling, _filled, _filling, false });
+      _filling = nullptr;
+      _filled = 0;
+    }
+  }
+
+  void Queue(const Task& task) {
+    assert(task.stream != nullptr);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _queues[task.stream->worker].push_back(task);
+    _queued[task.stream->worker] += task.size;
+    ++_pending;
+    _changed.notify_all();
+  }
+
+  void WorkerLoop(size_t worker) {
+    auto& queue = _queues[worker];
+    for (;;) {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _changed.wait(lock, [&] { return !queue.empty() || _closed; });
+        if (queue.empty()) {
+          break;
+        }
+        task = queue.front();
+        queue.pop_front();
+      }
+      std::string hex;
+      if (task.end) {
+        hex = task.stream->digest.Hex();
+      } else if (task.data) {
+        task.stream->digest.Update(task.data, task.size);
+      } else {
+        task.stream->digest.UpdateZeros(task.size);
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (task.end) {
+        task.stream->hex = hex;
+        task.stream->done = true;
+      }
+      if (task.chunk) {
+        _free.push_back(task.chunk);
+      }
+      _queued[worker] -= task.size;
+      --_pending;
+      _changed.notify_all();
+    }
+  }
+
+  const Algorithm               _algorithm;
+  std::vector<std::deque<Task>> _queues;  // One per worker.
+  std::vector<uint64_t>         _queued;  // Bytes in each queue.
+  std::vector<std::thread>      _workers;
+
+  // Only used by the thread calling Update().
+  char*                         _filling = nullptr;
+  size_t                        _filled = 0;
+
+  std::mutex                    _mutex;
+  std::condition_variable       _changed;
+  // Streams not drained yet. A deque keeps them in place as it grows.
+  std::deque<Stream>            _streams;
+  Stream*                       _current = nullptr;
+  const size_t                  _max_chunks;
+  std::vector<std::unique_ptr<char[]>> _chunks;
+  std::vector<char*>            _free;
+  uint64_t                      _pending = 0;  // Tasks not done yet.
+  bool                          _closed = false;
+  uint64_t                      _stalls = 0;
+};
+
+}  // namespace digest
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DIGEST_H_
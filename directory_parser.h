@@ -0,0 +1,318 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DIRECTORY_PARSER_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DIRECTORY_PARSER_H_
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "./dump_format.h"
+#include "./inode_table.h"
+
+namespace dump {
+
+/* Call `f(inode, name, name_len)` for the entries of a block of directory
+ * content, in order, without the unused entries, '.' and '..'. */
+template <typename F>
+void ForEachDirectoryEntry(const char* block, F f) {
+  for (const auto* begin = block; begin < block + BLOCK_SIZE;) {
+    const auto& entry = reinterpret_cast<
+        const format::DirectoryEntry&>(*begin);
+    const uint16_t record_length = entry.record_length;
+    if (record_length == 0) {
+      break;  // Corrupted, the rest of the block cannot be walked.
+    }
+    begin += record_length;
+    if (entry.inode_id == 0) {
+      continue;
+    }
+    if (entry.name_len <= 2 && entry.name[0] == '.'
+        && (entry.name_len == 1 || entry.name[1] == '.')) {
+      continue;
+    }
+    f(entry.inode_id, entry.name, entry.name_len);
+  }
+}
+
+/* Parses the blocks of directory content of stage 3 on a pool of worker
+ * threads, and adds their names to an InodeTable split in one shard per
+ * worker.
+ *
+ * Blocks are copied in batches of BATCH_BLOCKS, each parsed by one worker
+ * into lists of names that point into the batch, one list per shard. Worker
+ * `i` then adds the names of shard `i` of every batch to the table, in the
+ * order the batches were given, so the names of an inode come in the same
+ * order as when parsing inline. At most two batches per worker are in
+ * flight: past that, Add() waits for the oldest one. */
+class DirectoryParser {
+ public:
+  static constexpr const size_t BATCH_BLOCKS = 256;
+
+  DirectoryParser(size_t workers, InodeTable* names)
+      : _names(names), _inserts(workers) {
+    assert(workers > 0);
+    _names->SetShards(workers);
+    _max_in_flight = 2 * workers;
+    for (size_t i = 0; i < workers; ++i) {
+      _workers.emplace_back(&DirectoryParser::WorkerLoop, this, i);
+    }
+  }
+
+  ~DirectoryParser() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closed = true;
+    }
+    _ready.notify_all();
+    for (auto& worker : _workers) {
+      worker.join();
+    }
+  }
+
+  DirectoryParser(const DirectoryParser&) = delete;
+  DirectoryParser& operator=(const DirectoryParser&) = delete;
+
+  /* Copy a block of the content of `directory`, to be parsed later. */
+  void Add(const char* block, uint32_t directory) {
+    if (!_current) {
+      _current = NewBatch();
+    }
+    Batch& batch = *_current;
+    const size_t offset = batch.blocks.size();
+    batch.blocks.resize(offset + BLOCK_SIZE);
+    memcpy(&batch.blocks[offset], block, BLOCK_SIZE);
+    batch.directories.push_back(directory);
+    if (batch.directories.size() == BATCH_BLOCKS) {
+      Submit();
+      Advance(_in_flight.size() > _max_in_flight);
+    }
+  }
+
+  /* Parse and add all the blocks given so far. Cheap when there are none. */
+  void Flush() {
+    if (_current) {
+      Submit();
+    }
+    while (!_in_flight.empty()) {
+      Advance(true);
+    }
+  }
+
+  uint64_t batches() const {
+    return _batches;
+  }
+
+  /* Times Add() or Flush() had to wait for a batch to be parsed or added. */
+  uint64_t stalls() const {
+    return _stalls;
+  }
+
+ private:
+  struct Name {
+    uint32_t inode;
+    uint32_t directory;
+    uint32_t offset;    // Of the name, in `blocks`.
+    uint32_t name_len;
+  };
+
+  struct Batch {
+    enum State {
+      PARSING,    // Waiting for a worker, or being parsed.
+      PARSED,     // Waiting to be handed to the shards.
+      ADDING,     // In the queues of the shards, or being added.
+      DONE,
+    };
+
+    std::vector<char>              blocks;
+    std::vector<uint32_t>          directories;  // One per block.
+    std::vector<std::vector<Name>> names;        // One list per shard.
+    uint32_t                       max_inode = 0;
+    size_t                         shards_left = 0;
+    State                          state = PARSING;
+  };
+
+  std::unique_ptr<Batch> NewBatch() {
+    std::unique_ptr<Batch> batch;
+    if (_free.empty()) {
+      batch.reset(new Batch);
+      batch->blocks.reserve(BATCH_BLOCKS * BLOCK_SIZE);
+      batch->directories.reserve(BATCH_BLOCKS);
+      batch->names.resize(_workers.size());
+    } else {
+      batch = std::move(_free.back());
+      _free.pop_back();
+    }
+    return batch;
+  }
+
+  void Submit() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _todo.push_back(_current.get());
+      _in_flight.push_back(std::move(_current));
+      ++_batches;
+    }
+    _ready.notify_all();
+  }
+
+  /* Hand the batches parsed at the front to the shards, and recycle the ones
+   * added. If `wait`, wait until at least the oldest one is added. */
+  void Advance(bool wait) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+      // Batches go to the shards in the order they were given.
+      bool handed = false;
+      for (; _handed < _in_flight.size(); ++_handed) {
+        Batch* batch = _in_flight[_handed].get();
+        if (batch->state != Batch::PARSED) {
+          break;
+        }
+        if (!_names->Covers(batch->max_inode)) {
+          // Growing moves the table: only once the shards are idle.
+          if (_adding) {
+            break;
+          }
+          _names->Grow(batch->max_inode);
+        }
+        batch->state = Batch::ADDING;
+        batch->shards_left = _inserts.size();
+        for (auto& queue : _inserts) {
+          queue.push_back(batch);
+        }
+        ++_adding;
+        handed = true;
+      }
+      if (handed) {
+        _ready.notify_all();
+      }
+      bool recycled = false;
+      while (!_in_flight.empty()
+             && _in_flight.front()->state == Batch::DONE) {
+        Batch& batch = *_in_flight.front();
+        batch.blocks.clear();
+        batch.directories.clear();
+        for (auto& names : batch.names) {
+          names.clear();
+        }
+        batch.max_inode = 0;
+        batch.state = Batch::PARSING;
+        _free.push_back(std::move(_in_flight.front()));
+        _in_flight.pop_front();
+        --_handed;
+        recycled = true;
+      }
+      if (recycled || !wait || _in_flight.empty()) {
+        return;
+      }
+      ++_stalls;
+      _changed.wait(lock);
+    }
+  }
+
+  void Parse(Batch* batch) {
+    const char* blocks = batch->blocks.data();
+    for (size_t i = 0; i < batch->directories.size(); ++i) {
+      const uint32_t directory = batch->directories[i];
+      ForEachDirectoryEntry(blocks + i * BLOCK_SIZE,
+          [&](uint32_t inode, const char* name, size_t name_len) {
+        batch->names[_names->ShardOf(inode)].push_back(
+            Name{ inode, directory, uint32_t(name - blocks),
+                  uint32_t(name_len) });
+        batch->max_inode = std::max(batch->max_inode, inode);
+      });
+    }
+  }
+
+  void Insert(const Batch& batch, size_t shard) {
+    for (const Name& name : batch.names[shard]) {
+      _names->AddToShard(shard, name.inode, name.directory,
+                         &batch.blocks[name.offset], name.name_len);
+    }
+  }
+
+  /* Adds the names of shard `shard`, and parses batches meanwhile. */
+  void WorkerLoop(size_t shard) {
+    std::deque<Batch*>& inserts = _inserts[shard];
+    for (;;) {
+      Batch* batch;
+      bool insert;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _ready.wait(lock, [&] {
+          return !inserts.empty() || !_todo.empty() || _closed;
+        });
+        insert = !inserts.empty();
+        if (insert) {
+          batch = inserts.front();
+          inserts.pop_front();
+        } else if (!_todo.empty()) {
+          batch = _todo.front();
+          _todo.pop_front();
+        } else {
+          return;
+        }
+      }
+      if (insert) {
+        Insert(*batch, shard);
+      } else {
+        Parse(batch);
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (!insert) {
+        batch->state = Batch::PARSED;
+      } else if (--batch->shards_left == 0) {
+        batch->state = Batch::DONE;
+        --_adding;
+      }
+      _changed.notify_one();
+    }
+  }
+
+  InodeTable*                         _names;
+  size_t                              _max_in_flight;
+  std::vector<std::thread>            _workers;
+
+  // Only used by the thread calling Add() and Flush().
+  std::unique_ptr<Batch>              _current;
+  std::vector<std::unique_ptr<Batch>> _free;
+  uint64_t                            _batches = 0;
+  uint64_t                            _stalls = 0;
+
+  std::mutex                          _mutex;
+  std::condition_variable             _ready;    // Work for the workers.
+  std::condition_variable             _changed;  // A batch parsed or added.
+  std::deque<std::unique_ptr<Batch>>  _in_flight;  // In the order given.
+  size_t                              _handed = 0;  // Of _in_flight, to
+                                                    // the shards.
+  size_t                              _adding = 0;  // Batches in the shards.
+  std::deque<Batch*>                  _todo;     // To parse.
+  std::vector<std::deque<Batch*>>     _inserts;  // To add, one per shard.
+  bool                                _closed = false;
+};
+
+constexpr const size_t DirectoryParser::BATCH_BLOCKS;
+
+}  // namespace dump
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DIRECTORY_PARSER_H_
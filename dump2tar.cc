@@ -12,60 +12,1043 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
 #include <list>
+#include <memory>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <iostream>
 #include <istream>
 
+#include "./catalog.h"
+#include "./dedup.h"
+#include "./digest.h"
+#include "./dump_index.h"
+#include "./extract.h"
+#include "./input_buffer.h"
+#include "./output_buffer.h"
+#include "./path_filter.h"
+#include "./tar_index.h"
 #include "./tar_writer.h"
 #include "./dump_reader.h"
 
-int main() {
-  char blank[512];
-  memset(blank, 0, sizeof blank);
+namespace {
+
+/* Shards finishing on their own writer threads while the next ones are
+ * written, before the oldest one is waited for. */
+constexpr const size_t FINISHING_SHARDS = 4;
+
+void Usage(const char* argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [options] [input.dump] > output.tar\n"
+            << "  input.dump    dump file, mapped in memory when it is a regular"
+            << " file (default: stdin)\n"
+            << "  -b read_size  bytes per read(2) call, accepts K/M/G suffixes"
+            << " (default: " << io::DEFAULT_READ_SIZE << ")\n"
+            << "  -p depth      read and write on their own threads, with"
+            << " rings of `depth` buffers\n"
+            << "  -H format     tar headers: pax (default), ustar or gnu\n"
+            << "  -T times      times kept in pax headers, comma separated:"
+            << " atime,ctime,subsec or none (default: all)\n"
+            << "  -z codec      compress the output with gzip"
+#ifdef DUMP2TAR_ZSTD
+            << " or zstd"
+#endif
+            << ", as in gzip:9 to set the level\n"
+            << "  -j workers    compression, hashing and directory parsing"
+            << " threads (default: one per CPU)\n"
+            << "  -P            parse the directories of stage 3 and build the"
+            << " tree on the -j threads\n"
+            << "  -I index      write a member index of the archive to the"
+            << " `index` file\n"
+            << "  -i pattern    only write the paths matching the glob, or any"
+            << " of the globs\n"
+            << "                of a file with -i @file. Can be repeated\n"
+            << "  -e pattern    do not write the paths matching the glob, or"
+            << " -e @file\n"
+            << "  -X index      write an index of the dump records to the"
+            << " `index` file, no archive\n"
+            << "  -R index      only read the records of the selected paths,"
+            << " found in the `index`\n"
+            << "                file of an earlier -X run\n"
+            << "  -l            write a catalog of the inodes as JSON lines,"
+            << " no archive\n"
+            << "  -x directory  restore the files under `directory`, no"
+            << " archive\n"
+            << "  -S digest     hash the content of the files with xxh64"
+#ifdef DUMP2TAR_OPENSSL
+            << " or sha256"
+#endif
+            << ",\n"
+            << "                as in xxh64:pax to also add it to their pax"
+            << " headers\n"
+            << "  -M manifest   write the digests to the `manifest` file\n"
+            << "  -D budget     write the files with the content of an earlier"
+            << " one as hardlinks\n"
+            << "                to it, with about `budget` bytes of"
+            << " fingerprints, accepts K/M/G,\n"
+            << "                after comparing them; on a pipe, with"
+            << " -S sha256 only\n"
+            << "  -V size       cut the archive in shards of about `size`"
+            << " bytes, accepts K/M/G\n"
+            << "  -O prefix     write the shards to prefix.0000.tar,"
+            << " prefix.0001.tar...\n"
+#ifdef DUMP2TAR_IO_URING
+            << "  -u depth      read and write with io_uring, `depth` requests"
+            << " in flight each way\n"
+#endif
+            << std::flush;
+}
+
+/* Parse "4096", "512K", "4M", "1G" as a number of bytes, 0 on error. */
+size_t ParseSize(const char* str) {
+  char* end;
+  const unsigned long long v = strtoull(str, &end, 10);
+  switch (*end) {
+    case '\0': return v;
+    case 'k': case 'K': return end[1] ? 0 : v << 10;
+    case 'm': case 'M': return end[1] ? 0 : v << 20;
+    case 'g': case 'G': return end[1] ? 0 : v << 30;
+  }
+  return 0;
+}
+
+/* The file of the shard `shard`, as in "prefix.0001.tar.gz". */
+std::string ShardPath(const char* prefix, size_t shard, bool compress,
+                      io::Codec codec) {
+  char number[32];
+  snprintf(number, sizeof number, ".%04zu.tar", shard);
+  std::string path = std::string(prefix) + number;
+  if (compress) {
+    path += codec == io::Codec::GZIP ? ".gz" : ".zst";
+  }
+  return path;
+}
+
+/* Make the directory `path` of `dir_fd` and the missing ones above it. */
+bool MakeDirectories(int dir_fd, const std::string& path) {
+  for (size_t end = path.find('/'); ; end = path.find('/', end + 1)) {
+    const std::string prefix = path.substr(0, end);
+    if (!prefix.empty() && mkdirat(dir_fd, prefix.c_str(), 0700) != 0
+        && errno != EEXIST) {
+      return false;
+    }
+    if (end == std::string::npos) {
+      return true;
+    }
+  }
+}
+
+/* Parse "pax", "ustar" or "gnu". */
+bool ParseHeaderFormat(const char* str, tar::HeaderFormat* format) {
+  if (strcmp(str, "pax") == 0) {
+    *format = tar::HeaderFormat::PAX;
+  } else if (strcmp(str, "ustar") == 0) {
+    *format = tar::HeaderFormat::USTAR;
+  } else if (strcmp(str, "gnu") == 0) {
+    *format = tar::HeaderFormat::GNU;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/* Parse "gzip" or "zstd", optionally followed by ":<level>". */
+bool ParseCompression(const char* str, io::Codec* codec, int* level) {
+  const char* end = strchrnul(str, ':');
+  const std::string name(str, end);
+  if (name == "gzip") {
+    *codec = io::Codec::GZIP;
+    *level = 6;
+#ifdef DUMP2TAR_ZSTD
+  } else if (name == "zstd") {
+    *codec = io::Codec::ZSTD;
+    *level = 3;
+#endif
+  } else {
+    return false;
+  }
+  if (*end) {
+    char* level_end;
+    *level = strtol(end + 1, &level_end, 10);
+    if (level_end == end + 1 || *level_end) {
+      return false;
+    }
+    if (*codec == io::Codec::GZIP && (*level < 1 || *level > 9)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Parse "xxh64" or "sha256", optionally followed by ":pax". */
+bool ParseDigest(const char* str, digest::Algorithm* algorithm, bool* pax) {
+  const char* end = strchrnul(str, ':');
+  const std::string name(str, end);
+  if (name == "xxh64") {
+    *algorithm = digest::Algorithm::XXH64;
+#ifdef DUMP2TAR_OPENSSL
+  } else if (name == "sha256") {
+    *algorithm = digest::Algorithm::SHA256;
+#endif
+  } else {
+    return false;
+  }
+  *pax = *end != '\0';
+  return !*end || strcmp(end + 1, "pax") == 0;
+}
+
+/* Parse "none" or a comma separated list of "atime", "ctime" and "subsec". */
+bool ParseKeptTimes(const char* str, tar::HeaderPolicy* policy) {
+  policy->keep_atime = false;
+  policy->keep_ctime = false;
+  policy->keep_subsecond_mtime = false;
+  if (strcmp(str, "none") == 0) {
+    return true;
+  }
+  for (const char* begin = str;;) {
+    const char* end = strchrnul(begin, ',');
+    const std::string item(begin, end);
+    if (item == "atime") {
+      policy->keep_atime = true;
+    } else if (item == "ctime") {
+      policy->keep_ctime = true;
+    } else if (item == "subsec") {
+      policy->keep_subsecond_mtime = true;
+    } else {
+      return false;
+    }
+    if (!*end) {
+      return true;
+    }
+    begin = end + 1;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  size_t read_size = io::DEFAULT_READ_SIZE;
+  size_t pipeline_depth = 0;
+  size_t uring_depth = 0;
+  tar::HeaderPolicy header_policy;
+  bool compress = false;
+  io::Codec codec = io::Codec::GZIP;
+  int compression_level = 0;
+  size_t compression_workers = std::max(1u, std::thread::hardware_concurrency());
+  const char* index_path = nullptr;
+  dump::PathFilter filter;
+  const char* dump_index_path = nullptr;
+  const char* restore_index_path = nullptr;
+  bool catalog = false;
+  bool parse_directories = false;
+  const char* extract_path = nullptr;
+  bool hash = false;
+  digest::Algorithm digest_algorithm = digest::Algorithm::XXH64;
+  bool digest_in_pax = false;
+  const char* manifest_path = nullptr;
+  size_t dedup_budget = 0;
+  size_t shard_size = 0;
+  const char* shard_prefix = nullptr;
+
+  const char* options = "b:p:u:H:T:z:j:PI:i:e:X:R:lS:M:D:V:O:x:h";
+  for (int opt; (opt = getopt(argc, argv, options)) != -1;) {
+    switch (opt) {
+      case 'b':
+        read_size = ParseSize(optarg);
+        if (read_size < dump::BLOCK_SIZE) {
+          std::cerr << "Invalid read size: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'p':
+        pipeline_depth = strtoul(optarg, nullptr, 10);
+        if (pipeline_depth == 0) {
+          std::cerr << "Invalid pipeline depth: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'H':
+        if (!ParseHeaderFormat(optarg, &header_policy.format)) {
+          std::cerr << "Invalid header format: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'T':
+        if (!ParseKeptTimes(optarg, &header_policy)) {
+          std::cerr << "Invalid times: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'z':
+        if (!ParseCompression(optarg, &codec, &compression_level)) {
+          std::cerr << "Invalid compression: " << optarg << std::endl;
+          return 1;
+        }
+        compress = true;
+        break;
+      case 'I':
+        index_path = optarg;
+        break;
+      case 'X':
+        dump_index_path = optarg;
+        break;
+      case 'R':
+        restore_index_path = optarg;
+        break;
+      case 'l':
+        catalog = true;
+        break;
+      case 'P':
+        parse_directories = true;
+        break;
+      case 'x':
+        extract_path = optarg;
+        break;
+      case 'S':
+        if (!ParseDigest(optarg, &digest_algorithm, &digest_in_pax)) {
+          std::cerr << "Invalid digest: " << optarg << std::endl;
+          return 1;
+        }
+        hash = true;
+        break;
+      case 'M':
+        manifest_path = optarg;
+        break;
+      case 'D':
+        dedup_budget = ParseSize(optarg);
+        if (dedup_budget == 0) {
+          std::cerr << "Invalid dedup budget: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'V':
+        shard_size = ParseSize(optarg);
+        if (shard_size == 0) {
+          std::cerr << "Invalid shard size: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'O':
+        shard_prefix = optarg;
+        break;
+      case 'i':
+      case 'e': {
+        bool read = true;
+        if (optarg[0] == '@') {
+          read = opt == 'i' ? filter.IncludeFrom(optarg + 1)
+                            : filter.ExcludeFrom(optarg + 1);
+        } else if (opt == 'i') {
+          filter.Include(optarg);
+        } else {
+          filter.Exclude(optarg);
+        }
+        if (!read) {
+          std::cerr << "Cannot read patterns from " << optarg + 1
+            << std::endl;
+          return 1;
+        }
+        break;
+      }
+      case 'j':
+        compression_workers = strtoul(optarg, nullptr, 10);
+        if (compression_workers == 0) {
+          std::cerr << "Invalid number of workers: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+#ifdef DUMP2TAR_IO_URING
+      case 'u':
+        uring_depth = strtoul(optarg, nullptr, 10);
+        if (uring_depth == 0) {
+          std::cerr << "Invalid io_uring depth: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+#endif
+      default:
+        Usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (pipeline_depth && uring_depth) {
+    std::cerr << "-p and -u are mutually exclusive" << std::endl;
+    return 1;
+  }
+  if (dump_index_path
+      && (compress || index_path || restore_index_path || !filter.empty())) {
+    std::cerr << "-X writes no archive, it excludes -z, -I, -R, -i and -e"
+      << std::endl;
+    return 1;
+  }
+  if (catalog && (dump_index_path || index_path)) {
+    std::cerr << "-l writes no archive, it excludes -X and -I" << std::endl;
+    return 1;
+  }
+  if (hash && (catalog || dump_index_path)) {
+    std::cerr << "-S hashes the content of the archive, it excludes -l and -X"
+      << std::endl;
+    return 1;
+  }
+  if (hash != (manifest_path || digest_in_pax) && !(hash && dedup_budget)) {
+    std::cerr << "-S needs -M, :pax or -D, -M needs -S" << std::endl;
+    return 1;
+  }
+  // Alone, -S only picks the digest of -D.
+  hash = manifest_path || digest_in_pax;
+  if (dedup_budget && (catalog || dump_index_path)) {
+    std::cerr << "-D links members of the archive, it excludes -l and -X"
+      << std::endl;
+    return 1;
+  }
+  if (extract_path
+      && (compress || index_path || catalog || dump_index_path || hash
+          || dedup_budget || shard_size)) {
+    std::cerr << "-x writes no archive, it excludes -z, -I, -l, -X, -S, -D"
+      << " and -V" << std::endl;
+    return 1;
+  }
+  if (bool(shard_size) != bool(shard_prefix)) {
+    std::cerr << "-V needs -O, -O needs -V" << std::endl;
+    return 1;
+  }
+  if (shard_size && (catalog || dump_index_path || index_path)) {
+    std::cerr << "-V cuts the archive in shards, it excludes -l, -X and -I"
+      << std::endl;
+    return 1;
+  }
+  if (digest_in_pax && header_policy.format != tar::HeaderFormat::PAX) {
+    std::cerr << ":pax needs the pax header format" << std::endl;
+    return 1;
+  }
+
+  int input_fd = STDIN_FILENO;
+  if (optind + 1 == argc) {
+    input_fd = open(argv[optind], O_RDONLY);
+    if (input_fd < 0) {
+      std::cerr << "Cannot open " << argv[optind] << ": " << strerror(errno)
+        << std::endl;
+      return 1;
+    }
+  } else if (optind != argc) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  int index_fd = -1;
+  if (index_path) {
+    index_fd = open(index_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (index_fd < 0) {
+      std::cerr << "Cannot open " << index_path << ": " << strerror(errno)
+        << std::endl;
+      return 1;
+    }
+  }
+
+  int dump_index_fd = -1;
+  if (dump_index_path) {
+    dump_index_fd = open(dump_index_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dump_index_fd < 0) {
+      std::cerr << "Cannot open " << dump_index_path << ": "
+        << strerror(errno) << std::endl;
+      return 1;
+    }
+  }
+
+  int extract_fd = -1;
+  if (extract_path) {
+    if (mkdir(extract_path, 0755) != 0 && errno != EEXIST) {
+      std::cerr << "Cannot create " << extract_path << ": " << strerror(errno)
+        << std::endl;
+      return 1;
+    }
+    extract_fd = open(extract_path, O_RDONLY | O_DIRECTORY);
+    if (extract_fd < 0) {
+      std::cerr << "Cannot open " << extract_path << ": " << strerror(errno)
+        << std::endl;
+      return 1;
+    }
+  }
+
+  std::ofstream manifest;
+  if (manifest_path) {
+    manifest.open(manifest_path, std::ios::out | std::ios::trunc);
+    if (!manifest) {
+      std::cerr << "Cannot open " << manifest_path << std::endl;
+      return 1;
+    }
+  }
 
-  tar::StreamWriter tar;
+  tar::StreamWriter tar(header_policy);
 
-  tar::StreamWriter::Result tar_result;
+  tar::StreamWriter::Result tar_result = {};
+  std::vector<char> header;  // Reused by every AddFile().
   bool copying_file = false;
+  bool sparse_file = false;  // Its holes are not part of the content.
+  std::vector<dump::Region> regions;
   std::unordered_map<uint32_t, tar::File> dirs;
+  // With -V, the shard + 1 each directory was last written to: they stay in
+  // `dirs`, to be written again in every shard with files below them.
+  std::unordered_map<uint32_t, size_t> dir_shards;
+  // The other names of the file being copied, written as hardlinks to its
+  // first name once its content is out: tar extracts a hardlink by linking
+  // to a file it already extracted.
+  tar::File hardlink;
+  uint32_t hardlink_inode = 0;
+  std::vector<std::string> pending_hardlinks;
+  tar::IndexWriter index;
+  std::vector<dump::Path> selected;  // Names of the current file.
+  uint64_t filtered_files = 0;
+  uint64_t filtered_bytes = 0;
+  dump::IndexWriter dump_index;
+  // With -R, the [begin, end) spans of the dump to read, one per inode to
+  // restore, and the END record. They are jumped to after the TAPE record,
+  // once it matches the one of the index.
+  std::vector<std::pair<uint64_t, uint64_t>> restore;
+  size_t restore_position = 0;
+  uint64_t restore_end = 0;
+  int32_t restore_dump_date = 0;
+  int32_t restore_volume = 0;
+  // With -l, the directories of stage 3, listed once their paths are all
+  // known.
+  std::vector<dump::Inode> catalog_dirs;
+  std::vector<dump::Path> catalog_paths;
+  std::string catalog_line;
+  uint64_t catalog_inodes = 0;
+  // With -S, the hashing is done on the side by the workers, reading the
+  // content in the input buffer as it is copied. Only with :pax is a file
+  // hashed before its headers, reading it ahead.
+  std::unique_ptr<digest::HashPool> hasher;
+  uint64_t hash_left = 0;  // Bytes of the current file still to hash,
+                           // holes included.
+  std::vector<char> digest_buffer;
+  uint64_t digests_not_in_pax = 0;
+  uint64_t hashed_files = 0;
+  // With -D, the fingerprints of the files written, from the same hashing.
+  std::unique_ptr<digest::DedupTable> dedup;
+  uint64_t dedup_files = 0;
+  uint64_t dedup_bytes = 0;
+  uint64_t dedup_out_of_reach = 0;
+  uint64_t dedup_mismatches = 0;
+
+  // With -x, the content of the files goes to the workers as it is read.
+  // Directories are made once stage 3 is over, with their attributes set
+  // at the end, once nothing is written in them anymore.
+  std::unique_ptr<io::ExtractPool> extractor;
+  std::vector<dump::Inode> extract_dirs;
+  std::vector<std::pair<std::string, size_t>> extract_dir_paths;
+  bool extract_dirs_made = false;
+  uint64_t extract_left = 0;  // Bytes of the current file still to come,
+                              // holes included.
+  uint64_t extract_offset = 0;
+  uint64_t extracted_files = 0;
+  uint64_t extracted_bytes = 0;
+  uint64_t extracted_links = 0;
+  const bool extract_chown = geteuid() == 0;
+
+  // With -V, the shards before the current one, still being written.
+  size_t shard = 0;
+  uint64_t shard_start = 0;  // Of the current shard, in the archive.
+  std::deque<std::pair<std::unique_ptr<io::OutputBuffer>, int>>
+      finishing_shards;
+  // With -z, the compression threads, shared by the shards.
+  std::shared_ptr<io::CompressorPool> compressor_pool;
 
   dump::StreamReader reader;
-  char buf[dump::BLOCK_SIZE];
-  reader.SetBlock(buf);
-  size_t offset = 0;
+  if (parse_directories && !restore_index_path) {
+    reader.ParseDirectoriesOn(compression_workers);
+  }
+  io::InputBuffer input(input_fd, read_size);
+  int output_fd = STDOUT_FILENO;
+  if (shard_size) {
+    const std::string path = ShardPath(shard_prefix, 0, compress, codec);
+    output_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+      std::cerr << "Cannot open " << path << ": " << strerror(errno)
+        << std::endl;
+      return 1;
+    }
+  }
+  std::unique_ptr<io::OutputBuffer> output(new io::OutputBuffer(output_fd));
+
+  if (restore_index_path) {
+    // Everything is decided from the index: its directory tree is given to
+    // the reader, stage 3 and the inodes left out are never read.
+    dump::IndexReader restore_index;
+    if (!restore_index.Open(restore_index_path)) {
+      std::cerr << "Cannot read the dump index " << restore_index_path
+        << std::endl;
+      return 1;
+    }
+    restore_index.ForEachName([&reader](uint32_t inode, uint32_t parent_inode,
+                                        const char* name, size_t name_len) {
+      reader.AddName(inode, parent_inode, name, name_len);
+    });
+    for (size_t i = 0; i < restore_index.size(); ++i) {
+      const auto entry = restore_index.At(i);
+      if (entry.inode == 2) {
+        continue;
+      }
+      if (dump::Mode::Type(entry.type) == dump::Mode::Type::DIRECTORY) {
+        // Only its record, its content is in the index already.
+        if (filter.empty() || filter.SelectedDirectory(&reader, entry.inode)) {
+          restore.emplace_back(entry.record_offset,
+                               entry.record_offset + dump::BLOCK_SIZE);
+        }
+        continue;
+      }
+      const auto links = reader.ResolvePaths(entry.inode);
+      bool any = filter.empty();
+      for (auto it = links.begin(); !any && it != links.end(); ++it) {
+        any = filter.Selected(&reader, it.name());
+      }
+      if (any) {
+        restore.emplace_back(entry.record_offset, entry.end_offset);
+      } else if (!links.empty()) {
+        ++filtered_files;
+        filtered_bytes += entry.size;
+      }
+    }
+    std::cerr << "restoring " << restore.size() << " of "
+      << restore_index.size() << " inodes" << std::endl;
+    restore.emplace_back(restore_index.end_record_offset(), 0);
+    restore_end = dump::BLOCK_SIZE;
+    restore_dump_date = restore_index.dump_date();
+    restore_volume = restore_index.volume();
+  }
+
+  // Write the headers of `file`, the result has no header if it cannot be
+  // represented.
+  auto write_entry = [&](const tar::File& file, uint32_t inode) {
+    const uint64_t offset = tar.stats().total();
+    const auto result = tar.AddFile(file, &header);
+    if (result.header) {
+      output->Write(result.header, result.header_size);
+      if (index_fd >= 0) {
+        index.Add(file, inode, offset, offset + result.header_size);
+      }
+    } else {
+      std::cerr << "cannot be represented, skipped: " << file.filename
+        << std::endl;
+    }
+    return result;
+  };
+  auto write_hardlinks = [&] {
+    for (const auto& path : pending_hardlinks) {
+      hardlink.filename = path;
+      write_entry(hardlink, hardlink_inode);
+    }
+    pending_hardlinks.clear();
+  };
+  // With -V, write the directory `dir` and the ones above it that are not in
+  // the current shard yet, top down.
+  auto write_shard_dirs = [&](uint32_t dir) {
+    std::vector<uint32_t> missing;
+    for (uint32_t d = dir; d != 2;) {
+      const auto written = dir_shards.find(d);
+      if (written != dir_shards.end() && written->second == shard + 1) {
+        break;
+      }
+      missing.push_back(d);
+      dump::InodeTable::Name name;
+      if (!reader.names().Find(d, &name)) {
+        break;
+      }
+      d = name.parent_inode;
+    }
+    for (auto d = missing.rbegin(); d != missing.rend(); ++d) {
+      const auto it = dirs.find(*d);
+      if (it == dirs.end()) {
+        continue;
+      }
+      if (!filter.empty() && !filter.SelectedDirectory(&reader, *d)) {
+        dirs.erase(it);
+        continue;
+      }
+      const auto links = reader.ResolvePaths(*d);
+      if (!links.empty()) {
+        it->second.filename = links.front();
+        write_entry(it->second, *d);
+        dir_shards[*d] = shard + 1;
+      }
+    }
+  };
+  // Account for `size` bytes of content written, finishing the file once
+  // all of it is.
+  auto end_of_content = [&](size_t size) {
+    tar_result.content_size -= size;
+    if (tar_result.content_size == 0) {
+      output->WriteZeros(tar_result.padding);
+      copying_file = false;
+      write_hardlinks();
+    }
+  };
+  auto write_catalog_line = [&](const dump::Inode& inode,
+                                const std::vector<dump::Path>& paths) {
+    catalog_line.clear();
+    dump::CatalogWriter::AppendLine(inode, paths, &catalog_line);
+    output->Write(catalog_line.data(), catalog_line.size());
+    ++catalog_inodes;
+  };
+  auto write_catalog_dirs = [&] {
+    for (const auto& inode : catalog_dirs) {
+      if (!filter.empty()
+          && !filter.SelectedDirectory(&reader, inode.inode_id)) {
+        continue;
+      }
+      const auto links = reader.ResolvePaths(inode.inode_id);
+      catalog_paths.clear();
+      for (const auto& path : links) {
+        catalog_paths.push_back(path);
+      }
+      write_catalog_line(inode, catalog_paths);
+    }
+    catalog_dirs.clear();
+  };
+  // The paths of the directories, parents first, made writable for now.
+  auto make_extract_dirs = [&] {
+    if (extract_dirs_made) {
+      return;
+    }
+    extract_dirs_made = true;
+    for (size_t i = 0; i < extract_dirs.size(); ++i) {
+      const uint32_t inode = extract_dirs[i].inode_id;
+      if (!filter.empty() && !filter.SelectedDirectory(&reader, inode)) {
+        continue;
+      }
+      const auto links = reader.ResolvePaths(inode);
+      if (!links.empty()) {
+        extract_dir_paths.emplace_back(links.front().str().substr(1), i);
+      }
+    }
+    std::sort(extract_dir_paths.begin(), extract_dir_paths.end());
+    for (const auto& dir : extract_dir_paths) {
+      if (!MakeDirectories(extract_fd, dir.first)) {
+        std::cerr << "Cannot create " << dir.first << ": " << strerror(errno)
+          << std::endl;
+        abort();
+      }
+    }
+  };
+  auto end_of_extract = [&](uint64_t size) {
+    extract_left -= size;
+    if (extract_left == 0) {
+      extractor->End();
+    }
+  };
+  auto write_digests = [&] {
+    hasher->Drain([&](const std::string& path, const std::string& hex) {
+      if (manifest_path) {
+        manifest << digest::ManifestLine(hex, path);
+      }
+      if (dedup) {
+        dedup->Hashed(path, hex);
+      }
+      ++hashed_files;
+    });
+  };
+  // Account for `size` bytes of the current file hashed.
+  auto end_of_hash = [&](uint64_t size) {
+    hash_left -= size;
+    if (hash_left == 0) {
+      hasher->End();
+      write_digests();
+    }
+  };
+  // Hash the file whose INODE was just read from what follows in the dump,
+  // without consuming it. Return false if it is not all available.
+  auto hash_ahead = [&](uint64_t file_size, std::string* hex) {
+    digest::Digest digest(digest_algorithm);
+    if (file_size > 0) {
+      digest_buffer.resize(1 << 20);
+      const bool all = reader.WalkContent(
+          [&input](uint64_t ahead, size_t size, char* out) {
+            return input.Peek(ahead, size, out);
+          },
+          [&](uint64_t, uint64_t size, uint64_t ahead) {
+            if (ahead == dump::StreamReader::HOLE) {
+              digest.UpdateZeros(size);
+              return true;
+            }
+            while (size > 0) {
+              const size_t amount = std::min<uint64_t>(size,
+                                                       digest_buffer.size());
+              if (!input.Peek(ahead, amount, digest_buffer.data())) {
+                return false;
+              }
+              digest.Update(digest_buffer.data(), amount);
+              ahead += amount;
+              size -= amount;
+            }
+            return true;
+          });
+      if (!all) {
+        return false;
+      }
+    }
+    *hex = digest.Hex();
+    return true;
+  };
+  // The hash of the first bytes of the file whose INODE was just read, like
+  // hash_ahead().
+  auto prefix_ahead = [&](uint64_t file_size, uint64_t* prefix) {
+    char data[digest::DedupTable::PREFIX_SIZE];
+    digest::Xxh64 xxh64;
+    uint64_t left = std::min(file_size, digest::DedupTable::PREFIX_SIZE);
+    reader.WalkContent(
+        [&input](uint64_t ahead, size_t size, char* out) {
+          return input.Peek(ahead, size, out);
+        },
+        [&](uint64_t, uint64_t size, uint64_t ahead) {
+          const size_t amount = std::min(size, left);
+          if (ahead == dump::StreamReader::HOLE) {
+            memset(data, 0, amount);
+          } else if (!input.Peek(ahead, amount, data)) {
+            return false;
+          }
+          xxh64.Update(data, amount);
+          left -= amount;
+          return left > 0;
+        });
+    *prefix = xxh64.Final();
+    return left == 0;
+  };
+  // With -D, whether the file whose INODE was just read has the content of
+  // the one whose INODE record is at `target` of the dump, comparing the
+  // bytes of both read again from the dump.
+  std::vector<dump::ContentRun> runs;
+  std::vector<dump::ContentRun> target_runs;
+  std::vector<char> compare_buffer;
+  auto same_content = [&](uint64_t target) {
+    auto peek_at = [&input](uint64_t offset, size_t size, char* out) {
+      return input.PeekAt(offset, size, out);
+    };
+    const uint64_t here = input.offset();
+    runs.clear();
+    target_runs.clear();
+    if (!reader.WalkContent(
+            [&](uint64_t ahead, size_t size, char* out) {
+              return peek_at(here + ahead, size, out);
+            },
+            [&](uint64_t offset, uint64_t size, uint64_t ahead) {
+              runs.push_back(dump::ContentRun{
+                  offset, size,
+                  ahead == dump::StreamReader::HOLE ? ahead : here + ahead });
+              return true;
+            })
+        || !dump::StreamReader::WalkContentAt(target, peek_at,
+            [&](uint64_t offset, uint64_t size, uint64_t at) {
+              target_runs.push_back(dump::ContentRun{ offset, size, at });
+              return true;
+            })) {
+      return false;
+    }
+    constexpr const size_t CHUNK = 64 << 10;
+    compare_buffer.resize(2 * CHUNK);
+    char* a = compare_buffer.data();
+    char* b = a + CHUNK;
+    auto read_run = [&](const dump::ContentRun& run, uint64_t position,
+                        size_t size, char* out) {
+      if (run.at == dump::StreamReader::HOLE) {
+        memset(out, 0, size);
+        return true;
+      }
+      return peek_at(run.at + position - run.offset, size, out);
+    };
+    uint64_t position = 0;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < runs.size() && j < target_runs.size()) {
+      const auto& x = runs[i];
+      const auto& y = target_runs[j];
+      const size_t amount = std::min<uint64_t>(
+          std::min(x.offset + x.size, y.offset + y.size) - position, CHUNK);
+      if (!read_run(x, position, amount, a)
+          || !read_run(y, position, amount, b)
+          || memcmp(a, b, amount) != 0) {
+        return false;
+      }
+      position += amount;
+      i += position == x.offset + x.size;
+      j += position == y.offset + y.size;
+    }
+    return i == runs.size() && j == target_runs.size();
+  };
+  if (hash || dedup_budget) {
+    hasher.reset(new digest::HashPool(digest_algorithm, compression_workers));
+  }
+  if (dedup_budget) {
+    dedup.reset(new digest::DedupTable(dedup_budget,
+                                       digest::Size(digest_algorithm)));
+  }
+  // File content is written by reference to the input buffer. The hashers
+  // get a copy of it, unless the input is mapped.
+  input.SetRefillHook([&output, &extractor] {
+    output->Flush();
+    if (extractor) {
+      extractor->Wait();
+    }
+  });
+  if (extract_path) {
+    extractor.reset(new io::ExtractPool(compression_workers));
+  }
+  // Set up `out` as -u, -p and -z say. A shard always gets a writer thread,
+  // to finish while the next one is being written.
+  auto start_output = [&](io::OutputBuffer* out) {
+    bool started = false;
+#ifdef DUMP2TAR_IO_URING
+    if (uring_depth && !compress) {
+      started = out->StartUring(uring_depth);
+      if (!started) {
+        std::cerr << "io_uring not available for output, using write(2)"
+          << std::endl;
+      }
+    }
+#endif
+    if (compress) {
+      // Has its own writer thread.
+      if (!compressor_pool) {
+        compressor_pool = std::make_shared<io::CompressorPool>(
+            codec, compression_level, compression_workers);
+      }
+      out->StartCompressor(compressor_pool);
+    } else if (!started && (pipeline_depth || shard_size)) {
+      out->StartWriter(pipeline_depth ? pipeline_depth : 2);
+    }
+  };
+  // End the current shard and start the next one.
+  auto next_shard = [&] {
+    output->WriteZeros(tar.Close().padding);
+    output->Flush();
+    finishing_shards.emplace_back(std::move(output), output_fd);
+    if (finishing_shards.size() > FINISHING_SHARDS) {
+      finishing_shards.front().first->Close();
+      close(finishing_shards.front().second);
+      finishing_shards.pop_front();
+    }
+    ++shard;
+    const std::string path = ShardPath(shard_prefix, shard, compress, codec);
+    output_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+      std::cerr << "Cannot open " << path << ": " << strerror(errno)
+        << std::endl;
+      abort();
+    }
+    output.reset(new io::OutputBuffer(output_fd));
+    start_output(output.get());
+    shard_start = tar.stats().total();
+    if (dedup) {
+      // Links only work within a shard.
+      dedup.reset(new digest::DedupTable(dedup_budget,
+                                         digest::Size(digest_algorithm)));
+    }
+  };
+  if (input_fd != STDIN_FILENO) {
+    input.Map();
+  }
+#ifdef DUMP2TAR_IO_URING
+  if (uring_depth) {
+    if (!input.mapped() && !input.StartUring(uring_depth)) {
+      std::cerr << "io_uring not available for input, using read(2)"
+        << std::endl;
+    }
+  }
+#endif
+  if (pipeline_depth && !input.mapped()) {
+    input.StartReader(pipeline_depth);
+  }
+  // A file is only linked once its content is compared to the one of the
+  // first file, read again from the dump. When it cannot be, only a digest
+  // as large as SHA-256 is trusted not to collide.
+  if (dedup_budget && !input.rereadable()
+      && digest::Size(digest_algorithm) < 32) {
+    std::cerr << "-D on a dump that cannot be read again (a pipe, -p or -u)"
+      << " needs -S sha256" << std::endl;
+    return 1;
+  }
+  start_output(output.get());
+  // The reader is given all that is buffered at once, see NextBatch(). The
+  // input is consumed in step with the actions, as they are acted on.
+  std::vector<dump::BatchAction> actions;
+  size_t next_action = 0;
+  uint64_t batch_offset = 0;  // Of the span of the batch in the dump.
+  uint64_t batch_end = 0;     // Where the reader stopped.
+  uint64_t batches = 0;
   while (42) {
-    auto action = reader.Next();
+    if (next_action == actions.size()) {
+      // The blocks the reader went through after the last action.
+      if (input.offset() < batch_end) {
+        input.Consume(batch_end - input.offset());
+      }
+      if (reader.block_wanted() && restore_position < restore.size()
+          && input.offset() == restore_end) {
+        // Done with the records of an inode, on to the next one to restore.
+        if (restore_position == 0
+            && (reader.dump_date() != restore_dump_date
+                || reader.volume() != restore_volume)) {
+          std::cerr << "The dump index " << restore_index_path
+            << " is of another dump: date " << restore_dump_date
+            << " volume " << restore_volume << ", the dump has date "
+            << reader.dump_date() << " volume " << reader.volume()
+            << std::endl;
+          abort();
+        }
+        const auto& span = restore[restore_position++];
+        reader.JumpToInode();
+        input.Skip(span.first - input.offset());
+        restore_end = span.second;
+      }
+      // At least a block when the reader waits for one, nothing is read
+      // otherwise.
+      size_t size;
+      const char* span = input.Buffered(
+          reader.block_wanted() ? dump::BLOCK_SIZE : 0, &size);
+      if (restore_position < restore.size()) {
+        // Not past the records of the inode being restored.
+        size = std::min<uint64_t>(size, restore_end - input.offset());
+      }
+      batch_offset = input.offset();
+      batch_end = batch_offset
+                + reader.NextBatch(span, size, batch_offset, &actions);
+      next_action = 0;
+      ++batches;
+      continue;
+    }
+    const auto& batch_action = actions[next_action++];
+    // The blocks the reader went through up to the action.
+    input.Consume(batch_offset + batch_action.offset - input.offset());
+    const auto& action = batch_action.action;
     // std::cout << "action: " << action.kind << std::endl;
     switch (action.kind) {
       case dump::NextAction::FEED_BLOCK:
-        // std::cout << "offset: " << offset << "\n";
-        std::cin.read(buf, sizeof buf);
-        if (!std::cin) {
-          std::cerr << "Read error" << std::endl;
-          abort();
-        }
-        offset += sizeof buf;
-        break;
+        break;  // Done by NextBatch().
       case dump::NextAction::SKIP:
-        // std::cerr << "SKIP, before @(" << offset << ") " << action.skip.size
-        // << std::endl;
-        for (auto remaining = action.skip.size; remaining > 0;) {
-          auto amount = std::min(sizeof buf, remaining);
-          std::cin.read(buf, amount);
-          if (!std::cin) {
-            std::cerr << "Read error" << std::endl;
-            abort();
-          }
-          offset += amount;
-          remaining -= amount;
-        }
-        // std::cerr << "SKIP, after @(" << offset << ")" << std::endl;
+        // std::cerr << "SKIP, before @(" << input.offset() << ") "
+        // << action.skip.size << std::endl;
+        input.Skip(action.skip.size);
+        // std::cerr << "SKIP, after @(" << input.offset() << ")" << std::endl;
         break;
       case dump::NextAction::INODE: {
         // std::cerr << "Got " << action.inode << std::endl;
         const auto& inode = action.inode;
 
+        if (dump_index_fd >= 0) {
+          // Listing only, the content is skipped.
+          dump_index.AddInode(inode, batch_action.record);
+          break;
+        }
+
         if (inode.hardlink_cnt == 0) {
           break;
         }
@@ -74,15 +1057,111 @@ int main() {
           break;  // ignore root inode.
         }
 
-        auto links = reader.ResolvePaths(inode.inode_id);
+        // The path of a directory is only resolved once it is written: in
+        // stage 3 the names may still be parsed on the workers.
         std::string filename = "N/A";
-        if (links.empty()
-            && inode.mode.type != dump::Mode::Type::DIRECTORY) {
-          std::cerr << "ABORT: Shit no names: " << inode << std::endl;
-          abort();
+        if (inode.mode.type != dump::Mode::Type::DIRECTORY) {
+          auto links = reader.ResolvePaths(inode.inode_id);
+          if (links.empty()) {
+            std::cerr << "ABORT: Shit no names: " << inode << std::endl;
+            abort();
+          }
+          // The names that pass the filters, the first one gets the content.
+          selected.clear();
+          for (auto it = links.begin(); it != links.end(); ++it) {
+            if (filter.empty() || filter.Selected(&reader, it.name())) {
+              selected.push_back(*it);
+            }
+          }
+          if (selected.empty()) {
+            // Its content is skipped.
+            ++filtered_files;
+            filtered_bytes += inode.size;
+            break;
+          }
+          filename = selected.front();
         }
-        if (!links.empty()) {
-          filename = links.back();
+
+        if (catalog) {
+          // Its content is skipped.
+          if (inode.mode.type == dump::Mode::Type::DIRECTORY) {
+            catalog_dirs.push_back(inode);
+          } else {
+            write_catalog_dirs();
+            write_catalog_line(inode, selected);
+          }
+          break;
+        }
+
+        std::string content_hex;  // Known before the headers.
+        bool dedup_candidate = false;
+        digest::DedupTable::Key dedup_key;
+        if (extract_path) {
+          if (inode.mode.type == dump::Mode::Type::DIRECTORY) {
+            extract_dirs.push_back(inode);
+            break;
+          }
+          make_extract_dirs();
+          if (inode.mode.type != dump::Mode::Type::REGULAR) {
+            std::cerr << "not restored, not a regular file: " << filename
+              << std::endl;
+            break;
+          }
+          const std::string path = filename.substr(1);
+          const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW
+                          | O_CLOEXEC;
+          int fd = openat(extract_fd, path.c_str(), flags, 0600);
+          if (fd < 0 && errno == ENOENT) {
+            // Below a directory left out by the filters.
+            MakeDirectories(extract_fd, path.substr(0, path.rfind('/')));
+            fd = openat(extract_fd, path.c_str(), flags, 0600);
+          }
+          if (fd < 0) {
+            std::cerr << "Cannot create " << path << ": " << strerror(errno)
+              << std::endl;
+            break;  // Its content is skipped.
+          }
+          // Unless its map says otherwise, the holes of the file are left to
+          // its writes.
+          bool holes = true;
+          if (inode.size > 0
+              && !reader.ScanContent(
+                  [&input](uint64_t ahead, size_t size, char* out) {
+                    return input.Peek(ahead, size, out);
+                  }, &regions, &holes)) {
+            holes = true;
+          }
+          extractor->Begin(fd, inode.size, holes, io::FileAttributes{
+            .uid      = inode.uid,
+            .gid      = inode.gid,
+            .perms    = uint16_t(inode.mode.perms_value),
+            .atime_us = inode.atime_us,
+            .mtime_us = inode.mtime_us,
+            .chown    = extract_chown,
+          });
+          for (size_t i = 1; i < selected.size(); ++i) {
+            const std::string link = selected[i].str().substr(1);
+            if (linkat(extract_fd, path.c_str(), extract_fd, link.c_str(), 0)
+                != 0) {
+              if (errno == EEXIST) {
+                unlinkat(extract_fd, link.c_str(), 0);
+              } else if (errno == ENOENT) {
+                MakeDirectories(extract_fd, link.substr(0, link.rfind('/')));
+              }
+              if (linkat(extract_fd, path.c_str(), extract_fd, link.c_str(),
+                         0) != 0) {
+                std::cerr << "Cannot link " << link << ": " << strerror(errno)
+                  << std::endl;
+                continue;
+              }
+            }
+            ++extracted_links;
+          }
+          ++extracted_files;
+          extract_left = inode.size;
+          extract_offset = 0;
+          end_of_extract(0);
+          break;
         }
 
         tar::File f{
@@ -90,9 +1169,9 @@ int main() {
           .size      = 0,
           .uid       = inode.uid,
           .gid       = inode.gid,
-          .mtime     = inode.mtime_us / 1000000.,
-          .atime     = inode.atime_us / 1000000.,
-          .ctime     = inode.ctime_us / 1000000.,
+          .mtime_us  = inode.mtime_us,
+          .atime_us  = inode.atime_us,
+          .ctime_us  = inode.ctime_us,
         };
 
         switch (inode.mode.type) {
@@ -121,14 +1200,9 @@ int main() {
         }
 
         if (inode.mode.type == dump::Mode::Type::DIRECTORY) {
-          if (links.size()) {
-            f.filename = links.back() + "/";
-          } else {
-            f.filename = "NOT_KNOWN";
-          }
+          f.filename = "NOT_KNOWN";  // Resolved when written.
         } else {
-          assert(links.size());
-          f.filename = links.back();
+          f.filename = filename;
         }
 
         switch (inode.mode.type) {
@@ -143,7 +1217,99 @@ int main() {
             break;
           case dump::Mode::Type::REGULAR:
             f.size = inode.size;
-            copying_file = true;
+            if (inode.size > 0
+                && header_policy.format == tar::HeaderFormat::PAX) {
+              // Keep the holes out of the archive when the whole map can be
+              // known upfront. Otherwise they are written as zeroes.
+              bool holes;
+              if (reader.ScanContent(
+                      [&input](uint64_t ahead, size_t size, char* out) {
+                        return input.Peek(ahead, size, out);
+                      }, &regions, &holes) && holes) {
+                for (const auto& region : regions) {
+                  f.sparse.push_back({ region.offset, region.size });
+                }
+                if (f.sparse.empty()
+                    || f.sparse.back().offset + f.sparse.back().size
+                       < inode.size) {
+                  f.sparse.push_back({ inode.size, 0 });
+                }
+              }
+            }
+            if (shard_size && tar.stats().total() > shard_start) {
+              // Never split a member, it starts the next shard if it would
+              // not fit in this one.
+              uint64_t member = inode.size;
+              if (!f.sparse.empty()) {
+                member = 0;
+                for (const auto& entry : f.sparse) {
+                  member += entry.size;
+                }
+              }
+              // With its headers, and the end of the archive.
+              member = (member + 511) / 512 * 512 + 5 * 512;
+              if (tar.stats().total() - shard_start + member > shard_size) {
+                next_shard();
+              }
+            }
+            if (digest_in_pax) {
+              if (hash_ahead(inode.size, &content_hex)) {
+                // As an extended attribute, which tar knows how to restore.
+                f.pax_records.emplace_back(
+                    std::string("SCHILY.xattr.user.dump2tar.")
+                        + digest::Name(digest_algorithm),
+                    content_hex);
+              } else {
+                ++digests_not_in_pax;
+              }
+            }
+            dedup_key = digest::DedupTable::Key{ inode.size, 0, inode.uid,
+                                                 inode.gid,
+                                                 inode.mode.perms_value };
+            if (dedup && inode.size >= digest::DedupTable::MIN_SIZE
+                && prefix_ahead(inode.size, &dedup_key.prefix)) {
+              dedup_candidate = true;
+              if (!dedup->MayMatch(dedup_key)) {
+                break;  // Hashed as it is copied, if added.
+              }
+              if (content_hex.empty()
+                  && !hash_ahead(inode.size, &content_hex)) {
+                ++dedup_out_of_reach;
+                break;
+              }
+              if (dedup->pending()) {
+                hasher->Wait();
+                write_digests();
+              }
+              size_t target_len;
+              uint64_t target_record;
+              const char* target = dedup->Find(dedup_key, content_hex,
+                                               &target_len, &target_record);
+              if (target && input.rereadable()
+                  && !same_content(target_record)) {
+                ++dedup_mismatches;
+                dedup_candidate = false;
+                target = nullptr;
+              }
+              if (target) {
+                // The same content was written already, link to it.
+                uint64_t content = inode.size;
+                if (!f.sparse.empty()) {
+                  content = 0;
+                  for (const auto& entry : f.sparse) {
+                    content += entry.size;
+                  }
+                }
+                ++dedup_files;
+                dedup_bytes += content;
+                dedup_candidate = false;
+                f.type = tar::FileType::LINK;
+                f.linkname.assign(target, target_len);
+                f.size = 0;
+                f.sparse.clear();
+                f.pax_records.clear();
+              }
+            }
             break;
           case dump::Mode::Type::FIFO:
             std::cerr << "fifo !implemented " << filename << std::endl;
@@ -170,21 +1336,29 @@ int main() {
         // end of the tar archive.
         if (inode.mode.type == dump::Mode::Type::DIRECTORY) {
           std::cerr << "ready to use directory entry #" << inode.inode_id
-            << " - " << filename << std::endl;
+            << std::endl;
           dirs.insert(std::make_pair(inode.inode_id, f));
         } else {
           for (auto parent_inode : reader.Parents(inode.inode_id)) {
+            if (shard_size) {
+              // Every shard has the directories above its files.
+              write_shard_dirs(parent_inode);
+              continue;
+            }
             auto it = dirs.find(parent_inode);
             if (it != dirs.end()) {
+              if (!filter.empty()
+                  && !filter.SelectedDirectory(&reader, parent_inode)) {
+                dirs.erase(it);
+                continue;
+              }
               auto links = reader.ResolvePaths(parent_inode);
               if (!links.empty()) {
-                const auto& filename = links.back();
+                const std::string filename = links.front();
                 std::cerr << "flushing directory entry #" << parent_inode
                   << " - " << filename << std::endl;
                 it->second.filename = filename;
-                auto tar_result = tar.AddFile(it->second);
-                std::cout.write(tar_result.buffer.data(),
-                    tar_result.buffer.size());
+                write_entry(it->second, parent_inode);
                 dirs.erase(it);
               } else {
                 std::cerr << "directory !yet resolved #" << parent_inode
@@ -193,16 +1367,46 @@ int main() {
             }
           }
 
-          tar_result = tar.AddFile(f);
-          std::cout.write(tar_result.buffer.data(), tar_result.buffer.size());
-        }
-
-        if (!links.empty()) {
-          links.pop_back();
-        }
-
-        if (!links.empty()) {
-          std::cerr << "hardlinks !implemented" << filename << std::endl;
+          tar_result = write_entry(f, inode.inode_id);
+          if (tar_result.header) {
+            copying_file = tar_result.content_size > 0;
+            sparse_file = !f.sparse.empty();
+            // Every file with -S, only the new fingerprints otherwise.
+            bool hash_content = hash && f.type == tar::FileType::REGULAR;
+            if (dedup_candidate
+                && dedup->Add(dedup_key, f.filename, content_hex,
+                              input.offset() - dump::BLOCK_SIZE)) {
+              hash_content = true;
+            }
+            if (!content_hex.empty()) {
+              if (hash) {
+                hasher->Add(f.filename, content_hex);
+                write_digests();
+              }
+            } else if (hash_content) {
+              hasher->Begin(f.filename);
+              hash_left = inode.size;
+              end_of_hash(0);
+            }
+            if (selected.size() > 1) {
+              hardlink = f;
+              hardlink_inode = inode.inode_id;
+              hardlink.type = tar::FileType::LINK;
+              hardlink.size = 0;
+              hardlink.sparse.clear();
+              hardlink.pax_records.clear();
+              hardlink.linkname = f.type == tar::FileType::LINK ? f.linkname
+                                                                : f.filename;
+              for (size_t i = 1; i < selected.size(); ++i) {
+                pending_hardlinks.push_back(selected[i].str());
+              }
+              if (!copying_file) {
+                write_hardlinks();
+              }
+            }
+          } else {
+            copying_file = false;
+          }
         }
 done:
         break;
@@ -212,59 +1416,143 @@ done:
                   // << action.data.size
                   // << " " << action.data.content_size
                   // << std::endl;
-        for (auto remaining = action.data.size; remaining > 0;) {
-          auto amount = std::min(sizeof buf, remaining);
-          std::cin.read(buf, amount);
-          if (!std::cin) {
-            std::cerr << "Read error" << std::endl;
+        if (copying_file) {
+          if (tar_result.content_size < action.data.size) {
+            std::cerr << "Dafuk you didn't read enough! "
+              << action.data.size << "/" << tar_result.content_size
+              << std::endl;
             abort();
           }
-
-          if (copying_file) {
-            if (tar_result.content_size < remaining) {
-              std::cerr << "Dafuk you didn't read enough! "
-                << remaining << "/" << tar_result.content_size
-                << std::endl;
-              abort();
-            }
-            std::cout.write(buf, amount);
-            tar_result.content_size -= amount;
-
-            if (tar_result.content_size == 0) {
-              std::cout.write(blank, tar_result.padding);
-              copying_file = 0;
-            }
+          if (hash_left) {
+            output->Transfer(&input, action.data.size,
+                            [&](const char* data, size_t size) {
+              if (input.mapped()) {
+                hasher->UpdateInPlace(data, size);
+              } else {
+                hasher->Update(data, size);
+              }
+            });
+            end_of_hash(action.data.size);
+          } else {
+            output->Transfer(&input, action.data.size);
           }
-
-          offset += amount;
-          remaining -= amount;
+          end_of_content(action.data.size);
+        } else if (extract_left) {
+          for (size_t size = action.data.size; size > 0;) {
+            size_t amount;
+            const char* data = input.ReadSome(size, &amount);
+            extractor->Write(data, amount, extract_offset);
+            extract_offset += amount;
+            size -= amount;
+          }
+          extracted_bytes += action.data.size;
+          end_of_extract(action.data.size);
+        } else {
+          input.Skip(action.data.size);
         }
-        for (auto remaining = action.data.padding; remaining > 0;) {
-          auto amount = std::min(sizeof buf, remaining);
-          std::cin.read(buf, amount);
-          if (!std::cin) {
-            std::cerr << "Read error" << std::endl;
+        input.Skip(action.data.padding);
+        break;
+      case dump::NextAction::HOLE:
+        if (extract_left) {
+          // Already zeroes in the file.
+          extract_offset += action.hole.size;
+          end_of_extract(action.hole.size);
+        }
+        if (hash_left) {
+          hasher->UpdateZeros(action.hole.size);
+          end_of_hash(action.hole.size);
+        }
+        // Left out of a sparse entry, spelled out otherwise.
+        if (copying_file && !sparse_file) {
+          if (tar_result.content_size < action.hole.size) {
+            std::cerr << "Dafuk you didn't read enough! "
+              << action.hole.size << "/" << tar_result.content_size
+              << std::endl;
             abort();
           }
-          offset += amount;
-          remaining -= amount;
+          output->WriteZeros(action.hole.size);
+          end_of_content(action.hole.size);
         }
         break;
       case dump::NextAction::DONE:
-        // std::cerr << "DONE (" << offset << ")" << std::endl;
         // reader.PrintTree(std::cerr);
-        std::cerr << "DONE (" << offset << ")" << std::endl;
+        std::cerr << "DONE (" << input.offset() << ") in " << batches
+          << " batches" << std::endl;
+        if (dump_index_fd >= 0) {
+          dump_index.End(batch_action.record);
+          dump_index.Tape(reader.dump_date(), reader.volume());
+          dump_index.Write(dump_index_fd, reader.names());
+          close(dump_index_fd);
+          std::cerr << "dump index: " << dump_index.size() << " inodes"
+            << std::endl;
+          if (input.seeked()) {
+            std::cerr << "skipped with lseek: " << input.seeked() << " bytes"
+              << std::endl;
+          }
+          return 0;
+        }
+        if (extract_path) {
+          make_extract_dirs();
+          extractor->Close();
+          // Deepest first, a directory may lose its write permission.
+          for (auto it = extract_dir_paths.rbegin();
+               it != extract_dir_paths.rend(); ++it) {
+            const auto& dir = extract_dirs[it->second];
+            const char* path = it->first.c_str();
+            const struct timespec times[2] = {
+              io::ToTimespec(dir.atime_us), io::ToTimespec(dir.mtime_us),
+            };
+            if ((extract_chown
+                 && fchownat(extract_fd, path, dir.uid, dir.gid,
+                             AT_SYMLINK_NOFOLLOW) != 0)
+                || fchmodat(extract_fd, path, dir.mode.perms_value, 0) != 0
+                || utimensat(extract_fd, path, times, AT_SYMLINK_NOFOLLOW)
+                   != 0) {
+              std::cerr << "Cannot set the attributes of " << path << ": "
+                << strerror(errno) << std::endl;
+            }
+          }
+          close(extract_fd);
+          std::cerr << "restored " << extracted_files << " files, "
+            << extracted_bytes << " bytes, " << extract_dir_paths.size()
+            << " directories, " << extracted_links << " hardlinks, waits for"
+            << " the writers " << extractor->stalls() << std::endl;
+          if (filtered_files) {
+            std::cerr << "filtered out: " << filtered_files << " files, "
+              << filtered_bytes << " bytes" << std::endl;
+          }
+          if (input.seeked()) {
+            std::cerr << "skipped with lseek: " << input.seeked() << " bytes"
+              << std::endl;
+          }
+          return 0;
+        }
+        if (catalog) {
+          write_catalog_dirs();
+          output->Close();
+          std::cerr << "catalog: " << catalog_inodes << " inodes" << std::endl;
+          if (input.seeked()) {
+            std::cerr << "skipped with lseek: " << input.seeked() << " bytes"
+              << std::endl;
+          }
+          return 0;
+        }
         {
           for (auto dir : dirs) {
+            if (dir_shards.count(dir.first)) {
+              continue;
+            }
+            if (!filter.empty()
+                && !filter.SelectedDirectory(&reader, dir.first)) {
+              continue;
+            }
             auto links = reader.ResolvePaths(dir.first);
-            if (links.size()) {
-              const auto& filename = links.back();
+            if (!links.empty()) {
+              const std::string filename = links.front();
               std::cerr << "flushing directory entry #" << dir.first
                 << " - " << filename << std::endl;
               dir.second.filename = filename;
-              auto tar_result = tar.AddFile(dir.second);
-              std::cout.write(tar_result.buffer.data(),
-                  tar_result.buffer.size());
+              write_entry(dir.second, dir.first);
             } else {
               std::cerr << "directory entry never resolved #" << dir.first
                 << std::endl;
@@ -273,12 +1561,127 @@ done:
         }
         {
           auto r = tar.Close();
-          while (r.padding) {
-            const auto to_write = std::min(r.padding, sizeof blank);
-            std::cout.write(blank, to_write);
-            r.padding -= to_write;
+          output->WriteZeros(r.padding);
+        }
+        output->Close();
+        if (shard_size) {
+          close(output_fd);
+          for (auto& finishing : finishing_shards) {
+            finishing.first->Close();
+            close(finishing.second);
+          }
+          std::cerr << "shards: " << shard + 1 << std::endl;
+        }
+        if (hasher) {
+          hasher->Close();
+          write_digests();
+          manifest.close();
+          std::cerr << "hashed " << hashed_files << " files with "
+            << digest::Name(digest_algorithm) << ", waits for the hashers "
+            << hasher->stalls() << std::endl;
+          if (digests_not_in_pax) {
+            std::cerr << "digests left out of pax headers: "
+              << digests_not_in_pax << std::endl;
           }
         }
+        if (dedup) {
+          std::cerr << "dedup: " << dedup_files << " files linked, "
+            << dedup_bytes << " bytes of content saved, fingerprints of "
+            << dedup->size() << " files in " << dedup->used() << " bytes"
+            << std::endl;
+          if (dedup->rejected()) {
+            std::cerr << "dedup: fingerprints over budget, not kept: "
+              << dedup->rejected() << std::endl;
+          }
+          if (dedup_out_of_reach) {
+            std::cerr << "dedup: files not checked, content out of reach: "
+              << dedup_out_of_reach << std::endl;
+          }
+          if (dedup_mismatches) {
+            std::cerr << "dedup: same digest but not the same content, not"
+              << " linked: " << dedup_mismatches << std::endl;
+          }
+        }
+        if (index_fd >= 0) {
+          const auto* compressor = output->compressor();
+          index.Write(index_fd, compressor != nullptr,
+                      [compressor](uint64_t offset, uint64_t* frame_offset,
+                                   uint64_t* frame_start) {
+            // The last frame starting at or before `offset`.
+            const auto& frames = compressor->frames();
+            auto it = std::upper_bound(
+                frames.begin(), frames.end(), offset,
+                [](uint64_t o, const io::CompressingWriter::FrameOffset& f) {
+                  return o < f.uncompressed;
+                });
+            --it;
+            *frame_offset = it->compressed;
+            *frame_start = it->uncompressed;
+          });
+          close(index_fd);
+          std::cerr << "index: " << index.size() << " entries" << std::endl;
+        }
+        if (reader.directory_parser()) {
+          std::cerr << "directories parsed in "
+            << reader.directory_parser()->batches() << " batches, waits for"
+            << " the parsers " << reader.directory_parser()->stalls()
+            << std::endl;
+        }
+        {
+          const auto& stats = tar.stats();
+          std::cerr << "archive: " << stats.total() << " bytes, headers "
+            << stats.headers << ", extended headers " << stats.extended
+            << ", content " << stats.content << ", padding "
+            << stats.padding << std::endl;
+          if (stats.rejected) {
+            std::cerr << "entries not represented: " << stats.rejected
+              << std::endl;
+          }
+        }
+        if (filtered_files) {
+          std::cerr << "filtered out: " << filtered_files << " files, "
+            << filtered_bytes << " bytes" << std::endl;
+        }
+        if (input.seeked()) {
+          std::cerr << "skipped with lseek: " << input.seeked() << " bytes"
+            << std::endl;
+        }
+        if (output->writes()) {
+          std::cerr << "writev calls: " << output->writes() << std::endl;
+        }
+        if (output->kernel_copied()) {
+          std::cerr << "kernel copied " << output->kernel_copied() << " bytes"
+            << std::endl;
+        }
+        if (input.pipe()) {
+          std::cerr << "input stalls: waiting for the reader "
+            << input.pipe()->consumer_stalls() << ", reader waiting "
+            << input.pipe()->producer_stalls() << std::endl;
+        }
+        if (output->pipe()) {
+          std::cerr << "output stalls: waiting for the writer "
+            << output->pipe()->producer_stalls() << ", writer waiting "
+            << output->pipe()->consumer_stalls() << std::endl;
+        }
+        if (output->compressor()) {
+          const auto* compressor = output->compressor();
+          std::cerr << "compressed " << compressor->bytes_in() << " bytes to "
+            << compressor->bytes_out() << ", stored as is "
+            << compressor->bytes_stored() << std::endl;
+          std::cerr << "compression stalls: waiting for the workers "
+            << compressor->producer_stalls() << ", writer waiting "
+            << compressor->writer_stalls() << std::endl;
+        }
+#ifdef DUMP2TAR_IO_URING
+        if (input.uring()) {
+          std::cerr << "io_uring input waits: " << input.uring()->waits()
+            << std::endl;
+        }
+        if (output->uring()) {
+          std::cerr << "io_uring output waits: " << output->uring()->waits()
+            << std::endl;
+        }
+#endif
         return 0;
     }
   }
@@ -15,6 +15,7 @@
 #ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DUMP_FORMAT_H_
 #define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DUMP_FORMAT_H_
 
+#include "./checksum.h"
 #include "./common.h"
 #include "./endian_cpp.h"
 
@@ -123,14 +124,9 @@ struct Record: BigEndianStruct {
 
   bool Checksum() const {
     constexpr const int32_t checksum_seed = 84446;
-    const auto& as_bint32 = reinterpret_cast<
-        const bint32_t(&)[sizeof *this / sizeof (bint32_t)]
-        >(*this);
-    int32_t sum = 0;
-    for (auto v : as_bint32) {
-      sum += v;
-    }
-    return sum == checksum_seed;
+    // Sum of all the record as big-endian int32s.
+    return int32_t(checksum::SumBigEndian32(this, sizeof *this))
+        == checksum_seed;
   }
 
   bool IsMagicNFS() const {
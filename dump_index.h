@@ -0,0 +1,295 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DUMP_INDEX_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DUMP_INDEX_H_
+
+#include <endian.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <iostream>
+#include <vector>
+
+#include "./common.h"
+#include "./dump_reader.h"
+#include "./inode_table.h"
+
+namespace dump {
+
+/* Index of the records of a dump, to restore some files by seeking to their
+ * records instead of reading the dump up to them.
+ *
+ * The file is a header, one entry per INODE record in the order of the dump,
+ * the names of the directory tree of stage 3, then a string table of these
+ * names. The ADDR records and the data blocks of an inode follow its record,
+ * up to the next INODE or END record, so an entry only keeps where that span
+ * starts and ends. All the numbers are little-endian, the file can be mapped
+ * in memory, see IndexReader. */
+namespace index_format {
+
+constexpr const char MAGIC[8] = { 'D', '2', 'T', 'D', 'U', 'M', 'P', 'X' };
+constexpr const uint32_t VERSION = 2;
+
+struct Header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t flags;             // None yet.
+  uint64_t inode_count;
+  uint64_t inodes_offset;     // From the start of the file.
+  uint64_t name_count;
+  uint64_t names_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+  uint64_t end_record_offset;  // The END record, in the dump.
+  int32_t  dump_date;          // From the TAPE record of the dump, to tell
+  int32_t  volume;             // it from another one.
+  uint64_t reserved[2];
+};
+static_assert(sizeof (Header) == 96, "Wrong size for Header");
+
+struct Inode {
+  uint64_t record_offset;  // The INODE record, in the dump.
+  uint64_t end_offset;     // The next INODE or END record.
+  uint64_t size;
+  uint64_t mtime_us;
+  uint32_t inode;
+  uint32_t type;           // Mode::Type.
+};
+static_assert(sizeof (Inode) == 40, "Wrong size for Inode");
+
+/* A name of `inode` in the directory `parent_inode`, in the order of the
+ * directory entries, see InodeTable. */
+struct Name {
+  uint32_t inode;
+  uint32_t parent_inode;
+  uint64_t name;  // Offset in the string table << 8 | length.
+};
+static_assert(sizeof (Name) == 16, "Wrong size for Name");
+
+}  // namespace index_format
+
+/* Collects the INODE records as the dump is read, and writes the index once
+ * the END record is found. */
+class IndexWriter {
+ public:
+  /* The record of `inode` starts at `offset` of the dump. */
+  void AddInode(const Inode& inode, uint64_t offset) {
+    if (!_inodes.empty()) {
+      _inodes.back().end_offset = offset;
+    }
+    index_format::Inode entry;
+    memset(&entry, 0, sizeof entry);
+    entry.record_offset = offset;
+    entry.end_offset = offset;
+    entry.size = inode.size;
+    entry.mtime_us = inode.mtime_us;
+    entry.inode = inode.inode_id;
+    entry.type = uint32_t(inode.mode.type);
+    _inodes.push_back(entry);
+  }
+
+  /* The date and volume number of the TAPE record of the dump. */
+  void Tape(int32_t dump_date, int32_t volume) {
+    _dump_date = dump_date;
+    _volume = volume;
+  }
+
+  /* The END record starts at `offset`, after the last inode. */
+  void End(uint64_t offset) {
+    if (!_inodes.empty()) {
+      _inodes.back().end_offset = offset;
+    }
+    _end_record_offset = offset;
+  }
+
+  /* Write the index to `fd`, with the directory tree `names`. */
+  void Write(int fd, const InodeTable& names) {
+    using index_format::Inode;
+    using index_format::Name;
+    std::vector<Name> entries;
+    std::vector<char> strings;
+    names.ForEachInode([&](uint32_t inode) {
+      names.ForEachName(inode, [&](const InodeTable::Name& name) {
+        Name entry;
+        entry.inode = htole32(inode);
+        entry.parent_inode = htole32(name.parent_inode);
+        entry.name = htole64((uint64_t(strings.size()) << 8) | name.name_len);
+        strings.insert(strings.end(), name.name, name.name + name.name_len);
+        entries.push_back(entry);
+      });
+    });
+
+    index_format::Header header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, index_format::MAGIC, sizeof header.magic);
+    header.version = htole32(index_format::VERSION);
+    header.inode_count = htole64(_inodes.size());
+    header.inodes_offset = htole64(sizeof header);
+    const uint64_t names_offset = sizeof header
+                                + _inodes.size() * sizeof (Inode);
+    header.name_count = htole64(entries.size());
+    header.names_offset = htole64(names_offset);
+    header.strings_offset = htole64(names_offset
+                                    + entries.size() * sizeof (Name));
+    header.strings_size = htole64(strings.size());
+    header.end_record_offset = htole64(_end_record_offset);
+    header.dump_date = htole32(_dump_date);
+    header.volume = htole32(_volume);
+    WriteAll(fd, &header, sizeof header, "Index");
+
+    for (auto& entry : _inodes) {
+      entry = ToLittleEndian(entry);
+    }
+    WriteAll(fd, _inodes.data(), _inodes.size() * sizeof (Inode), "Index");
+    WriteAll(fd, entries.data(), entries.size() * sizeof (Name), "Index");
+    WriteAll(fd, strings.data(), strings.size(), "Index");
+  }
+
+  size_t size() const {
+    return _inodes.size();
+  }
+
+ private:
+  static index_format::Inode ToLittleEndian(index_format::Inode entry) {
+    entry.record_offset = htole64(entry.record_offset);
+    entry.end_offset = htole64(entry.end_offset);
+    entry.size = htole64(entry.size);
+    entry.mtime_us = htole64(entry.mtime_us);
+    entry.inode = htole32(entry.inode);
+    entry.type = htole32(entry.type);
+    return entry;
+  }
+
+  std::vector<index_format::Inode> _inodes;
+  uint64_t                         _end_record_offset = 0;
+  int32_t                          _dump_date = 0;
+  int32_t                          _volume = 0;
+};
+
+/* An index file mapped in memory. */
+class IndexReader {
+ public:
+  /* Return false if the file cannot be mapped or is not an index. */
+  bool Open(const char* path) {
+    if (!_file.Open(path, sizeof (Header))) {
+      return false;
+    }
+    const char* data = _file.data();
+    const size_t size = _file.size();
+    const Header& header = *reinterpret_cast<const Header*>(data);
+    const uint64_t inode_count = le64toh(header.inode_count);
+    const uint64_t inodes_offset = le64toh(header.inodes_offset);
+    const uint64_t name_count = le64toh(header.name_count);
+    const uint64_t names_offset = le64toh(header.names_offset);
+    const uint64_t strings_offset = le64toh(header.strings_offset);
+    const uint64_t strings_size = le64toh(header.strings_size);
+    // Like for the tar index, every term is bounded by the file size before
+    // it is added to.
+    if (memcmp(header.magic, index_format::MAGIC, sizeof header.magic) != 0
+        || le32toh(header.version) != index_format::VERSION
+        || inode_count > size / sizeof (Inode)
+        || inodes_offset > size
+        || inodes_offset + inode_count * sizeof (Inode) > names_offset
+        || name_count > size / sizeof (Name)
+        || names_offset > size
+        || names_offset + name_count * sizeof (Name) > strings_offset
+        || strings_offset > size
+        || strings_size > size - strings_offset) {
+      return false;
+    }
+    _inode_count = inode_count;
+    _inodes = reinterpret_cast<const Inode*>(data + inodes_offset);
+    _name_count = name_count;
+    _names = reinterpret_cast<const Name*>(data + names_offset);
+    _strings = data + strings_offset;
+    _strings_size = strings_size;
+    _end_record_offset = le64toh(header.end_record_offset);
+    _dump_date = le32toh(header.dump_date);
+    _volume = le32toh(header.volume);
+    return true;
+  }
+
+  size_t size() const {
+    return _inode_count;
+  }
+
+  /* The entry at `i`, numbers in host order. */
+  index_format::Inode At(size_t i) const {
+    index_format::Inode entry = _inodes[i];
+    entry.record_offset = le64toh(entry.record_offset);
+    entry.end_offset = le64toh(entry.end_offset);
+    entry.size = le64toh(entry.size);
+    entry.mtime_us = le64toh(entry.mtime_us);
+    entry.inode = le32toh(entry.inode);
+    entry.type = le32toh(entry.type);
+    return entry;
+  }
+
+  uint64_t end_record_offset() const {
+    return _end_record_offset;
+  }
+
+  /* Of the TAPE record of the indexed dump. */
+  int32_t dump_date() const {
+    return _dump_date;
+  }
+
+  int32_t volume() const {
+    return _volume;
+  }
+
+  size_t name_count() const {
+    return _name_count;
+  }
+
+  /* Call `f(inode, parent_inode, name, name_len)` for every name of the
+   * directory tree, in the order they were found. */
+  template <typename F>
+  void ForEachName(F f) const {
+    for (size_t i = 0; i < _name_count; ++i) {
+      const uint32_t inode = le32toh(_names[i].inode);
+      const uint32_t parent_inode = le32toh(_names[i].parent_inode);
+      const uint64_t name = le64toh(_names[i].name);
+      const size_t name_len = name & 0xFF;
+      if ((name >> 8) + name_len > _strings_size) {
+        std::cerr << "Corrupted index, name out of bounds" << std::endl;
+        abort();
+      }
+      f(inode, parent_inode, _strings + (name >> 8), name_len);
+    }
+  }
+
+ private:
+  using Header = index_format::Header;
+  using Inode = index_format::Inode;
+  using Name = index_format::Name;
+
+  MappedFile   _file;
+  size_t       _inode_count = 0;
+  const Inode* _inodes = nullptr;
+  size_t       _name_count = 0;
+  const Name*  _names = nullptr;
+  const char*  _strings = nullptr;
+  uint64_t     _strings_size = 0;
+  uint64_t     _end_record_offset = 0;
+  int32_t      _dump_date = 0;
+  int32_t      _volume = 0;
+};
+
+}  // namespace dump
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DUMP_INDEX_H_
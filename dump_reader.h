@@ -15,9 +15,13 @@
 #ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DUMP_READER_H_
 #define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DUMP_READER_H_
 
+#include "./directory_parser.h"
 #include "./dump_format.h"
+#include "./inode_table.h"
 
 #include <iostream>
+#include <memory>
+#include <string>
 #include <unordered_map>
 #include <vector>
 #include <cassert>
@@ -58,6 +62,9 @@ struct NextAction {
     DATA,         // A DATA section corresponding to the previous INODE should
                   // be consumed directly from the stream. More than one DATA
                   // section in a row is possible.
+    HOLE,         // A hole in the content of the previous INODE: zeroes
+                  // that are not in the stream. Comes between or after DATA
+                  // sections.
     SKIP,         // A section to be skipped without further processing.
     DONE,         // The dump reached the end.
   } kind;
@@ -70,15 +77,137 @@ struct NextAction {
       size_t padding; /* Padding to discard afterward. */
     } data;
 
+    struct { /* If action == HOLE */
+      size_t size;         /* Bytes of zeroes in the content. */
+    } hole;
+
     struct { /* If action == SKIP */
       size_t size;         /* Size bytes to discard from the stream */
     } skip;
   };
 };
 
-struct FileEntry {
-  std::string name;
-  uint32_t parent_inode;
+/* An action of StreamReader::NextBatch(), with where it is. */
+struct BatchAction {
+  NextAction action;  // Never FEED_BLOCK.
+  size_t     offset;  // In the span, where the input must be to act on it:
+                      // the start of the bytes of a DATA or SKIP, right
+                      // after the record of an INODE.
+  uint64_t   record;  // In the dump, the last record read, the one of an
+                      // INODE or the END record of a DONE.
+};
+
+/* A run of content of a file, as found with StreamReader::ScanContent(). */
+struct Region {
+  uint64_t offset;
+  uint64_t size;
+};
+
+/* A resolved path, made of the interned path of its directory, with a
+ * trailing '/', and its own name. Both point into the reader's memory and
+ * stay valid for the reader's lifetime. */
+struct Path {
+  const char* directory;
+  size_t      directory_len;  // 0 if the directory is not resolved (yet).
+  const char* name;
+  size_t      name_len;
+
+  void AppendTo(std::string* s) const {
+    s->append(directory, directory_len).append(name, name_len);
+  }
+
+  std::string str() const {
+    std::string s;
+    s.reserve(directory_len + name_len);
+    AppendTo(&s);
+    return s;
+  }
+
+  operator std::string () const {
+    return str();
+  }
+};
+
+inline std::ostream& operator<<(std::ostream& os, const Path& path) {
+  return os.write(path.directory, path.directory_len)
+           .write(path.name, path.name_len);
+}
+
+class StreamReader;
+
+/* All the paths of an inode, resolved lazily as they are iterated. */
+class Paths {
+ public:
+  class iterator {
+   public:
+    Path operator*() const;
+
+    iterator& operator++() {
+      ++_it;
+      return *this;
+    }
+
+    bool operator!=(const iterator& other) const {
+      return _it != other._it;
+    }
+
+    /* The name, before it is resolved to a path. */
+    InodeTable::Name name() const {
+      return *_it;
+    }
+
+   private:
+    friend class Paths;
+    iterator(StreamReader* reader, InodeTable::NameIterator it)
+        : _reader(reader), _it(it) {
+    }
+
+    StreamReader*            _reader;
+    InodeTable::NameIterator _it;
+  };
+
+  iterator begin() const {
+    return iterator(_reader, _table->NamesBegin(_inode));
+  }
+
+  iterator end() const {
+    return iterator(_reader, _table->NamesEnd());
+  }
+
+  bool empty() const {
+    return !(begin() != end());
+  }
+
+  size_t size() const {
+    size_t n = 0;
+    for (auto it = _table->NamesBegin(_inode); it != _table->NamesEnd(); ++it) {
+      ++n;
+    }
+    return n;
+  }
+
+  Path front() const {
+    assert(!empty());
+    return *begin();
+  }
+
+ private:
+  friend class StreamReader;
+  Paths(StreamReader* reader, const InodeTable* table, uint32_t inode)
+      : _reader(reader), _table(table), _inode(inode) {
+  }
+
+  StreamReader*     _reader;
+  const InodeTable* _table;
+  uint32_t          _inode;
+};
+
+/* `size` bytes at `offset` of a file, found at `at` of the dump, or zeroes
+ * when `at` is StreamReader::HOLE. */
+struct ContentRun {
+  uint64_t offset;
+  uint64_t size;
+  uint64_t at;
 };
 
 class StreamReader {
@@ -87,10 +216,20 @@ class StreamReader {
   StreamReader() {
   }
 
-  void SetBlock(char block[BLOCK_SIZE]) {
+  /* Point the reader at the next BLOCK_SIZE bytes of the dump. The block is
+   * read in place and must stay valid until the next call to Next(). */
+  void SetBlock(const char* block) {
     _block = block;
   }
 
+  /* Parse the directory content of stage 3 on `workers` threads instead of
+   * inline, see DirectoryParser. The names are all merged by the time the
+   * first inode of stage 4, or any path, is returned. */
+  void ParseDirectoriesOn(size_t workers) {
+    assert(_state == State::WAITING_FIRST_BLOCK);
+    _directory_parser.reset(new DirectoryParser(workers, &_names));
+  }
+
   NextAction Next() {
     switch (_state) {
       case State::WAITING_FIRST_BLOCK: {
@@ -103,6 +242,8 @@ class StreamReader {
           std::cerr << "Expecting TAPE record" << std::endl;
           abort();
         }
+        _dump_date = record.date;
+        _volume = record.volume_id;
         SetState(State::READING_CLRI_HEADER);
         return NextAction{ NextAction::FEED_BLOCK };
       }
@@ -133,6 +274,9 @@ class StreamReader {
       [[clang::fallthrough]];
       case State::SKIPPING_BITS_MAP: {
         auto record = Record();
+        // One bit per inode of the volume, size the inode table after it.
+        _bits_map_inodes += uint64_t(record.count) * BLOCK_SIZE * 8;
+        _names.Reserve(std::min<uint64_t>(_bits_map_inodes, UINT32_MAX));
         SetState(State::SKIPPING_BITS_MAP);
         WaitIfContinuationThenElse(State::SKIPPING_BITS_MAP,
                                    State::READING_ROOT_INODE);
@@ -150,7 +294,8 @@ class StreamReader {
           abort();
         }
         SetState(State::WAITING_DIRECTORY_CONTENT);
-        _reverse_tree.emplace(2, FileEntry { .name = "/", .parent_inode = 0 });
+        // Root names itself, with an empty name under "/".
+        _names.Add(2, 2, "", 0);
         _current_inode = record.inode_id;
         _blocks_left = record.count;
         return NextAction{ NextAction::INODE, .inode = ReadInodeInfo(record) };
@@ -161,26 +306,13 @@ class StreamReader {
       }
       case State::READING_DIRECTORY_CONTENT: {
         assert(_block != nullptr);
-        for (const auto* begin = _block; begin < _block + BLOCK_SIZE;) {
-          const auto& entry = reinterpret_cast<
-              const format::DirectoryEntry&>(*begin);
-          if (entry.inode_id == 0) {
-            begin += entry.record_length;
-            continue;
-          }
-          if (entry.name_len <= 2) {
-            if (entry.name[0] == '.') {
-              if (entry.name_len == 1 || entry.name[1] == '.') {
-                begin += entry.record_length;
-                continue;
-              }
-            }
-          }
-          _reverse_tree.emplace(entry.inode_id, FileEntry {
-            .name = { entry.name, entry.name_len },
-            .parent_inode = _current_inode,
+        if (_directory_parser) {
+          _directory_parser->Add(_block, _current_inode);
+        } else {
+          ForEachDirectoryEntry(_block,
+              [this](uint32_t inode, const char* name, size_t name_len) {
+            _names.Add(inode, _current_inode, name, name_len);
           });
-          begin += entry.record_length;
         }
         if (--_blocks_left == 0) {
           IfContinuationThenElse(State::READING_DIRECTORY_CONTENT,
@@ -201,6 +333,7 @@ class StreamReader {
         auto record = Record();
 
         if (record.type == format::Record::Type::END) {
+          MergeDirectories();
           SetState(State::DONE);
           return NextAction{ NextAction::SKIP,
             .skip.size = record.count * BLOCK_SIZE };
@@ -218,9 +351,14 @@ class StreamReader {
           _current_inode = record.inode_id;
           _blocks_left = record.count;
         } else {
+          // Stage 4, all the names are known.
+          MergeDirectories();
           if (record.inode.size) {
             _content_left = record.inode.size;
-            SetState(State::SKIPPING_INODE_CONTENT);
+            // Done with the block already, the caller may move the input to
+            // look ahead, see ScanContent().
+            KeepBlocksMap(record);
+            SetState(State::READING_CONTENT_RUNS);
           } else {
             SetState(State::WAITING_INODE);
           }
@@ -229,14 +367,47 @@ class StreamReader {
           NextAction::INODE, .inode = ReadInodeInfo(record) };
       }
       case State::SKIPPING_INODE_CONTENT: {
-        auto record = Record();
-        WaitIfContinuationThenElse(State::SKIPPING_INODE_CONTENT,
-                                   State::READING_VALIDATED_INODE);
-        const uint64_t total_size = record.count * BLOCK_SIZE;
+        KeepBlocksMap(Record());
+        SetState(State::READING_CONTENT_RUNS);
+        // case fall through.
+      }
+      [[clang::fallthrough]];
+      case State::READING_CONTENT_RUNS: {
+        // One DATA for every run of blocks in the stream, one HOLE for every
+        // run of blocks that are not.
+        if (_map_position == _map_size) {
+          WaitIfContinuationThenElse(State::SKIPPING_INODE_CONTENT,
+                                     State::ENDING_INODE_CONTENT);
+          return Next();
+        }
+        const bool present = _blocks_map[_map_position] != 0;
+        uint32_t blocks = 0;
+        while (_map_position < _map_size
+               && (_blocks_map[_map_position] != 0) == present) {
+          ++_map_position;
+          ++blocks;
+        }
+        const uint64_t total_size = uint64_t(blocks) * BLOCK_SIZE;
         const auto content_size = std::min(_content_left, total_size);
         _content_left -= content_size;
-        return NextAction{ NextAction::DATA, .data.size = content_size,
-          .data.padding = total_size - content_size };
+        if (present) {
+          return NextAction{ NextAction::DATA, .data.size = content_size,
+            .data.padding = total_size - content_size };
+        }
+        if (content_size == 0) {
+          return Next();
+        }
+        return NextAction{ NextAction::HOLE, .hole.size = content_size };
+      }
+      case State::ENDING_INODE_CONTENT: {
+        // The records stop short of the size, the file ends with a hole.
+        SetState(State::READING_VALIDATED_INODE);
+        if (_content_left > 0) {
+          const size_t size = _content_left;
+          _content_left = 0;
+          return NextAction{ NextAction::HOLE, .hole.size = size };
+        }
+        return Next();
       }
       case State::WAITING_CONTINUATION: {
         SetState(State::READING_CONTINUATION);
@@ -259,41 +430,222 @@ class StreamReader {
     abort();
   }
 
+  /* Feed the reader the blocks of the `size` bytes at `span`, found at
+   * `offset` of the dump, and set `actions` to what they give: one call for
+   * a whole buffer of the input instead of a Next() and a SetBlock() for
+   * every block. The blocks are read in place.
+   *
+   * Return the bytes of the span used, the caller consumes them as it acts
+   * on `actions` in order, see BatchAction::offset. Stops:
+   *  - when the next block is not all in the span, block_wanted() is then
+   *    true, and the next call must start with that block;
+   *  - after a DATA or SKIP running past the span, the caller consumes it
+   *    from the input as usual;
+   *  - after an INODE followed by content, for ScanContent() and
+   *    WalkContent() to look at it before anything else is read;
+   *  - after BATCH_ACTIONS actions, for the vector to stay in the cache;
+   *  - after DONE.
+   * Calls to Next() and NextBatch() must not be mixed. */
+  size_t NextBatch(const char* span, size_t size, uint64_t offset,
+                   std::vector<BatchAction>* actions) {
+    actions->clear();
+    size_t used = 0;
+    for (;;) {
+      if (_block_wanted) {
+        if (size - used < BLOCK_SIZE) {
+          return used;
+        }
+        _block_wanted = false;
+        _block = span + used;
+        _record_offset = offset + used;
+        used += BLOCK_SIZE;
+      }
+      const NextAction action = Next();
+      switch (action.kind) {
+        case NextAction::FEED_BLOCK:
+          _block_wanted = true;
+          break;
+        case NextAction::DATA:
+        case NextAction::SKIP:
+          actions->push_back(BatchAction{ action, used, _record_offset });
+          used += action.kind == NextAction::DATA ?
+              action.data.size + action.data.padding : action.skip.size;
+          if (used > size) {
+            return used;
+          }
+          break;
+        case NextAction::INODE:
+          actions->push_back(BatchAction{ action, used, _record_offset });
+          if (_state == State::READING_CONTENT_RUNS) {
+            return used;
+          }
+          break;
+        case NextAction::HOLE:
+          actions->push_back(BatchAction{ action, used, _record_offset });
+          break;
+        case NextAction::DONE:
+          actions->push_back(BatchAction{ action, used, _record_offset });
+          return used;
+      }
+      if (actions->size() == BATCH_ACTIONS) {
+        return used;
+      }
+    }
+  }
+
+  static constexpr const size_t BATCH_ACTIONS = 256;
+
+  /* Whether NextBatch() stopped for want of a block. */
+  bool block_wanted() const {
+    return _block_wanted;
+  }
+
+  /* Where the content of the file whose INODE was just returned is, as the
+   * (offset, size) data regions of the file, and whether it has holes at all.
+   * Must be called right after the INODE, see WalkContent(). Return false if
+   * `peek` does. */
+  template <typename Peek>
+  bool ScanContent(Peek peek, std::vector<Region>* regions, bool* holes) {
+    regions->clear();
+    *holes = false;
+    return WalkContent(peek, [&](uint64_t offset, uint64_t size,
+                                 uint64_t ahead) {
+      if (ahead == HOLE) {
+        *holes = true;
+      } else if (!regions->empty()
+                 && regions->back().offset + regions->back().size == offset) {
+        regions->back().size += size;
+      } else {
+        regions->push_back(Region{ offset, size });
+      }
+      return true;
+    });
+  }
+
+  /* `ahead` of the runs of WalkContent() that are holes. */
+  static constexpr const uint64_t HOLE = ~uint64_t(0);
+
+  /* Call `f(offset, size, ahead)` for the runs of content of the file whose
+   * INODE was just returned, in order: `size` bytes at `offset` of the file
+   * are found `ahead` bytes after the current block of the dump, or are a
+   * hole when `ahead` is HOLE. Must be called right after the INODE.
+   *
+   * The record of the inode only maps the first 512 blocks, the maps of the
+   * following ADDR records are read ahead with `peek(ahead, size, out)`, which
+   * must copy `size` bytes of the dump found `ahead` bytes after the current
+   * block, or return false. Return false if it does, or if `f` does. Both
+   * may move the input. */
+  template <typename Peek, typename F>
+  bool WalkContent(Peek peek, F f) {
+    assert(_state == State::READING_CONTENT_RUNS && _map_position == 0);
+    // From the copies of the INODE record, the input may have moved since.
+    return WalkRuns(_content_left, _blocks_map, _map_size, peek, f);
+  }
+
+  /* WalkContent() for the file whose INODE record is anywhere in the dump,
+   * at `offset`: `peek_at(offset, size, out)` must copy `size` bytes found at
+   * `offset` of the dump, and `f(offset, size, at)` is given where the runs
+   * are in the dump instead of how far ahead. Return false if the record is
+   * not an INODE record. */
+  template <typename PeekAt, typename F>
+  static bool WalkContentAt(uint64_t offset, PeekAt peek_at, F f) {
+    char block[BLOCK_SIZE];
+    if (!peek_at(offset, sizeof block, block)) {
+      return false;
+    }
+    const auto& record = reinterpret_cast<const format::Record&>(*block);
+    CheckRecord(record);
+    if (record.type != format::Record::Type::INODE) {
+      return false;
+    }
+    const uint64_t base = offset + BLOCK_SIZE;
+    return WalkRuns(
+        record.inode.size, record.blocks_map,
+        std::min<uint32_t>(record.count, sizeof record.blocks_map),
+        [&](uint64_t ahead, size_t size, char* out) {
+          return peek_at(base + ahead, size, out);
+        },
+        [&](uint64_t file_offset, uint64_t size, uint64_t ahead) {
+          return f(file_offset, size, ahead == HOLE ? HOLE : base + ahead);
+        });
+  }
+
   /* Return all possible path for the given inode. Only regular files inodes can
    * return more than one entry (hardlinks). */
-  std::vector<std::string> ResolvePaths(uint32_t inode) {
+  Paths ResolvePaths(uint32_t inode) {
     assert(inode != 0);
-    if (inode == 2) {
-      return { "/" };
-    }
-    std::vector<std::string> r;
-    auto range = _reverse_tree.equal_range(inode);
-    for (auto it = range.first; it != range.second; ++it) {
-      const FileEntry& file_entry = it->second;
-      assert(file_entry.name != "." && file_entry.name != "..");
-      r.push_back(_ResolveDirectoryPath(file_entry.parent_inode) +
-                  file_entry.name);
-    }
-    return r;
+    MergeDirectories();
+    return Paths(this, &_names, inode);
+  }
+
+  /* Resolve one name of an inode, see InodeTable::NamesBegin(). */
+  Path ResolvePath(const InodeTable::Name& name) {
+    MergeDirectories();
+    const auto directory = ResolveDirectory(name.parent_inode);
+    return Path{ directory.data, directory.size, name.name, name.name_len };
   }
 
   std::vector<uint32_t> Parents(uint32_t inode) {
     std::vector<uint32_t> r;
-    auto range = _reverse_tree.equal_range(inode);
-    for (auto it = range.first; it != range.second; ++it) {
-      const FileEntry& file_entry = it->second;
-      assert(file_entry.name != "." && file_entry.name != "..");
-      r.push_back(file_entry.parent_inode);
-    }
+    MergeDirectories();
+    _names.ForEachName(inode, [&](const InodeTable::Name& name) {
+      r.push_back(name.parent_inode);
+    });
     return r;
   }
 
   void PrintTree(std::ostream* os = &std::cout) {
-    for (const auto& item : _reverse_tree) {
-      for (const auto& p : ResolvePaths(item.first)) {
-        *os << std::setw(10) << item.first << " - " << p << std::endl;
+    MergeDirectories();
+    _names.ForEachInode([&](uint32_t inode) {
+      for (const auto& p : ResolvePaths(inode)) {
+        *os << std::setw(10) << inode << " - " << p << std::endl;
       }
+    });
+  }
+
+  /* Add a name of the directory tree found by an earlier pass over the dump,
+   * to resolve paths without reading stage 3 again, see JumpToInode(). */
+  void AddName(uint32_t inode, uint32_t parent_inode,
+               const char* name, size_t name_len) {
+    MergeDirectories();
+    _names.Add(inode, parent_inode, name, name_len);
+  }
+
+  /* Call right after a FEED_BLOCK, or when block_wanted(), to feed an INODE
+   * or END record found elsewhere in the dump, instead of the block that
+   * follows. What was read
+   * of the current inode is finished as if the record came next, the content
+   * of a directory is not read. */
+  void JumpToInode() {
+    if (_state == State::READING_CONTINUATION
+        && _continuation_else == State::ENDING_INODE_CONTENT) {
+      return;  // Still to decide if the file ends with a hole.
     }
+    SetState(State::READING_INODE);
+  }
+
+  /* The reverse directory tree built so far. */
+  const InodeTable& names() {
+    MergeDirectories();
+    return _names;
+  }
+
+  /* The date of the dump and its volume number, from its TAPE record. */
+  int32_t dump_date() const {
+    return _dump_date;
+  }
+
+  int32_t volume() const {
+    return _volume;
+  }
+
+  const DirectoryParser* directory_parser() const {
+    return _directory_parser.get();
+  }
+
+  /* Bytes used by the reverse directory tree and the directory paths. */
+  size_t TreeMemoryUsage() const {
+    return _names.MemoryUsage() + _directory_arena.MemoryUsage();
   }
 
  private:
@@ -313,12 +665,94 @@ class StreamReader {
     WAITING_CONTINUATION,
     READING_CONTINUATION,
     SKIPPING_INODE_CONTENT,
+    READING_CONTENT_RUNS,
+    ENDING_INODE_CONTENT,
     DONE,
   };
 
+  /* The walk of WalkContent(), from the map of `count` blocks of the INODE
+   * record of a file of `size` bytes. */
+  template <typename Peek, typename F>
+  static bool WalkRuns(uint64_t size, const uint8_t* map, uint32_t count,
+                       Peek peek, F f) {
+    char next[BLOCK_SIZE];
+    uint64_t offset = 0;  // In the file.
+    uint64_t ahead = 0;   // In the dump, after the current block.
+    // The run being extended, blocks are contiguous in the dump within a
+    // record.
+    uint64_t run_offset = 0;
+    uint64_t run_size = 0;
+    uint64_t run_ahead = HOLE;
+    auto flush = [&]() {
+      const bool ok = run_size == 0 || f(run_offset, run_size, run_ahead);
+      run_size = 0;
+      return ok;
+    };
+    for (;;) {
+      for (uint32_t i = 0; i < count; ++i) {
+        const uint64_t length = offset < size ?
+            std::min<uint64_t>(BLOCK_SIZE, size - offset) : 0;
+        uint64_t block_ahead = HOLE;
+        if (map[i]) {
+          block_ahead = ahead;
+        }
+        if (length > 0) {
+          if ((block_ahead == HOLE) != (run_ahead == HOLE)) {
+            if (!flush()) {
+              return false;
+            }
+          }
+          if (run_size == 0) {
+            run_offset = offset;
+            run_ahead = block_ahead;
+          }
+          run_size += length;
+        }
+        if (block_ahead != HOLE) {
+          ahead += BLOCK_SIZE;
+        }
+        offset += length;
+      }
+      if (run_ahead != HOLE && !flush()) {
+        return false;  // The next record is in between.
+      }
+      if (offset >= size) {
+        break;
+      }
+      if (!peek(ahead, sizeof next, next)) {
+        return false;
+      }
+      const auto* record = reinterpret_cast<const format::Record*>(next);
+      if (record->type != format::Record::Type::ADDR) {
+        // The content stops short, the rest is a hole.
+        if (run_ahead != HOLE && !flush()) {
+          return false;
+        }
+        if (run_size == 0) {
+          run_offset = offset;
+          run_ahead = HOLE;
+        }
+        run_size += size - offset;
+        break;
+      }
+      // Its map is used before Next() gets to validate it.
+      CheckRecord(*record);
+      map = record->blocks_map;
+      count = std::min<uint32_t>(record->count, sizeof record->blocks_map);
+      ahead += BLOCK_SIZE;
+    }
+    return flush();
+  }
+
   const format::Record& ValidateRecord() {
     assert(_block != nullptr);
     const auto& record = reinterpret_cast<const format::Record&>(*_block);
+    CheckRecord(record);
+    return record;
+  }
+
+  /* Abort unless `record` has a valid checksum and magic. */
+  static void CheckRecord(const format::Record& record) {
     if (!record.Checksum()) {
       std::cerr << "Invalid checksum" << std::endl;
       abort();
@@ -327,7 +761,6 @@ class StreamReader {
       std::cerr << "Invalid MAGIC" << std::endl;
       abort();
     }
-    return record;
   }
 
   const format::Record& Record() {
@@ -355,6 +788,21 @@ class StreamReader {
     };
   }
 
+  /* The block goes away as soon as the caller reads the content, keep the
+   * map of the record. */
+  void KeepBlocksMap(const format::Record& record) {
+    _map_size = std::min<uint32_t>(record.count, sizeof _blocks_map);
+    memcpy(_blocks_map, record.blocks_map, _map_size);
+    _map_position = 0;
+  }
+
+  /* Add the names still being parsed on the workers, if any. */
+  void MergeDirectories() {
+    if (_directory_parser) {
+      _directory_parser->Flush();
+    }
+  }
+
   void SetState(State new_state) {
     _state = new_state;
   }
@@ -371,37 +819,74 @@ class StreamReader {
     SetState(State::READING_CONTINUATION);
   }
 
+  struct StringRef {
+    const char* data;
+    size_t      size;
+  };
+
   /* There is no hardlinks on directory except for '.' && '..'. But there
-   * should be none of theses in _reverse_tree. We just have to recursively
-   * follow up every parent directory until we reach root. */
-  std::string _ResolveDirectoryPath(uint32_t inode) {
+   * should be none of theses in _names. We just have to follow up every parent
+   * directory until we reach root.
+   *
+   * A directory path is built once, by appending its name to the path of its
+   * parent, and interned in _directory_arena. Directories are not always read
+   * top-down: a path is only interned once it reaches root, an unresolved
+   * directory gives an empty path. */
+  StringRef ResolveDirectory(uint32_t inode) {
     assert(inode != 0);
     if (inode == 2) {
-      return "/";
+      return { "/", 1 };
+    }
+    const auto cached = _directory_paths.find(inode);
+    if (cached != _directory_paths.end()) {
+      return cached->second;
     }
-    for (auto it = _reverse_tree.find(inode);
-         it != _reverse_tree.end();
-         it = _reverse_tree.find(inode)) {
-      const FileEntry& file_entry = it->second;
-      assert(file_entry.name != "." && file_entry.name != "..");
-      return (_ResolveDirectoryPath(file_entry.parent_inode)
-              + file_entry.name + '/');
+    InodeTable::Name name;
+    if (!_names.Find(inode, &name)) {
+      return { "", 0 };
     }
-    return {};
+    const StringRef parent = ResolveDirectory(name.parent_inode);
+    if (parent.size == 0) {
+      return { "", 0 };
+    }
+    const size_t size = parent.size + name.name_len + 1;
+    char* path = _directory_arena.Data(_directory_arena.Allocate(size));
+    memcpy(path, parent.data, parent.size);
+    memcpy(path + parent.size, name.name, name.name_len);
+    path[size - 1] = '/';
+    const StringRef r = { path, size };
+    _directory_paths.emplace(inode, r);
+    return r;
   }
 
   State _state  = State::WAITING_FIRST_BLOCK;
   State _continuation_then;
   State _continuation_else;
-  char* _block = nullptr;
-  std::unordered_multimap<uint32_t, FileEntry> _reverse_tree;
+  const char* _block = nullptr;
+  // NextBatch() is waiting for a block, and where the last one it fed is.
+  bool _block_wanted = false;
+  uint64_t _record_offset = 0;
+  int32_t _dump_date = 0;
+  int32_t _volume = 0;
+  InodeTable _names;
+  uint64_t _bits_map_inodes = 0;
+  Arena _directory_arena;
+  std::unordered_map<uint32_t, StringRef> _directory_paths;
+  std::unique_ptr<DirectoryParser> _directory_parser;
 
   // Directory walking.
   uint32_t _current_inode;
   uint32_t _blocks_left;
   uint64_t _content_left;
+  uint8_t _blocks_map[sizeof format::Record::blocks_map];
+  uint32_t _map_size;
+  uint32_t _map_position;
 };
 
+inline Path Paths::iterator::operator*() const {
+  return _reader->ResolvePath(*_it);
+}
+
 }  // namespace dump
 
 #endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_DUMP_READER_H_
@@ -0,0 +1,267 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_EXTRACT_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_EXTRACT_H_
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace io {
+
+/* Owner, permissions and times given to a file once written. */
+struct FileAttributes {
+  uint32_t uid;
+  uint32_t gid;
+  uint16_t perms;
+  uint64_t atime_us;
+  uint64_t mtime_us;
+  bool     chown;  // Only root can give files away.
+};
+
+inline struct timespec ToTimespec(uint64_t us) {
+  struct timespec ts;
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  return ts;
+}
+
+/* Writes the content of files opened by the caller on a pool of worker
+ * threads.
+ *
+ * Like digest::HashPool, bytes are given by reference and written later,
+ * they must stay valid until the next Wait(). All the writes of a file go
+ * to one worker, which sizes the file first, with fallocate(2) when it has
+ * no holes, and once its content is written sets its attributes and closes
+ * it. The files go round robin to the workers, so the caller can open the
+ * next file while the previous ones are still being written. */
+class ExtractPool {
+ public:
+  explicit ExtractPool(size_t workers) : _queues(workers), _ready(workers) {
+    assert(workers > 0);
+    for (size_t i = 0; i < workers; ++i) {
+      _workers.emplace_back(&ExtractPool::WorkerLoop, this, i);
+    }
+  }
+
+  ~ExtractPool() {
+    Close();
+  }
+
+  ExtractPool(const ExtractPool&) = delete;
+  ExtractPool& operator=(const ExtractPool&) = delete;
+
+  /* Start writing `size` bytes to `fd`, which the pool now owns. A file
+   * with `holes` is only truncated to its size, its holes are not
+   * allocated. */
+  void Begin(int fd, uint64_t size, bool holes,
+             const FileAttributes& attributes) {
+    _current = Task{};
+    _current.kind = Task::BEGIN;
+    _current.fd = fd;
+    _current.worker = _begun++ % _queues.size();
+    _current.size = size;
+    _current.holes = holes;
+    _current.attributes = attributes;
+    Queue(_current);
+  }
+
+  /* Write `size` bytes at `offset` of the current file. */
+  void Write(const char* data, size_t size, uint64_t offset) {
+    Task task = _current;
+    task.kind = Task::WRITE;
+    task.data = data;
+    task.size = size;
+    task.offset = offset;
+    Queue(task);
+  }
+
+  /* Set the attributes of the current file and close it. */
+  void End() {
+    Task task = _current;
+    task.kind = Task::END;
+    Queue(task);
+    _current.fd = -1;
+  }
+
+  /* Wait until all the writes given so far are done. */
+  void Wait() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_pending) {
+      ++_stalls;
+      _done.wait(lock, [this] { return _pending == 0; });
+    }
+  }
+
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closed = true;
+    }
+    for (auto& ready : _ready) {
+      ready.notify_one();
+    }
+    for (auto& worker : _workers) {
+      if (worker.joinable()) {
+        worker.join();
+      }
+    }
+  }
+
+  /* Times Wait() had to wait for the workers. */
+  uint64_t stalls() const {
+    return _stalls;
+  }
+
+ private:
+  struct Task {
+    enum Kind { BEGIN, WRITE, END } kind;
+    int            fd;
+    size_t         worker;
+    const char*    data;
+    uint64_t       size;    // Of the file for BEGIN.
+    uint64_t       offset;
+    bool           holes;
+    FileAttributes attributes;
+  };
+
+  // Only the worker of the task is woken, the others may be busy with files
+  // of their own.
+  void Queue(const Task& task) {
+    assert(task.fd >= 0);
+    bool wake;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto& queue = _queues[task.worker];
+      wake = queue.empty();
+      queue.push_back(task);
+      ++_pending;
+    }
+    if (wake) {
+      _ready[task.worker].notify_one();
+    }
+  }
+
+  static void Fail(const char* what) {
+    std::cerr << "Extract error, " << what << ": " << strerror(errno)
+      << std::endl;
+    abort();
+  }
+
+  void Run(const Task& task) {
+    switch (task.kind) {
+      case Task::BEGIN:
+        if (task.size == 0) {
+          break;
+        }
+        // Not all filesystems can allocate upfront, they get the writes.
+        if (task.holes || fallocate(task.fd, 0, 0, task.size) != 0) {
+          if (ftruncate(task.fd, task.size) != 0) {
+            Fail("ftruncate");
+          }
+        }
+        break;
+      case Task::WRITE: {
+        const char* data = task.data;
+        uint64_t size = task.size;
+        uint64_t offset = task.offset;
+        while (size > 0) {
+          const ssize_t r = pwrite(task.fd, data, size, offset);
+          if (r < 0) {
+            if (errno == EINTR) {
+              continue;
+            }
+            Fail("pwrite");
+          }
+          data += r;
+          size -= r;
+          offset += r;
+        }
+        break;
+      }
+      case Task::END: {
+        const auto& attributes = task.attributes;
+        if (attributes.chown
+            && fchown(task.fd, attributes.uid, attributes.gid) != 0) {
+          Fail("fchown");
+        }
+        if (fchmod(task.fd, attributes.perms) != 0) {
+          Fail("fchmod");
+        }
+        const struct timespec times[2] = {
+          ToTimespec(attributes.atime_us), ToTimespec(attributes.mtime_us),
+        };
+        if (futimens(task.fd, times) != 0) {
+          Fail("futimens");
+        }
+        if (close(task.fd) != 0) {
+          Fail("close");
+        }
+        break;
+      }
+    }
+  }
+
+  void WorkerLoop(size_t worker) {
+    auto& queue = _queues[worker];
+    for (;;) {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _ready[worker].wait(lock,
+                            [&] { return !queue.empty() || _closed; });
+        if (queue.empty()) {
+          break;
+        }
+        task = queue.front();
+        queue.pop_front();
+      }
+      Run(task);
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (--_pending == 0) {
+        _done.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::deque<Task>>        _queues;  // One per worker.
+  std::vector<std::condition_variable> _ready;   // A task in the queue.
+  std::vector<std::thread>             _workers;
+
+  std::mutex                           _mutex;
+  std::condition_variable              _done;    // No task pending.
+  Task                                 _current = {};
+  uint64_t                             _begun = 0;
+  uint64_t                             _pending = 0;  // Tasks not done yet.
+  bool                                 _closed = false;
+  uint64_t                             _stalls = 0;
+};
+
+}  // namespace io
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_EXTRACT_H_
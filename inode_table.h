@@ -0,0 +1,264 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_INODE_TABLE_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_INODE_TABLE_H_
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace dump {
+
+/* Append only storage for small strings, in fixed size segments. Bytes never
+ * move once copied in, so pointers to them stay valid as the arena grows. */
+class Arena {
+ public:
+  static constexpr const size_t SEGMENT_SIZE = 1 << 20;
+
+  /* Reserve `size` contiguous bytes. Return their offset. */
+  uint64_t Allocate(size_t size) {
+    assert(size <= SEGMENT_SIZE);
+    if (_segments.empty() || _used + size > SEGMENT_SIZE) {
+      _segments.emplace_back(new char[SEGMENT_SIZE]);
+      _used = 0;
+    }
+    const uint64_t offset = (_segments.size() - 1) * SEGMENT_SIZE + _used;
+    _used += size;
+    return offset;
+  }
+
+  uint64_t Append(const char* data, size_t size) {
+    const uint64_t offset = Allocate(size);
+    memcpy(Data(offset), data, size);
+    return offset;
+  }
+
+  char* Data(uint64_t offset) const {
+    return _segments[offset / SEGMENT_SIZE].get() + offset % SEGMENT_SIZE;
+  }
+
+  size_t MemoryUsage() const {
+    return _segments.size() * SEGMENT_SIZE;
+  }
+
+ private:
+  std::vector<std::unique_ptr<char[]>> _segments;
+  size_t                               _used = 0;
+};
+
+/* Reverse directory tree: for every inode, the names it has in the
+ * directories, and the inode of each of these directories.
+ *
+ * Inodes numbers are dense, so the first name of an inode lives in an array
+ * indexed by inode number. Extra names (hardlinks) are chained in an overflow
+ * array. All the names are appended to an Arena. An entry is 16 bytes, plus
+ * the name itself in the arena.
+ *
+ * The inodes can be split in shards of SHARD_INODES consecutive inodes, dealt
+ * round robin, each with its own overflow array and arena: AddToShard() can
+ * then fill the shards on as many threads. */
+class InodeTable {
+  struct Entry;
+  struct Shard;
+
+ public:
+  static constexpr const uint32_t SHARD_INODES = 1024;
+
+  struct Name {
+    uint32_t    parent_inode;
+    const char* name;
+    size_t      name_len;
+  };
+
+  /* Split the table in `shards`. Must be called before any name is added. */
+  void SetShards(size_t shards) {
+    assert(shards > 0);
+    assert(_shards.size() == 1 && _shards[0].arena.MemoryUsage() == 0);
+    _shards.resize(shards);
+  }
+
+  size_t shards() const {
+    return _shards.size();
+  }
+
+  size_t ShardOf(uint32_t inode) const {
+    return inode / SHARD_INODES % _shards.size();
+  }
+
+  /* Size the table for inodes up to `max_inode`, excluded. */
+  void Reserve(uint32_t max_inode) {
+    if (_entries.size() < max_inode) {
+      _entries.resize(max_inode);
+    }
+  }
+
+  /* Make room for `inode`, growing geometrically. */
+  void Grow(uint32_t inode) {
+    if (inode >= _entries.size()) {
+      _entries.resize(std::max<size_t>(inode + 1, _entries.size() * 3 / 2));
+    }
+  }
+
+  /* Whether `inode` has room in the table, see AddToShard(). */
+  bool Covers(uint32_t inode) const {
+    return inode < _entries.size();
+  }
+
+  void Add(uint32_t inode, uint32_t parent_inode,
+           const char* name, size_t name_len) {
+    // Not covered by the BITS map, grow geometrically.
+    Grow(inode);
+    AddToShard(ShardOf(inode), inode, parent_inode, name, name_len);
+  }
+
+  /* Add a name of an inode of `shard` that Covers() already. Names of
+   * different shards can be added concurrently, as long as nothing else
+   * changes the table meanwhile. */
+  void AddToShard(size_t shard, uint32_t inode, uint32_t parent_inode,
+                  const char* name, size_t name_len) {
+    assert(parent_inode != 0);
+    assert(name_len < 256);
+    assert(Covers(inode) && ShardOf(inode) == shard);
+    Shard& s = _shards[shard];
+    Entry entry;
+    entry.parent_inode = parent_inode;
+    entry.next = 0;
+    entry.name = (s.arena.Append(name, name_len) << 8) | name_len;
+
+    Entry* slot = &_entries[inode];
+    if (slot->parent_inode == 0) {
+      *slot = entry;
+      return;
+    }
+    // Append at the end of the chain, to keep the order of the directories.
+    // The chain is walked once the entry is in, push_back() may move it.
+    s.overflow.push_back(entry);
+    while (slot->next) {
+      slot = &s.overflow[slot->next - 1];
+    }
+    slot->next = s.overflow.size();
+  }
+
+  /* Walks the names of one inode, in the order they were added. */
+  class NameIterator {
+   public:
+    Name operator*() const {
+      return Name{ _entry->parent_inode, _shard->NameData(*_entry),
+                   size_t(_entry->name & 0xFF) };
+    }
+
+    NameIterator& operator++() {
+      _entry = _entry->next ? &_shard->overflow[_entry->next - 1] : nullptr;
+      return *this;
+    }
+
+    bool operator==(const NameIterator& other) const {
+      return _entry == other._entry;
+    }
+
+    bool operator!=(const NameIterator& other) const {
+      return _entry != other._entry;
+    }
+
+   private:
+    friend class InodeTable;
+    NameIterator(const Shard* shard, const Entry* entry)
+        : _shard(shard), _entry(entry) {
+    }
+
+    const Shard* _shard;
+    const Entry* _entry;
+  };
+
+  NameIterator NamesBegin(uint32_t inode) const {
+    if (inode >= _entries.size() || _entries[inode].parent_inode == 0) {
+      return NamesEnd();
+    }
+    return NameIterator(&_shards[ShardOf(inode)], &_entries[inode]);
+  }
+
+  NameIterator NamesEnd() const {
+    return NameIterator(nullptr, nullptr);
+  }
+
+  /* Call `f(const Name&)` for every name of `inode`. */
+  template <typename F>
+  void ForEachName(uint32_t inode, F f) const {
+    for (auto it = NamesBegin(inode); it != NamesEnd(); ++it) {
+      f(*it);
+    }
+  }
+
+  /* First name of `inode`. Return false if it has none. */
+  bool Find(uint32_t inode, Name* name) const {
+    if (inode >= _entries.size() || _entries[inode].parent_inode == 0) {
+      return false;
+    }
+    const Entry& entry = _entries[inode];
+    *name = Name{ entry.parent_inode, _shards[ShardOf(inode)].NameData(entry),
+                  size_t(entry.name & 0xFF) };
+    return true;
+  }
+
+  /* Call `f(uint32_t inode)` for every inode with at least one name. */
+  template <typename F>
+  void ForEachInode(F f) const {
+    for (size_t inode = 0; inode < _entries.size(); ++inode) {
+      if (_entries[inode].parent_inode) {
+        f(uint32_t(inode));
+      }
+    }
+  }
+
+  size_t MemoryUsage() const {
+    size_t usage = _entries.capacity() * sizeof (Entry);
+    for (const Shard& shard : _shards) {
+      usage += shard.overflow.capacity() * sizeof (Entry)
+             + shard.arena.MemoryUsage();
+    }
+    return usage;
+  }
+
+ private:
+  struct Entry {
+    uint32_t parent_inode;  // 0 if the entry is unused.
+    uint32_t next;          // 1 + index in the overflow, 0 for none.
+    uint64_t name;          // Offset in the arena << 8 | length.
+  };
+  static_assert(sizeof (Entry) == 16, "Wrong size for Entry");
+
+  /* The extra names and the name bytes of the inodes of a shard. */
+  struct Shard {
+    std::vector<Entry> overflow;
+    Arena              arena;
+
+    const char* NameData(const Entry& entry) const {
+      return arena.Data(entry.name >> 8);
+    }
+  };
+
+  std::vector<Entry> _entries;
+  std::vector<Shard> _shards = std::vector<Shard>(1);
+};
+
+constexpr const uint32_t InodeTable::SHARD_INODES;
+
+}  // namespace dump
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_INODE_TABLE_H_
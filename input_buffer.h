@@ -0,0 +1,507 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_INPUT_BUFFER_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_INPUT_BUFFER_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include "./spsc_ring.h"
+#include "./uring.h"
+
+namespace io {
+
+constexpr const size_t DEFAULT_READ_SIZE = 4 << 20;
+
+/* Read-ahead input over a file descriptor.
+ *
+ * Data is pulled with large read(2) calls into a single reusable buffer, and
+ * handed out as pointers into that buffer. A pointer stays valid until the
+ * next call to any of Read(), ReadSome() or Skip().
+ *
+ * Alternatively, a regular file can be mapped in memory with Map(). The
+ * buffer is then the whole mapping: pointers stay valid for the lifetime of
+ * the InputBuffer and skipping is free.
+ *
+ * Or the reads can be moved to a reader thread with StartReader(), filling a
+ * ring of buffers ahead of the consumer. Or to io_uring with StartUring(),
+ * keeping several reads in flight. */
+class InputBuffer {
+ public:
+  explicit InputBuffer(int fd, size_t capacity = DEFAULT_READ_SIZE)
+      : _fd(fd), _capacity(capacity), _owned(new char[capacity]),
+        _buffer(_owned.get()) {
+    assert(capacity > 0);
+  }
+
+  ~InputBuffer() {
+    if (_mapped) {
+      munmap(_buffer, _end);
+    }
+    if (_pipe) {
+      // The reader might be blocked in read(2) forever on a pipe, let it go.
+      // It only holds on the ChunkPipe which it shares ownership of.
+      _pipe->Stop();
+      _reader.detach();
+    }
+  }
+
+  InputBuffer(const InputBuffer&) = delete;
+  InputBuffer& operator=(const InputBuffer&) = delete;
+
+  /* Map the file in memory instead of reading it. Must be called before
+   * anything is read. Return false if the file descriptor is not a regular
+   * file or cannot be mapped, reads are used in that case. */
+  bool Map() {
+    assert(_offset == 0 && _end == 0);
+    struct stat st;
+    if (fstat(_fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+      return false;
+    }
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (addr == MAP_FAILED) {
+      return false;
+    }
+    // Only hints, failures are harmless.
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(addr, st.st_size, MADV_HUGEPAGE);
+#endif
+    _owned.reset();
+    _buffer = static_cast<char*>(addr);
+    _capacity = st.st_size;
+    _end = st.st_size;
+    _mapped = true;
+    return true;
+  }
+
+  /* Read on a dedicated thread, `depth` buffers ahead. Must be called before
+   * anything is read. */
+  void StartReader(size_t depth) {
+    assert(_offset == 0 && _end == 0 && !_mapped);
+    _owned.reset();
+    _pipe = std::make_shared<ChunkPipe>(depth, _capacity);
+    _reader = std::thread(ReaderLoop, _fd, _pipe);
+    _source = _pipe.get();
+  }
+
+#ifdef DUMP2TAR_IO_URING
+  /* Read with io_uring, `depth` reads in flight. Must be called before
+   * anything is read. Return false if io_uring is not available. */
+  bool StartUring(size_t depth) {
+    assert(_offset == 0 && _end == 0 && !_mapped);
+    _uring = UringReader::Create(_fd, depth, _capacity);
+    if (!_uring) {
+      return false;
+    }
+    _owned.reset();
+    _source = _uring.get();
+    return true;
+  }
+
+  const UringReader* uring() const {
+    return _uring.get();
+  }
+#endif
+
+  /* Called before the buffer memory is reused, pointers handed out so far
+   * are about to become invalid. */
+  void SetRefillHook(std::function<void()> hook) {
+    _refill_hook = std::move(hook);
+  }
+
+  /* Return exactly `size` contiguous bytes. Abort on a short input. */
+  const char* Read(size_t size) {
+    assert(size <= _capacity);
+    if (_end - _begin < size) {
+      Fill(size);
+    }
+    const char* r = _buffer + _begin;
+    _begin += size;
+    _offset += size;
+    return r;
+  }
+
+  /* Return between 1 and `max_size` contiguous bytes, as many as the buffer
+   * can give without copying. The amount is stored in `size`. */
+  const char* ReadSome(size_t max_size, size_t* size) {
+    assert(max_size > 0);
+    if (_begin == _end) {
+      Fill(1);
+    }
+    *size = std::min(max_size, _end - _begin);
+    const char* r = _buffer + _begin;
+    _begin += *size;
+    _offset += *size;
+    return r;
+  }
+
+  /* Return all the bytes buffered, at least `min_size` of them, without
+   * consuming them, see Consume(). The amount is stored in `size`. */
+  const char* Buffered(size_t min_size, size_t* size) {
+    assert(min_size <= _capacity);
+    if (_end - _begin < min_size) {
+      Fill(min_size);
+    }
+    *size = _end - _begin;
+    return _buffer + _begin;
+  }
+
+  /* Consume `size` of the bytes returned by Buffered(). They are still
+   * buffered if the buffer moved since, at their new place. */
+  void Consume(size_t size) {
+    assert(size <= _end - _begin);
+    _begin += size;
+    _offset += size;
+  }
+
+  /* Discard `size` bytes. Past what is already buffered, a seekable file
+   * descriptor is moved forward with lseek(2) instead of being read, unless
+   * it is so little that the next read would cover it anyway. */
+  void Skip(size_t size) {
+    constexpr const size_t MIN_SEEK = 64 << 10;
+    const size_t from_buffer = std::min(size, _end - _begin);
+    _begin += from_buffer;
+    _offset += from_buffer;
+    size -= from_buffer;
+    if (size >= std::min(MIN_SEEK, _capacity) && Seekable()) {
+      if (lseek(_fd, size, SEEK_CUR) < 0) {
+        std::cerr << "Seek error: " << strerror(errno) << std::endl;
+        abort();
+      }
+      _offset += size;
+      _seeked += size;
+      // More seeking might follow, do not read far ahead for now. A pipe
+      // reads what it skips, it keeps its window.
+      _read_window = MIN_READ_WINDOW;
+      DropConsumed();
+      return;
+    }
+    while (size > 0) {
+      size_t amount;
+      ReadSome(size, &amount);
+      size -= amount;
+    }
+  }
+
+  /* Copy `size` bytes found `ahead` bytes past what was consumed, without
+   * consuming anything. They come from the buffer when it has them, from a
+   * seekable file with pread(2), or are read in the buffer when it has room
+   * for them. Return false otherwise.
+   *
+   * Reading in the buffer moves it, like Read() does. */
+  bool Peek(uint64_t ahead, size_t size, char* out) {
+    if (ahead + size <= _end - _begin) {
+      memcpy(out, _buffer + _begin + ahead, size);
+      return true;
+    }
+    if (_mapped) {
+      return false;
+    }
+    if (!Seekable()) {
+      if (_source || ahead + size > _capacity) {
+        return false;
+      }
+      Fill(ahead + size);
+      memcpy(out, _buffer + _begin + ahead, size);
+      return true;
+    }
+    const uint64_t position = _base + _offset + ahead;
+    size_t done = 0;
+    while (done < size) {
+      const ssize_t r = pread(_fd, out + done, size - done, position + done);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r <= 0) {
+        return false;
+      }
+      done += r;
+    }
+    return true;
+  }
+
+  /* Copy `size` bytes found at `offset` of the input, before or after what
+   * was consumed, from the mapping or with pread(2). Return false if the
+   * input cannot be read again, see rereadable(). */
+  bool PeekAt(uint64_t offset, size_t size, char* out) {
+    if (_mapped) {
+      if (offset + size > _end) {
+        return false;
+      }
+      memcpy(out, _buffer + offset, size);
+      return true;
+    }
+    if (!Seekable()) {
+      return false;
+    }
+    size_t done = 0;
+    while (done < size) {
+      const ssize_t r = pread(_fd, out + done, size - done,
+                              _base + offset + done);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r <= 0) {
+        return false;
+      }
+      done += r;
+    }
+    return true;
+  }
+
+  /* Whether any part of the input can be read again with PeekAt(). */
+  bool rereadable() {
+    return _mapped || Seekable();
+  }
+
+  /* Account for `size` bytes consumed directly from the file descriptor, for
+   * example by splice(2). Only valid once the buffer is drained. */
+  void Bypass(size_t size) {
+    assert(_begin == _end);
+    _offset += size;
+    DropConsumed();
+  }
+
+  int fd() const {
+    return _fd;
+  }
+
+  bool mapped() const {
+    return _mapped;
+  }
+
+  /* Whether the file descriptor can be consumed directly with Bypass(). */
+  bool bypassable() const {
+    return !_mapped && !_source;
+  }
+
+  /* The ring between the reader thread and us, if any. */
+  const ChunkPipe* pipe() const {
+    return _pipe.get();
+  }
+
+  /* Bytes read from the file descriptor but not consumed yet. */
+  size_t buffered() const {
+    return _end - _begin;
+  }
+
+  /* Bytes consumed so far. */
+  uint64_t offset() const {
+    return _offset;
+  }
+
+  /* Bytes skipped with lseek(2) so far. */
+  uint64_t seeked() const {
+    return _seeked;
+  }
+
+ private:
+  /* Make at least `size` bytes available, moving the unconsumed tail at the
+   * front of the buffer first. */
+  void Fill(size_t size) {
+    if (_mapped) {
+      std::cerr << "Read error: unexpected end of input" << std::endl;
+      abort();
+    }
+    if (_refill_hook) {
+      _refill_hook();
+    }
+    if (_source) {
+      FillFromSource(size);
+      return;
+    }
+    const size_t left = _end - _begin;
+    if (left && _begin) {
+      memmove(_buffer, _buffer + _begin, left);
+    }
+    _begin = 0;
+    _end = left;
+    // Up to the read window, which grows back to the whole buffer as long
+    // as nothing is skipped.
+    const size_t limit = std::max(size, std::min(_capacity,
+                                                 _end + _read_window));
+    _read_window = std::min(_capacity, _read_window * 2);
+    while (_end < size) {
+      const ssize_t r = read(_fd, _buffer + _end, limit - _end);
+      if (r < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        std::cerr << "Read error: " << strerror(errno) << std::endl;
+        abort();
+      }
+      if (r == 0) {
+        std::cerr << "Read error: unexpected end of input" << std::endl;
+        abort();
+      }
+      _end += r;
+    }
+    DropConsumed();
+  }
+
+  /* Whether Skip() can use lseek(2). Only for plain reads on regular files and
+   * block devices. */
+  bool Seekable() {
+    if (_seekable == Seek::UNKNOWN) {
+      _seekable = Seek::NO;
+      struct stat st;
+      if (bypassable() && fstat(_fd, &st) == 0
+          && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) {
+        const off_t position = lseek(_fd, 0, SEEK_CUR);
+        if (position >= 0) {
+          // Everything read so far is before the current position.
+          _base = position - _offset - (_end - _begin);
+          _dropped = _base;
+          _seekable = Seek::YES;
+        }
+      }
+    }
+    return _seekable == Seek::YES;
+  }
+
+  /* Tell the kernel to drop the page cache of what was read already, so a
+   * pass over a big dump does not evict everybody else's cache. Done by
+   * DROP_SIZE steps to keep the number of calls low. */
+  void DropConsumed() {
+    constexpr const uint64_t DROP_SIZE = 16 << 20;
+    if (!Seekable()) {
+      return;
+    }
+    const uint64_t position = _base + _offset + (_end - _begin);
+    if (position - _dropped >= DROP_SIZE) {
+      posix_fadvise(_fd, _dropped, position - _dropped, POSIX_FADV_DONTNEED);
+      _dropped = position;
+    }
+  }
+
+  /* Move to the next chunks from the reader thread or io_uring. A read
+   * straddling two chunks is stitched in `_owned`, which never happens as
+   * long as reads stay aligned on the chunk size. */
+  void FillFromSource(size_t size) {
+    while (_end - _begin < size) {
+      const size_t left = _end - _begin;
+      if (left && _chunk.data) {
+        // Keep the tail aside, the chunk goes back to the reader.
+        if (!_owned) {
+          _owned.reset(new char[2 * _capacity]);
+        }
+        memcpy(_owned.get(), _buffer + _begin, left);
+        _buffer = _owned.get();
+        _begin = 0;
+        _end = left;
+      }
+      ReleaseChunk();
+      Chunk next;
+      if (!_source->AcquireFilled(&next)) {
+        std::cerr << "Read error: unexpected end of input" << std::endl;
+        abort();
+      }
+      if (left == 0) {
+        _chunk = next;
+        _buffer = next.data;
+        _begin = 0;
+        _end = next.size;
+        continue;
+      }
+      memmove(_owned.get(), _owned.get() + _begin, left);
+      memcpy(_owned.get() + left, next.data, next.size);
+      _source->Release(next);
+      _begin = 0;
+      _end = left + next.size;
+    }
+  }
+
+  void ReleaseChunk() {
+    if (_chunk.data) {
+      _source->Release(_chunk);
+      _chunk.data = nullptr;
+    }
+  }
+
+  static void ReaderLoop(int fd, std::shared_ptr<ChunkPipe> pipe) {
+    Chunk chunk;
+    while (pipe->AcquireFree(&chunk)) {
+      while (chunk.size < pipe->chunk_size()) {
+        const ssize_t r = read(fd, chunk.data + chunk.size,
+                               pipe->chunk_size() - chunk.size);
+        if (r < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          std::cerr << "Read error: " << strerror(errno) << std::endl;
+          abort();
+        }
+        if (r == 0) {
+          break;
+        }
+        chunk.size += r;
+      }
+      if (chunk.size) {
+        pipe->Publish(chunk);
+      }
+      if (chunk.size < pipe->chunk_size()) {
+        break;
+      }
+    }
+    pipe->Close();
+  }
+
+  int                     _fd;
+  size_t                  _capacity;
+  std::unique_ptr<char[]> _owned;
+  char*                   _buffer;
+  bool                    _mapped = false;
+  size_t                  _begin = 0;
+  size_t                  _end = 0;
+  uint64_t                _offset = 0;
+  std::function<void()>   _refill_hook;
+
+  enum class Seek { UNKNOWN, YES, NO };
+  Seek                    _seekable = Seek::UNKNOWN;
+  uint64_t                _base = 0;     // File position of offset 0.
+  uint64_t                _dropped = 0;  // File position dropped up to.
+  uint64_t                _seeked = 0;
+  // Bytes to read ahead with the next read(2), the whole buffer unless
+  // large sections were skipped lately.
+  static constexpr const size_t MIN_READ_WINDOW = 4 << 10;
+  size_t                  _read_window = SIZE_MAX;
+
+  ChunkSource*               _source = nullptr;
+  std::shared_ptr<ChunkPipe> _pipe;
+  std::thread                _reader;
+#ifdef DUMP2TAR_IO_URING
+  std::unique_ptr<UringReader> _uring;
+#endif
+  Chunk                      _chunk = { nullptr, 0 };
+};
+
+}  // namespace io
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_INPUT_BUFFER_H_
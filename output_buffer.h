@@ -0,0 +1,515 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_OUTPUT_BUFFER_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_OUTPUT_BUFFER_H_
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "./compressor.h"
+#include "./input_buffer.h"
+#include "./spsc_ring.h"
+#include "./uring.h"
+
+namespace io {
+
+constexpr const size_t DEFAULT_WRITE_SIZE = 4 << 20;
+
+/* Gathering output over a file descriptor.
+ *
+ * Pending output is a list of iovecs flushed with large writev(2) calls.
+ * Small writes are copied in a staging buffer, zeroes point at a shared zero
+ * page, and content referenced with WriteRef() or Transfer() is not copied at
+ * all. Transfer() moves bytes from an InputBuffer to the output, kernel to
+ * kernel with splice(2) or copy_file_range(2) when the file descriptors allow
+ * it.
+ *
+ * With StartWriter(), full buffers are instead handed over to a writer thread
+ * through a ring, and everything is copied. StartUring() does the same with
+ * io_uring writes in place of the writer thread, and StartCompressor() with
+ * a pool of compression threads. */
+class OutputBuffer {
+ public:
+  explicit OutputBuffer(int fd, size_t capacity = DEFAULT_WRITE_SIZE)
+      : _fd(fd), _capacity(capacity), _owned(new char[capacity]),
+        _buffer(_owned.get()) {
+    assert(capacity > 0);
+  }
+
+  ~OutputBuffer() {
+    Close();
+    if (_tee[0] >= 0) {
+      close(_tee[0]);
+      close(_tee[1]);
+    }
+  }
+
+  OutputBuffer(const OutputBuffer&) = delete;
+  OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+  /* Write on a dedicated thread, up to `depth` buffers behind. Must be called
+   * before anything is written. */
+  void StartWriter(size_t depth) {
+    assert(_size == 0);
+    _pipe = new ChunkPipe(depth, _capacity);
+    _sink.reset(_pipe);
+    _owned.reset();
+    _sink->AcquireFree(&_chunk);
+    _buffer = _chunk.data;
+    _writer = std::thread(WriterLoop, _fd, _pipe);
+  }
+
+  /* Compress the output with `workers` threads, a buffer at a time. Must be
+   * called before anything is written. */
+  void StartCompressor(Codec codec, int level, size_t workers) {
+    StartCompressor(std::make_shared<CompressorPool>(codec, level, workers));
+  }
+
+  /* Compress the output on the threads of `pool`, which can be shared with
+   * other outputs. */
+  void StartCompressor(std::shared_ptr<CompressorPool> pool) {
+    assert(_size == 0);
+    _compressor = new CompressingWriter(_fd, std::move(pool), _capacity);
+    _sink.reset(_compressor);
+    _owned.reset();
+    _sink->AcquireFree(&_chunk);
+    _buffer = _chunk.data;
+  }
+
+  const CompressingWriter* compressor() const {
+    return _compressor;
+  }
+
+#ifdef DUMP2TAR_IO_URING
+  /* Write with io_uring, up to `depth` writes in flight. Must be called
+   * before anything is written. Return false if io_uring is not available. */
+  bool StartUring(size_t depth) {
+    assert(_size == 0);
+    auto uring = UringWriter::Create(_fd, depth, _capacity);
+    if (!uring) {
+      return false;
+    }
+    _uring = uring.get();
+    _sink = std::move(uring);
+    _owned.reset();
+    _sink->AcquireFree(&_chunk);
+    _buffer = _chunk.data;
+    return true;
+  }
+
+  const UringWriter* uring() const {
+    return _uring;
+  }
+#endif
+
+  void Write(const char* data, size_t size) {
+    if (_sink) {
+      Copy(data, size);
+      return;
+    }
+    if (size > _capacity - _size) {
+      // Too big to stage, send it right away without a copy.
+      AddIov(data, size);
+      Flush();
+      return;
+    }
+    memcpy(_buffer + _size, data, size);
+    _size += size;
+    AddIov(_buffer + _size - size, size);
+  }
+
+  /* Write `size` bytes referenced in place. They must stay valid until the
+   * next Flush(). */
+  void WriteRef(const char* data, size_t size) {
+    if (_sink) {
+      Copy(data, size);
+    } else {
+      AddIov(data, size);
+    }
+  }
+
+  void WriteZeros(size_t size) {
+    while (size > 0) {
+      const size_t amount = std::min(size, ZERO_PAGE_SIZE);
+      WriteRef(ZeroPage(), amount);
+      size -= amount;
+    }
+  }
+
+  /* Copy `size` bytes from `input` to the output. Bytes already in the
+   * input buffer are referenced with WriteRef(), the input must Flush() us
+   * before reusing its memory, see InputBuffer::SetRefillHook(). */
+  void Transfer(InputBuffer* input, size_t size) {
+    while (size > 0 && input->buffered()) {
+      size_t amount;
+      const char* data = input->ReadSome(size, &amount);
+      WriteRef(data, amount);
+      size -= amount;
+    }
+    if (size > 0 && !_sink && input->bypassable()
+        && KernelCopyFrom(input->fd()) != KernelCopy::NONE) {
+      Flush();
+      size -= TransferInKernel(input, size);
+    }
+    while (size > 0) {
+      size_t amount;
+      const char* data = input->ReadSome(size, &amount);
+      WriteRef(data, amount);
+      size -= amount;
+    }
+  }
+
+  /* Same as Transfer(), also calling `observe(data, size)` on the bytes as
+   * they go by. When they are moved kernel to kernel, they are also read on
+   * the side for `observe`, see ObservedTransferInKernel(). */
+  template <typename Observe>
+  void Transfer(InputBuffer* input, size_t size, Observe observe) {
+    while (size > 0 && input->buffered()) {
+      size_t amount;
+      const char* data = input->ReadSome(size, &amount);
+      observe(data, amount);
+      WriteRef(data, amount);
+      size -= amount;
+    }
+    if (size > 0 && !_sink && input->bypassable()
+        && KernelCopyFrom(input->fd()) != KernelCopy::NONE) {
+      Flush();
+      size -= ObservedTransferInKernel(input, size, observe);
+    }
+    while (size > 0) {
+      size_t amount;
+      const char* data = input->ReadSome(size, &amount);
+      observe(data, amount);
+      WriteRef(data, amount);
+      size -= amount;
+    }
+  }
+
+  void Flush() {
+    if (_sink) {
+      if (_size) {
+        _chunk.size = _size;
+        _sink->Publish(_chunk);
+        _sink->AcquireFree(&_chunk);
+        _buffer = _chunk.data;
+      }
+    } else if (!_iov.empty()) {
+      WriteAll(_fd, _iov.data(), _iov.size());
+      _iov.clear();
+      _iov_size = 0;
+      ++_writes;
+    }
+    _size = 0;
+  }
+
+  /* Flush and wait for all the writes to be done. */
+  void Close() {
+    Flush();
+    if (_sink && !_closed) {
+      _sink->Close();
+      _closed = true;
+    }
+    if (_writer.joinable()) {
+      _writer.join();
+    }
+  }
+
+  /* The ring between us and the writer thread, if any. */
+  const ChunkPipe* pipe() const {
+    return _pipe;
+  }
+
+  /* Number of writev(2) calls so far, when not using a ChunkSink. */
+  uint64_t writes() const {
+    return _writes;
+  }
+
+  /* Bytes moved with splice(2) or copy_file_range(2) so far. */
+  uint64_t kernel_copied() const {
+    return _kernel_copied;
+  }
+
+ private:
+  enum class KernelCopy {
+    UNKNOWN,
+    NONE,             // Copy through user space.
+    SPLICE,           // One side is a pipe.
+    COPY_FILE_RANGE,  // Both sides are regular files.
+  };
+
+  static constexpr const size_t ZERO_PAGE_SIZE = 4096;
+  // Read on the side of a transfer in kernel, at a time.
+  static constexpr const size_t SIDE_SIZE = 1 << 20;
+
+  static const char* ZeroPage() {
+    static const char zeros[ZERO_PAGE_SIZE] = {};
+    return zeros;
+  }
+
+  void AddIov(const char* data, size_t size) {
+    if (size == 0) {
+      return;
+    }
+    if (!_iov.empty()) {
+      struct iovec& last = _iov.back();
+      if (static_cast<char*>(last.iov_base) + last.iov_len == data) {
+        last.iov_len += size;
+        _iov_size += size;
+        if (_iov_size >= _capacity) {
+          Flush();
+        }
+        return;
+      }
+    }
+    _iov.push_back({ const_cast<char*>(data), size });
+    _iov_size += size;
+    if (_iov_size >= _capacity || _iov.size() == IOV_MAX) {
+      Flush();
+    }
+  }
+
+  /* Copy into the ChunkSink buffers. */
+  void Copy(const char* data, size_t size) {
+    while (size > 0) {
+      if (_size == _capacity) {
+        Flush();
+      }
+      const size_t amount = std::min(size, _capacity - _size);
+      memcpy(_buffer + _size, data, amount);
+      _size += amount;
+      data += amount;
+      size -= amount;
+    }
+  }
+
+  static bool IsFifo(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+  }
+
+  static bool IsRegular(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  }
+
+  KernelCopy KernelCopyFrom(int in_fd) {
+    if (_kernel_copy == KernelCopy::UNKNOWN) {
+      if (IsFifo(in_fd) || IsFifo(_fd)) {
+        _kernel_copy = KernelCopy::SPLICE;
+      } else if (IsRegular(in_fd) && IsRegular(_fd)) {
+        _kernel_copy = KernelCopy::COPY_FILE_RANGE;
+      } else {
+        _kernel_copy = KernelCopy::NONE;
+      }
+    }
+    return _kernel_copy;
+  }
+
+  /* Move up to `size` bytes straight from the input file descriptor. Return
+   * the amount moved, short only when the kernel refuses the operation, in
+   * which case user space copy is used from now on. */
+  size_t TransferInKernel(InputBuffer* input, size_t size) {
+    constexpr const size_t MAX_CHUNK = 1 << 30;
+    size_t done = 0;
+    while (done < size) {
+      const size_t amount = std::min(size - done, MAX_CHUNK);
+      ssize_t r;
+      if (_kernel_copy == KernelCopy::SPLICE) {
+        r = splice(input->fd(), nullptr, _fd, nullptr, amount,
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+      } else {
+        r = copy_file_range(input->fd(), nullptr, _fd, nullptr, amount, 0);
+      }
+      if (r < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (done == 0 && (errno == EINVAL || errno == ENOSYS
+                          || errno == EXDEV || errno == EOPNOTSUPP
+                          || errno == EBADF)) {
+          _kernel_copy = KernelCopy::NONE;
+          break;
+        }
+        std::cerr << "Transfer error: " << strerror(errno) << std::endl;
+        abort();
+      }
+      if (r == 0) {
+        std::cerr << "Read error: unexpected end of input" << std::endl;
+        abort();
+      }
+      input->Bypass(r);
+      done += r;
+    }
+    _kernel_copied += done;
+    return done;
+  }
+
+  /* TransferInKernel() a chunk at a time, each one first read on the side
+   * and given to `observe`: with pread(2) from a regular file, or from a
+   * pipe it is duplicated to with tee(2). Return the amount done, short
+   * when the input allows neither, the rest goes through user space. */
+  template <typename Observe>
+  size_t ObservedTransferInKernel(InputBuffer* input, size_t size,
+                                  Observe observe) {
+    const bool from_pipe = IsFifo(input->fd());
+    if (from_pipe && _tee[0] < 0) {
+      if (pipe2(_tee, O_CLOEXEC) != 0) {
+        return 0;
+      }
+      fcntl(_tee[1], F_SETPIPE_SZ, SIDE_SIZE);  // Best effort.
+    }
+    if (!_side) {
+      _side.reset(new char[SIDE_SIZE]);
+    }
+    size_t done = 0;
+    while (done < size) {
+      const ssize_t r = from_pipe ? tee(input->fd(), _tee[1],
+                                        std::min(size - done, SIDE_SIZE), 0)
+                                  : pread(input->fd(), _side.get(),
+                                          std::min(size - done, SIDE_SIZE),
+                                          lseek(input->fd(), 0, SEEK_CUR));
+      if (r < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (done == 0 && (errno == EINVAL || errno == ESPIPE)) {
+          return 0;
+        }
+        std::cerr << "Read error: " << strerror(errno) << std::endl;
+        abort();
+      }
+      if (r == 0) {
+        std::cerr << "Read error: unexpected end of input" << std::endl;
+        abort();
+      }
+      if (from_pipe) {
+        ReadAll(_tee[0], _side.get(), r);
+      }
+      observe(_side.get(), size_t(r));
+      const size_t moved = TransferInKernel(input, r);
+      done += moved;
+      if (moved < size_t(r)) {
+        // Refused by the kernel, the rest of the chunk is already observed.
+        for (size_t left = r - moved; left > 0;) {
+          size_t amount;
+          const char* data = input->ReadSome(left, &amount);
+          WriteRef(data, amount);
+          left -= amount;
+        }
+        done += r - moved;
+        break;
+      }
+    }
+    return done;
+  }
+
+  static void ReadAll(int fd, char* data, size_t size) {
+    while (size > 0) {
+      const ssize_t r = read(fd, data, size);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r <= 0) {
+        std::cerr << "Read error: " << (r ? strerror(errno) : "end of pipe")
+          << std::endl;
+        abort();
+      }
+      data += r;
+      size -= r;
+    }
+  }
+
+  static void WriterLoop(int fd, ChunkPipe* pipe) {
+    Chunk chunk;
+    while (pipe->AcquireFilled(&chunk)) {
+      WriteAll(fd, chunk.data, chunk.size);
+      pipe->Release(chunk);
+    }
+  }
+
+  static void WriteAll(int fd, const char* data, size_t size) {
+    struct iovec iov = { const_cast<char*>(data), size };
+    WriteAll(fd, &iov, 1);
+  }
+
+  static void WriteAll(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+      const ssize_t r = writev(fd, iov, count);
+      if (r < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        std::cerr << "Write error: " << strerror(errno) << std::endl;
+        abort();
+      }
+      size_t done = r;
+      while (count > 0 && done >= iov->iov_len) {
+        done -= iov->iov_len;
+        ++iov;
+        --count;
+      }
+      if (count > 0) {
+        iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+        iov->iov_len -= done;
+      }
+    }
+  }
+
+  int                     _fd;
+  size_t                  _capacity;
+  std::unique_ptr<char[]> _owned;
+  char*                   _buffer;
+  size_t                  _size = 0;
+  std::vector<iovec>      _iov;
+  size_t                  _iov_size = 0;
+  uint64_t                _writes = 0;
+  KernelCopy              _kernel_copy = KernelCopy::UNKNOWN;
+  uint64_t                _kernel_copied = 0;
+  std::unique_ptr<char[]> _side;  // See ObservedTransferInKernel().
+  int                     _tee[2] = { -1, -1 };
+
+  std::unique_ptr<ChunkSink> _sink;
+  bool                       _closed = false;
+  ChunkPipe*                 _pipe = nullptr;
+  CompressingWriter*         _compressor = nullptr;
+  std::thread                _writer;
+#ifdef DUMP2TAR_IO_URING
+  UringWriter*               _uring = nullptr;
+#endif
+  Chunk                      _chunk = { nullptr, 0 };
+};
+
+// Odr-used by WriteZeros() and ObservedTransferInKernel().
+constexpr const size_t OutputBuffer::ZERO_PAGE_SIZE;
+constexpr const size_t OutputBuffer::SIDE_SIZE;
+
+}  // namespace io
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_OUTPUT_BUFFER_H_
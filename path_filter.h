@@ -0,0 +1,166 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_PATH_FILTER_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_PATH_FILTER_H_
+
+#include <fnmatch.h>
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "./dump_reader.h"
+#include "./inode_table.h"
+
+namespace dump {
+
+/* Selects paths with include and exclude patterns.
+ *
+ * Patterns are shell globs where '*' also matches '/'. A pattern starting
+ * with '/' is matched against the whole path, any other one against the end
+ * of the path, after a '/'. A path matching a pattern selects or excludes
+ * everything below it too. Excludes win over includes. Without includes,
+ * everything that is not excluded is selected.
+ *
+ * Every directory is decided once, from its parent and its own path, and the
+ * decision is kept: what is below a decided directory is not matched at all,
+ * and no path is even resolved below an excluded one. */
+class PathFilter {
+ public:
+  void Include(const std::string& pattern) {
+    _includes.push_back(Normalize(pattern));
+  }
+
+  void Exclude(const std::string& pattern) {
+    _excludes.push_back(Normalize(pattern));
+  }
+
+  /* Add the patterns of `path`, one per line. Empty lines and lines starting
+   * with '#' are ignored. Return false if the file cannot be read. */
+  bool IncludeFrom(const char* path) {
+    return ReadPatterns(path, &_includes);
+  }
+
+  bool ExcludeFrom(const char* path) {
+    return ReadPatterns(path, &_excludes);
+  }
+
+  bool empty() const {
+    return _includes.empty() && _excludes.empty();
+  }
+
+  /* Whether the name `name` of an inode is selected. */
+  bool Selected(StreamReader* reader, const InodeTable::Name& name) {
+    const Decision parent = DecideDirectory(reader, name.parent_inode);
+    if (parent == Decision::EXCLUDED
+        || (parent == Decision::INCLUDED && _excludes.empty())) {
+      return parent == Decision::INCLUDED;
+    }
+    return Decide(reader->ResolvePath(name).str(), parent)
+        == Decision::INCLUDED;
+  }
+
+  /* Whether the directory `inode` itself is selected. */
+  bool SelectedDirectory(StreamReader* reader, uint32_t inode) {
+    return DecideDirectory(reader, inode) == Decision::INCLUDED;
+  }
+
+ private:
+  enum class Decision : uint8_t {
+    UNKNOWN,    // Not decided yet.
+    EXCLUDED,   // With everything below.
+    INCLUDED,   // Everything below too, unless excluded.
+    UNMATCHED,  // Neither, what is below is matched on its own.
+  };
+
+  static std::string Normalize(std::string pattern) {
+    while (pattern.size() > 1 && pattern.back() == '/') {
+      pattern.pop_back();
+    }
+    if (pattern.empty() || pattern[0] != '/') {
+      pattern.insert(0, "*/");
+    }
+    return pattern;
+  }
+
+  static bool ReadPatterns(const char* path, std::vector<std::string>* out) {
+    std::ifstream file(path);
+    if (!file) {
+      return false;
+    }
+    for (std::string line; std::getline(file, line);) {
+      if (!line.empty() && line[0] != '#') {
+        out->push_back(Normalize(line));
+      }
+    }
+    return !file.bad();
+  }
+
+  static bool Matches(const std::vector<std::string>& patterns,
+                      const std::string& path) {
+    for (const auto& pattern : patterns) {
+      if (fnmatch(pattern.c_str(), path.c_str(), 0) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  Decision Decide(const std::string& path, Decision parent) const {
+    if (parent == Decision::EXCLUDED || Matches(_excludes, path)) {
+      return Decision::EXCLUDED;
+    }
+    if (parent == Decision::INCLUDED || _includes.empty()
+        || Matches(_includes, path)) {
+      return Decision::INCLUDED;
+    }
+    return Decision::UNMATCHED;
+  }
+
+  Decision DecideDirectory(StreamReader* reader, uint32_t inode) {
+    if (inode >= _directories.size()) {
+      _directories.resize(inode + 1, Decision::UNKNOWN);
+    }
+    if (_directories[inode] != Decision::UNKNOWN) {
+      return _directories[inode];
+    }
+    Decision decision;
+    InodeTable::Name name;
+    if (inode == 2) {
+      decision = Decide("/", Decision::UNMATCHED);
+    } else if (reader->names().Find(inode, &name)) {
+      const Decision parent = DecideDirectory(reader, name.parent_inode);
+      if (parent == Decision::EXCLUDED
+          || (parent == Decision::INCLUDED && _excludes.empty())) {
+        decision = parent;
+      } else {
+        decision = Decide(reader->ResolvePath(name).str(), parent);
+      }
+    } else {
+      return Decision::UNMATCHED;  // Not known yet, do not keep it.
+    }
+    _directories[inode] = decision;
+    return decision;
+  }
+
+  std::vector<std::string> _includes;
+  std::vector<std::string> _excludes;
+  std::vector<Decision>    _directories;  // Indexed by inode.
+};
+
+}  // namespace dump
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_PATH_FILTER_H_
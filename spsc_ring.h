@@ -0,0 +1,196 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_SPSC_RING_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_SPSC_RING_H_
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace io {
+
+/* Lock-free single producer, single consumer ring of `capacity` elements. */
+template <typename T>
+class SpscRing {
+ public:
+  explicit SpscRing(size_t capacity)
+      : _size(capacity + 1), _slots(new T[capacity + 1]) {
+  }
+
+  bool TryPush(const T& v) {
+    const size_t tail = _tail.load(std::memory_order_relaxed);
+    const size_t next = (tail + 1) % _size;
+    if (next == _head.load(std::memory_order_acquire)) {
+      return false;  // full.
+    }
+    _slots[tail] = v;
+    _tail.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool TryPop(T* v) {
+    const size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire)) {
+      return false;  // empty.
+    }
+    *v = _slots[head];
+    _head.store((head + 1) % _size, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  const size_t         _size;
+  std::unique_ptr<T[]> _slots;
+  // Keep the indexes on their own cache line, they are each written by a
+  // different thread.
+  char                 _pad0[64];
+  std::atomic<size_t>  _head{0};
+  char                 _pad1[64];
+  std::atomic<size_t>  _tail{0};
+};
+
+struct Chunk {
+  char*  data;
+  size_t size;
+};
+
+/* Hands out filled chunks, in stream order. */
+class ChunkSource {
+ public:
+  virtual ~ChunkSource() = default;
+
+  /* Return false once the end of the stream is reached. */
+  virtual bool AcquireFilled(Chunk* chunk) = 0;
+  virtual void Release(const Chunk& chunk) = 0;
+};
+
+/* Takes filled chunks, in stream order. */
+class ChunkSink {
+ public:
+  virtual ~ChunkSink() = default;
+
+  virtual bool AcquireFree(Chunk* chunk) = 0;
+  virtual void Publish(const Chunk& chunk) = 0;
+  /* No more chunks will be published. */
+  virtual void Close() = 0;
+};
+
+/* A fixed set of `depth` buffers of `chunk_size` bytes cycling between a
+ * producer thread that fills them and a consumer thread that drains them.
+ *
+ * Waiting is done by spinning a little, then sleeping briefly. Each time a
+ * side has to wait counts as one stall for that side: the side that stalls
+ * most is waiting on the other, which is the bottleneck. */
+class ChunkPipe: public ChunkSource, public ChunkSink {
+ public:
+  ChunkPipe(size_t depth, size_t chunk_size)
+      : _chunk_size(chunk_size), _free(depth), _filled(depth) {
+    assert(depth > 0);
+    for (size_t i = 0; i < depth; ++i) {
+      _buffers.emplace_back(new char[chunk_size]);
+      _free.TryPush(Chunk{ _buffers.back().get(), 0 });
+    }
+  }
+
+  size_t chunk_size() const {
+    return _chunk_size;
+  }
+
+  /* Producer side. Return false if the pipe was stopped. */
+  bool AcquireFree(Chunk* chunk) override {
+    if (!Wait(&_free, chunk, &_producer_stalls)) {
+      return false;
+    }
+    chunk->size = 0;
+    return true;
+  }
+
+  void Publish(const Chunk& chunk) override {
+    const bool pushed = _filled.TryPush(chunk);
+    assert(pushed);
+    (void)pushed;
+  }
+
+  void Close() override {
+    _closed.store(true, std::memory_order_release);
+  }
+
+  /* Consumer side. Return false once the pipe is closed and drained. */
+  bool AcquireFilled(Chunk* chunk) override {
+    return Wait(&_filled, chunk, &_consumer_stalls);
+  }
+
+  void Release(const Chunk& chunk) override {
+    const bool pushed = _free.TryPush(chunk);
+    assert(pushed);
+    (void)pushed;
+  }
+
+  /* Wake up and fail any pending or future wait. */
+  void Stop() {
+    _stopped.store(true, std::memory_order_release);
+  }
+
+  uint64_t producer_stalls() const {
+    return _producer_stalls.load(std::memory_order_relaxed);
+  }
+
+  uint64_t consumer_stalls() const {
+    return _consumer_stalls.load(std::memory_order_relaxed);
+  }
+
+ private:
+  bool Wait(SpscRing<Chunk>* ring, Chunk* chunk,
+            std::atomic<uint64_t>* stalls) {
+    if (ring->TryPop(chunk)) {
+      return true;
+    }
+    stalls->fetch_add(1, std::memory_order_relaxed);
+    for (unsigned spin = 0;; ++spin) {
+      if (ring->TryPop(chunk)) {
+        return true;
+      }
+      if (_stopped.load(std::memory_order_acquire)) {
+        return false;
+      }
+      if (ring == &_filled && _closed.load(std::memory_order_acquire)) {
+        // Publish happens before Close, look one last time.
+        return ring->TryPop(chunk);
+      }
+      if (spin < 64) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    }
+  }
+
+  const size_t                         _chunk_size;
+  std::vector<std::unique_ptr<char[]>> _buffers;
+  SpscRing<Chunk>                      _free;
+  SpscRing<Chunk>                      _filled;
+  std::atomic<bool>                    _closed{false};
+  std::atomic<bool>                    _stopped{false};
+  std::atomic<uint64_t>                _producer_stalls{0};
+  std::atomic<uint64_t>                _consumer_stalls{0};
+};
+
+}  // namespace io
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_SPSC_RING_H_
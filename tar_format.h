@@ -15,16 +15,16 @@
 #ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_TAR_FORMAT_H_
 #define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_TAR_FORMAT_H_
 
-#include <cmath>
 #include <cstdint>
 #include <cstring>
 #include <cassert>
 
 #include <iostream>
-#include <sstream>
+#include <string>
 #include <utility>
 #include <vector>
 
+#include "./checksum.h"
 #include "./common.h"
 
 namespace tar {
@@ -34,6 +34,8 @@ constexpr const unsigned BLOCK_SIZE = 512;
 namespace format {
 
 constexpr const char POSIX_USTAR_MAGIC[6] = { "ustar" };
+// GNU tar's magic and version, "ustar  \0" across both fields.
+constexpr const char GNU_MAGIC[7] = { "ustar " };
 
 enum class FitResult {
   FIT_ALL,        // All good, it fits.
@@ -132,12 +134,33 @@ struct IntField: public Field<SIZE> {
       memset(begin + 1, '0', end - begin - 1);
       *begin = '-';
     } else {
-      do { *--end = '0' + int_val % BASE; } while ((int_val /= BASE) != 0);
+      auto u = static_cast<uint64_t>(int_val);
+      do { *--end = '0' + u % BASE; } while ((u /= BASE) != 0);
       memset(begin, '0', end - begin);
     }
     return fit;
   }
 
+  /* GNU base-256 encoding for values too large for octal: the first byte is
+   * 0x80, followed by the value in big-endian. */
+  FitResult SetBase256(value_t v) {
+    if (static_cast<int64_t>(v) < 0) {
+      return FitResult::FIT_OVERFLOW;
+    }
+    auto u = static_cast<uint64_t>(static_cast<int64_t>(v));
+    char bytes[SIZE];
+    for (unsigned i = SIZE - 1; i > 0; --i) {
+      bytes[i] = static_cast<char>(u & 0xFF);
+      u >>= 8;
+    }
+    if (u) {
+      return FitResult::FIT_OVERFLOW;
+    }
+    bytes[0] = static_cast<char>(0x80);
+    memcpy(this->raw, bytes, SIZE);
+    return FitResult::FIT_ALL;
+  }
+
   IntField& operator=(value_t v) {
     if (Set(v) == FitResult::FIT_OVERFLOW) {
       std::cerr << "OUT OF RANGE value -> str conversion" << std::endl;
@@ -155,11 +178,14 @@ struct TextField: public Field<SIZE> {
   }
 
   FitResult Set(const std::string& s) {
-    const auto size = s.size();
+    return Set(s.data(), s.size());
+  }
+
+  FitResult Set(const char* data, size_t size) {
     if (size > sizeof this->raw) {
       return FitResult::FIT_OVERFLOW;
     }
-    memcpy(this->raw, s.data(), size);
+    memcpy(this->raw, data, size);
     memset(this->raw + size, '\0', sizeof this->raw - size);
     if (this->raw[sizeof this->raw - 1]) {
       return FitResult::FIT_OVERWRITE;
@@ -194,6 +220,8 @@ struct FileHeader {
     DIRECTORY = '5',
     FIFO      = '6',
     PAX_ATTR  = 'x',
+    GNU_LONGNAME = 'L',
+    GNU_LONGLINK = 'K',
   };
 
   Type           type;
@@ -207,65 +235,113 @@ struct FileHeader {
   TextField<155> filename_prefix;
   char           spare[12];
 
-  void Finalize() {
-    magic = POSIX_USTAR_MAGIC;
-    version = "00";
-    checksum.Fill(' ');
-    const auto& as_uint8 = reinterpret_cast<
-        const uint8_t(&)[sizeof *this / sizeof (uint8_t)]
-        >(*this);
-    uint64_t sum = 0;
-    for (auto v : as_uint8) {
-      sum += v;
+  void Finalize(bool gnu = false) {
+    if (gnu) {
+      magic.Set(GNU_MAGIC, sizeof GNU_MAGIC - 1);
+      version.Set(" ", 1);
+    } else {
+      magic.Set(POSIX_USTAR_MAGIC, sizeof POSIX_USTAR_MAGIC - 1);
+      version.Set("00", 2);
     }
-    checksum = sum;
+    checksum.Fill(' ');
+    checksum = checksum::SumBytes(this, sizeof *this);
   }
 };
 static_assert(sizeof(FileHeader) == BLOCK_SIZE, "Wrong size for FileHeader");
 
-template <typename T>
-struct PaxEntry {
-  explicit PaxEntry(const char* k): key(k) {
-    assert(k);
+inline size_t DecimalDigits(uint64_t v) {
+  size_t n = 1;
+  for (; v >= 100; v /= 100) {
+    n += 2;
   }
-
-  template <typename U>
-  PaxEntry(const char* k, U&& v): key(k), value(std::forward<U>(v)) {
-    assert(k);
+  return n + (v >= 10);
+}
+
+/* Write `v` in decimal at `out`, return the number of digits. */
+inline size_t FormatDecimal(uint64_t v, char* out) {
+  static const char pairs[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233"
+      "34353637383940414243444546474849505152535455565758596061626364656667"
+      "6869707172737475767778798081828384858687888990919293949596979899";
+  const size_t n = DecimalDigits(v);
+  char* end = out + n;
+  while (v >= 100) {
+    end -= 2;
+    memcpy(end, &pairs[(v % 100) * 2], 2);
+    v /= 100;
   }
-
-  const char* key;
-  T value;
-
-  void Serialize(std::vector<char>* buffer) const {
-    std::ostringstream os;
-    os << " " << key << "=" << std::fixed << value << "\n";
-
-    auto size = os.str().size();
-    int nb_digit = 1;
-
-    if (size >= 9) {
-      switch (size) {
-        case   9: nb_digit = 2; break;
-        case  98: nb_digit = 3; break;
-        case 997: nb_digit = 4; break;
-        default:
-           nb_digit = static_cast<int>(log10(size)) + 1;
-           if (size == (pow(10, nb_digit) - nb_digit)) {
-             nb_digit += 1;
-           }
-      }
-    }
-    size += nb_digit;
-
-    buffer->resize(buffer->size() + size);
-    auto end = &(*buffer)[buffer->size() - size];
-
-    const auto size_str = std::to_string(size);
-    memcpy(end, size_str.data(), size_str.size());
-    memcpy(end + size_str.size(), os.str().data(), os.str().size());
+  if (v >= 10) {
+    memcpy(end - 2, &pairs[v * 2], 2);
+  } else {
+    end[-1] = '0' + v;
   }
-};
+  return n;
+}
+
+/* Write `us` microseconds as seconds with 6 decimals at `out`, return the
+ * number of characters. */
+inline size_t FormatFixedPoint6(uint64_t us, char* out) {
+  size_t n = FormatDecimal(us / 1000000, out);
+  out[n++] = '.';
+  // Leading zeros of the fraction: format 1000000 + frac, then overwrite the
+  // '1'.
+  FormatDecimal(1000000 + us % 1000000, out + n - 1);
+  out[n - 1] = '.';
+  return n + 6;
+}
+
+/* Append the pax extended header record "<length> <key>=<value>\n" to
+ * `buffer`. <length> counts the whole record, itself included. */
+inline void AppendPaxRecord(const char* key, const char* value,
+                            size_t value_len, std::vector<char>* buffer) {
+  const size_t key_len = strlen(key);
+  const size_t body_len = 1 + key_len + 1 + value_len + 1;
+  size_t nb_digit = DecimalDigits(body_len);
+  if (DecimalDigits(body_len + nb_digit) != nb_digit) {
+    ++nb_digit;  // Adding the length made it one digit longer.
+  }
+  const size_t size = body_len + nb_digit;
+
+  // Short records are put together on the stack and appended at once,
+  // resize() would first fill them with zeroes.
+  char record[128];
+  char* out = size <= sizeof record ? record : nullptr;
+  if (!out) {
+    const size_t offset = buffer->size();
+    buffer->resize(offset + size);
+    out = &(*buffer)[offset];
+  }
+  char* const begin = out;
+  out += FormatDecimal(size, out);
+  *out++ = ' ';
+  memcpy(out, key, key_len);
+  out += key_len;
+  *out++ = '=';
+  memcpy(out, value, value_len);
+  out += value_len;
+  *out = '\n';
+  if (begin == record) {
+    buffer->insert(buffer->end(), record, record + size);
+  }
+}
+
+inline void AppendPaxRecord(const char* key, const std::string& value,
+                            std::vector<char>* buffer) {
+  AppendPaxRecord(key, value.data(), value.size(), buffer);
+}
+
+inline void AppendPaxRecord(const char* key, uint64_t value,
+                            std::vector<char>* buffer) {
+  char digits[20];
+  AppendPaxRecord(key, digits, FormatDecimal(value, digits), buffer);
+}
+
+/* A time in microseconds, as seconds with 6 decimals. */
+inline void AppendPaxTime(const char* key, uint64_t us,
+                          std::vector<char>* buffer) {
+  char digits[28];
+  AppendPaxRecord(key, digits, FormatFixedPoint6(us, digits), buffer);
+}
 
 }  // namespace format
 }  // namespace tar
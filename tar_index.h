@@ -0,0 +1,292 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_TAR_INDEX_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_TAR_INDEX_H_
+
+#include <endian.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "./common.h"
+#include "./tar_writer.h"
+
+namespace tar {
+
+/* Sidecar index of the members of an archive, to get to one of them with a
+ * seek instead of reading the archive up to it.
+ *
+ * The file is a header, the entries sorted by path, then a string table of
+ * the paths. All the numbers are little-endian, the file can be mapped in
+ * memory and searched in place, see IndexReader. */
+namespace index_format {
+
+constexpr const char MAGIC[8] = { 'D', '2', 'T', 'I', 'N', 'D', 'E', 'X' };
+constexpr const uint32_t VERSION = 1;
+constexpr const uint32_t FLAG_COMPRESSED = 1;
+// frame_offset of the entries when the archive is not compressed.
+constexpr const uint64_t NO_FRAME = ~uint64_t(0);
+
+struct Header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t entry_count;
+  uint64_t entries_offset;  // From the start of the file.
+  uint64_t strings_offset;
+  uint64_t strings_size;
+  uint64_t reserved[2];
+};
+static_assert(sizeof (Header) == 64, "Wrong size for Header");
+
+struct Entry {
+  uint64_t header_offset;  // First header of the member, pax or GNU ones
+                           // included, in the uncompressed archive.
+  uint64_t data_offset;    // First byte of content.
+  uint64_t size;           // Size of the file, holes included.
+  uint64_t mtime_us;
+  uint64_t frame_offset;   // In the compressed archive, the first gzip member
+                           // or zstd frame to decompress from, or NO_FRAME.
+  uint32_t frame_skip;     // Uncompressed bytes from frame_offset to
+                           // header_offset.
+  uint32_t inode;
+  uint64_t path_offset;    // In the string table, '\0' terminated.
+  uint32_t path_size;
+  uint32_t type;           // The ustar type flag of the member.
+};
+static_assert(sizeof (Entry) == 64, "Wrong size for Entry");
+
+}  // namespace index_format
+
+/* Collects the members as they are written, and writes the index once the
+ * archive is complete. */
+class IndexWriter {
+ public:
+  void Add(const File& file, uint32_t inode, uint64_t header_offset,
+           uint64_t data_offset) {
+    index_format::Entry entry;
+    memset(&entry, 0, sizeof entry);
+    entry.header_offset = header_offset;
+    entry.data_offset = data_offset;
+    entry.size = file.size;
+    entry.mtime_us = file.mtime_us;
+    entry.frame_offset = index_format::NO_FRAME;
+    entry.inode = inode;
+    entry.path_offset = _strings.size();
+    entry.path_size = file.filename.size();
+    entry.type = TypeFlag(file.type);
+    _strings.insert(_strings.end(), file.filename.begin(),
+                    file.filename.end());
+    _strings.push_back('\0');
+    _entries.push_back(entry);
+  }
+
+  /* Sort the entries and write the index to `fd`. When the archive is
+   * compressed, `frame_of(offset, &frame_offset, &frame_start)` gives the
+   * compressed offset of the frame holding `offset` of the uncompressed
+   * archive, and the uncompressed offset that frame starts at. */
+  template <typename FrameOf>
+  void Write(int fd, bool compressed, FrameOf frame_of) {
+    using index_format::Entry;
+    std::vector<uint32_t> order(_entries.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+      return strcmp(Path(_entries[a]), Path(_entries[b])) < 0;
+    });
+
+    index_format::Header header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, index_format::MAGIC, sizeof header.magic);
+    header.version = htole32(index_format::VERSION);
+    header.flags = htole32(compressed ? index_format::FLAG_COMPRESSED : 0);
+    header.entry_count = htole64(_entries.size());
+    header.entries_offset = htole64(sizeof header);
+    header.strings_offset = htole64(sizeof header
+                                    + _entries.size() * sizeof (Entry));
+    header.strings_size = htole64(_strings.size());
+    WriteAll(fd, &header, sizeof header, "Index");
+
+    std::vector<Entry> sorted;
+    sorted.reserve(std::min<size_t>(_entries.size(), WRITE_BATCH));
+    for (const uint32_t i : order) {
+      Entry entry = _entries[i];
+      if (compressed) {
+        uint64_t frame_start;
+        frame_of(entry.header_offset, &entry.frame_offset, &frame_start);
+        entry.frame_skip = entry.header_offset - frame_start;
+      }
+      sorted.push_back(ToLittleEndian(entry));
+      if (sorted.size() == WRITE_BATCH) {
+        WriteAll(fd, sorted.data(), sorted.size() * sizeof (Entry),
+                 "Index");
+        sorted.clear();
+      }
+    }
+    WriteAll(fd, sorted.data(), sorted.size() * sizeof (Entry), "Index");
+    WriteAll(fd, _strings.data(), _strings.size(), "Index");
+  }
+
+  size_t size() const {
+    return _entries.size();
+  }
+
+ private:
+  static constexpr const size_t WRITE_BATCH = 4096;
+
+  const char* Path(const index_format::Entry& entry) const {
+    return &_strings[entry.path_offset];
+  }
+
+  static uint32_t TypeFlag(FileType type) {
+    using Type = format::FileHeader::Type;
+    switch (type) {
+      case FileType::REGULAR: return uint32_t(Type::REGULAR);
+      case FileType::LINK: return uint32_t(Type::LINK);
+      case FileType::SYMLINK: return uint32_t(Type::SYMLINK);
+      case FileType::CHAR_DEV: return uint32_t(Type::CHAR_DEV);
+      case FileType::BLOCK_DEV: return uint32_t(Type::BLOCK_DEV);
+      case FileType::DIRECTORY: return uint32_t(Type::DIRECTORY);
+      case FileType::FIFO: return uint32_t(Type::FIFO);
+    }
+    return 0;
+  }
+
+  static index_format::Entry ToLittleEndian(index_format::Entry entry) {
+    entry.header_offset = htole64(entry.header_offset);
+    entry.data_offset = htole64(entry.data_offset);
+    entry.size = htole64(entry.size);
+    entry.mtime_us = htole64(entry.mtime_us);
+    entry.frame_offset = htole64(entry.frame_offset);
+    entry.frame_skip = htole32(entry.frame_skip);
+    entry.inode = htole32(entry.inode);
+    entry.path_offset = htole64(entry.path_offset);
+    entry.path_size = htole32(entry.path_size);
+    entry.type = htole32(entry.type);
+    return entry;
+  }
+
+  std::vector<index_format::Entry> _entries;
+  std::vector<char>                _strings;
+};
+
+constexpr const size_t IndexWriter::WRITE_BATCH;
+
+/* An index file mapped in memory. */
+class IndexReader {
+ public:
+  /* Return false if the file cannot be mapped or is not an index. */
+  bool Open(const char* path) {
+    if (!_file.Open(path, sizeof (Header))) {
+      return false;
+    }
+    const char* data = _file.data();
+    const size_t size = _file.size();
+    const Header& header = *reinterpret_cast<const Header*>(data);
+    const uint64_t count = le64toh(header.entry_count);
+    const uint64_t entries_offset = le64toh(header.entries_offset);
+    const uint64_t strings_offset = le64toh(header.strings_offset);
+    const uint64_t strings_size = le64toh(header.strings_size);
+    // Every term is bounded by the file size before it is added to, none of
+    // the sums can wrap around.
+    if (memcmp(header.magic, index_format::MAGIC, sizeof header.magic) != 0
+        || le32toh(header.version) != index_format::VERSION
+        || count > size / sizeof (Entry)
+        || entries_offset > size
+        || entries_offset + count * sizeof (Entry) > strings_offset
+        || strings_offset > size
+        || strings_size > size - strings_offset) {
+      return false;
+    }
+    _count = count;
+    _entries = reinterpret_cast<const Entry*>(data + entries_offset);
+    _strings = data + strings_offset;
+    _strings_size = strings_size;
+    return true;
+  }
+
+  size_t size() const {
+    return _count;
+  }
+
+  /* The entry at `i`, numbers in host order. */
+  index_format::Entry At(size_t i) const {
+    index_format::Entry entry = _entries[i];
+    entry.header_offset = le64toh(entry.header_offset);
+    entry.data_offset = le64toh(entry.data_offset);
+    entry.size = le64toh(entry.size);
+    entry.mtime_us = le64toh(entry.mtime_us);
+    entry.frame_offset = le64toh(entry.frame_offset);
+    entry.frame_skip = le32toh(entry.frame_skip);
+    entry.inode = le32toh(entry.inode);
+    entry.path_offset = le64toh(entry.path_offset);
+    entry.path_size = le32toh(entry.path_size);
+    entry.type = le32toh(entry.type);
+    return entry;
+  }
+
+  /* The path of `entry`, which must lie in the string table with its
+   * '\0'. */
+  const char* Path(const index_format::Entry& entry) const {
+    if (entry.path_offset >= _strings_size
+        || entry.path_size >= _strings_size - entry.path_offset
+        || _strings[entry.path_offset + entry.path_size] != '\0') {
+      std::cerr << "Corrupted index, path out of bounds" << std::endl;
+      abort();
+    }
+    return _strings + entry.path_offset;
+  }
+
+  /* Binary search of `path`. Return false if it is not in the index. */
+  bool Find(const char* path, index_format::Entry* entry) const {
+    size_t begin = 0;
+    size_t end = _count;
+    while (begin < end) {
+      const size_t middle = begin + (end - begin) / 2;
+      *entry = At(middle);
+      const int c = strcmp(Path(*entry), path);
+      if (c == 0) {
+        return true;
+      }
+      if (c < 0) {
+        begin = middle + 1;
+      } else {
+        end = middle;
+      }
+    }
+    return false;
+  }
+
+ private:
+  using Header = index_format::Header;
+  using Entry = index_format::Entry;
+
+  MappedFile   _file;
+  size_t       _count = 0;
+  const Entry* _entries = nullptr;
+  const char*  _strings = nullptr;
+  size_t       _strings_size = 0;
+};
+
+}  // namespace tar
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_TAR_INDEX_H_
@@ -15,6 +15,9 @@
 #ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_TAR_WRITER_H_
 #define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_TAR_WRITER_H_
 
+#include <algorithm>
+#include <utility>
+
 #include "./tar_format.h"
 
 
@@ -30,6 +33,12 @@ enum class FileType {
   FIFO,
 };
 
+/* A run of data of a sparse file, the rest of the file is holes. */
+struct SparseRegion {
+  uint64_t offset;
+  uint64_t size;
+};
+
 struct File {
   FileType    type;
   Permissions perms;
@@ -45,64 +54,166 @@ struct File {
 
   uint64_t    size;
 
-  double      mtime;
-  double      ctime;
-  double      atime;
+  uint64_t    mtime_us;
+  uint64_t    ctime_us;
+  uint64_t    atime_us;
 
   uint32_t    device_major;
   uint32_t    device_minor;
+
+  // The data regions of a regular file with holes, in order, or empty for a
+  // plain file. A file ending with a hole ends with an empty region at its
+  // size. Only pax can hold them, other formats ignore them.
+  std::vector<SparseRegion> sparse;
+
+  // More pax records, as (keyword, value). Other formats ignore them.
+  std::vector<std::pair<std::string, std::string>> pax_records;
+};
+
+/* How headers are encoded.
+ *
+ * PAX:   ustar headers, plus pax extended headers for what ustar cannot hold
+ *        and for the kept times.
+ * USTAR: strict ustar, entries it cannot hold are rejected. Long paths are
+ *        split between the name and prefix fields.
+ * GNU:   GNU tar format, with ././@LongLink entries for long names and
+ *        base-256 for large numbers. */
+enum class HeaderFormat {
+  PAX,
+  USTAR,
+  GNU,
+};
+
+struct HeaderPolicy {
+  HeaderFormat format = HeaderFormat::PAX;
+  // Only pax extended headers can hold these, they cost one pax header per
+  // file when kept.
+  bool keep_atime = true;
+  bool keep_ctime = true;
+  bool keep_subsecond_mtime = true;
 };
 
 class StreamWriter {
  public:
-  StreamWriter() {}
+  explicit StreamWriter(const HeaderPolicy& policy = HeaderPolicy())
+      : _policy(policy) {
+  }
 
   struct Result {
-    std::vector<char> buffer;        // buffer to write out.
-    size_t            content_size;  // content to write out.
-    size_t            padding;       // zeroes to write out.
+    const char* header;        // headers to write out, nullptr if the entry
+                               // cannot be represented.
+    size_t      header_size;
+    size_t      content_size;  // content to write out.
+    size_t      padding;       // zeroes to write out.
   };
 
-  Result AddFile(const File& file) {
-    std::vector<char> buffer;
+  /* Bytes of the archive, by kind. */
+  struct Stats {
+    uint64_t headers  = 0;  // ustar headers, one block per entry.
+    uint64_t extended = 0;  // pax and GNU extension entries.
+    uint64_t content  = 0;
+    uint64_t padding  = 0;  // content padding and end of archive.
+    uint64_t rejected = 0;  // entries that could not be represented.
+
+    uint64_t total() const {
+      return headers + extended + content + padding;
+    }
+  };
 
-    buffer.reserve(BLOCK_SIZE*3);
-    buffer.resize(BLOCK_SIZE);
-    auto& pax_record = reinterpret_cast<tar::format::FileHeader&>(buffer[0]);
-    memset(&pax_record, '\0', sizeof pax_record);
+  /* Encode the headers of `file` in `buffer`, which is cleared first. Reusing
+   * the same buffer for every file keeps its memory: once it has grown large
+   * enough, no allocation happens here. `header` points in `buffer`. */
+  Result AddFile(const File& file, std::vector<char>* buffer) {
+    using format::FileHeader;
+    using format::FitResult;
+
+    const bool pax = _policy.format == HeaderFormat::PAX;
+    const bool gnu = _policy.format == HeaderFormat::GNU;
+    const bool sparse = pax && !file.sparse.empty();
+    bool representable = true;
+
+    // Bytes of the file that follow the headers, and the size of the entry:
+    // a sparse file stores its map first, padded to a block, then only its
+    // data regions.
+    uint64_t content_size = file.size;
+    uint64_t entry_size = file.size;
+    size_t sparse_map_size = 0;
+    if (sparse) {
+      content_size = 0;
+      for (const auto& region : file.sparse) {
+        content_size += region.size;
+      }
+      sparse_map_size = SparseMapSize(file.sparse);
+      entry_size = sparse_map_size + content_size;
+    }
 
-    pax_record.filename = ("././pax_entry_" +
-        std::to_string(_pax_entry_counter++));
-    pax_record.perms = Permissions{ 0600 };
-    pax_record.type = format::FileHeader::Type::PAX_ATTR;
+    buffer->clear();
+    if (pax) {
+      // Room for the pax header, filled in last since it holds the size of
+      // the pax records.
+      buffer->resize(BLOCK_SIZE);
+    }
+    const size_t extensions_begin = buffer->size();
 
-    tar::format::FileHeader file_record;
+    FileHeader file_record;
     memset(&file_record, '\0', sizeof file_record);
 
-#define ADD_PAX_ENTRY(attr, pax_name) do { \
-    if (file_record.attr.Set(file.attr) != format::FitResult::FIT_ALL) { \
-      AddPaxEntry(pax_name, file.attr, &buffer); } } while (0)
-
-    ADD_PAX_ENTRY(filename, "path");
+    // What does not fit the ustar header goes in a pax record, or is encoded
+    // the GNU way, or makes the entry unrepresentable in strict ustar.
+#define SET_FIELD(set, pax_record, gnu_fallback) do { \
+    if (set != FitResult::FIT_ALL) { \
+      if (pax) { pax_record; } \
+      else if (gnu) { gnu_fallback; } \
+      else { representable = false; } } } while (0)
+#define SET_NUMBER(attr, value, pax_record) \
+    SET_FIELD(file_record.attr.Set(value), pax_record, \
+              representable &= file_record.attr.SetBase256(value) \
+                               == FitResult::FIT_ALL)
+
+    if (sparse) {
+      // PAX sparse format 1.0: the real name and size are in GNU.sparse.*
+      // records, the ustar header has a made up name for tars that do not
+      // know about it.
+      SetSparseName(&file_record, file.filename);
+      format::AppendPaxRecord("GNU.sparse.major", 1, buffer);
+      format::AppendPaxRecord("GNU.sparse.minor", 0, buffer);
+      format::AppendPaxRecord("GNU.sparse.name", file.filename, buffer);
+      format::AppendPaxRecord("GNU.sparse.realsize", file.size, buffer);
+    } else {
+      SET_FIELD(SetPath(&file_record, file.filename, !gnu),
+                format::AppendPaxRecord("path", file.filename, buffer),
+                AppendGnuLongName(FileHeader::Type::GNU_LONGNAME,
+                                  file.filename, &file_record.filename,
+                                  buffer));
+    }
     file_record.perms = file.perms;
-    ADD_PAX_ENTRY(uid, "uid");
-    ADD_PAX_ENTRY(gid, "gid");
-    ADD_PAX_ENTRY(size, "size");
-
-    if (file.mtime) {
-      if (file.mtime == uint64_t(file.mtime)) {
-        // Second only precision.
-        ADD_PAX_ENTRY(mtime, "mtime");
-      } else {
+    SET_NUMBER(uid, file.uid,
+               format::AppendPaxRecord("uid", file.uid, buffer));
+    SET_NUMBER(gid, file.gid,
+               format::AppendPaxRecord("gid", file.gid, buffer));
+    SET_NUMBER(size, entry_size,
+               format::AppendPaxRecord("size", entry_size, buffer));
+
+    if (file.mtime_us) {
+      const uint64_t mtime = file.mtime_us / 1000000;
+      bool mtime_in_pax = false;
+      SET_NUMBER(mtime, mtime,
+                 (format::AppendPaxTime("mtime", file.mtime_us, buffer),
+                  mtime_in_pax = true));
+      if (pax && !mtime_in_pax && file.mtime_us % 1000000
+          && _policy.keep_subsecond_mtime) {
         // Sub-second precision, only pax extension can handle it.
-        file_record.mtime = file.mtime;
-        AddPaxEntry("mtime", file.mtime, &buffer);
+        format::AppendPaxTime("mtime", file.mtime_us, buffer);
       }
     }
-    if (file.ctime) AddPaxEntry("ctime", file.ctime, &buffer);
-    if (file.atime) AddPaxEntry("atime", file.atime, &buffer);
+    if (pax && _policy.keep_ctime && file.ctime_us) {
+      format::AppendPaxTime("ctime", file.ctime_us, buffer);
+    }
+    if (pax && _policy.keep_atime && file.atime_us) {
+      format::AppendPaxTime("atime", file.atime_us, buffer);
+    }
 
-    using type = format::FileHeader::Type;
+    using type = FileHeader::Type;
     switch (file.type) {
       case FileType::REGULAR: file_record.type = type::REGULAR; break;
       case FileType::LINK: file_record.type = type::LINK; break;
@@ -112,53 +223,207 @@ class StreamWriter {
       case FileType::DIRECTORY: file_record.type = type::DIRECTORY; break;
       case FileType::FIFO: file_record.type = type::FIFO; break;
     }
-    ADD_PAX_ENTRY(linkname, "linkpath");
-    ADD_PAX_ENTRY(username, "uname");
-    ADD_PAX_ENTRY(groupname, "gname");
-    ADD_PAX_ENTRY(device_major, "SCHILY.devmajor");
-    ADD_PAX_ENTRY(device_minor, "SCHILY.devmajor");
+    SET_FIELD(file_record.linkname.Set(file.linkname),
+              format::AppendPaxRecord("linkpath", file.linkname, buffer),
+              AppendGnuLongName(FileHeader::Type::GNU_LONGLINK, file.linkname,
+                                &file_record.linkname, buffer));
+    // The names are only a hint next to the ids, without pax they are dropped
+    // when too long.
+    if (file_record.username.Set(file.username) != FitResult::FIT_ALL
+        && pax) {
+      format::AppendPaxRecord("uname", file.username, buffer);
+    }
+    if (file_record.groupname.Set(file.groupname) != FitResult::FIT_ALL
+        && pax) {
+      format::AppendPaxRecord("gname", file.groupname, buffer);
+    }
+    SET_NUMBER(device_major, file.device_major,
+               format::AppendPaxRecord("SCHILY.devmajor", file.device_major,
+                                       buffer));
+    SET_NUMBER(device_minor, file.device_minor,
+               format::AppendPaxRecord("SCHILY.devminor", file.device_minor,
+                                       buffer));
+    if (pax) {
+      for (const auto& record : file.pax_records) {
+        format::AppendPaxRecord(record.first.c_str(), record.second, buffer);
+      }
+    }
+
+#undef SET_NUMBER
+#undef SET_FIELD
 
-#undef ADD_PAX_ENTRY
+    if (!representable) {
+      ++_stats.rejected;
+      return { nullptr, 0, 0, 0 };
+    }
 
-    const auto pax_size = buffer.size() - sizeof pax_record;
-    file_record.Finalize();
+    const auto pax_size = buffer->size() - extensions_begin;
+    file_record.Finalize(gnu);
 
-    if (pax_size) {
+    if (pax && pax_size) {
+      // The records may have moved the buffer, only take a reference now.
+      // Still all zeroes from the resize above.
+      auto& pax_record = reinterpret_cast<FileHeader&>((*buffer)[0]);
+      SetPaxFilename(&pax_record.filename, _pax_entry_counter++);
+      pax_record.perms = Permissions{ 0600 };
+      pax_record.type = type::PAX_ATTR;
       pax_record.size = pax_size;
       pax_record.Finalize();
 
-      const auto padding = BLOCK_SIZE - (buffer.size() % BLOCK_SIZE);
-      const auto extra_size = padding + sizeof file_record;
-      buffer.resize(buffer.size() + extra_size);
-      auto end = &buffer[buffer.size() - extra_size];
-      memset(end, '\0', padding);
-      memcpy(end + padding, &file_record, sizeof file_record);
-    } else {
-      memcpy(buffer.data(), &file_record, sizeof file_record);
-      buffer.resize(sizeof file_record);
+      const auto padding = (BLOCK_SIZE - buffer->size() % BLOCK_SIZE)
+                           % BLOCK_SIZE;
+      buffer->resize(buffer->size() + padding);
+    } else if (pax) {
+      buffer->clear();  // No pax records, no pax header.
+    }
+    // After the extension entries, if any.
+    const char* record = reinterpret_cast<const char*>(&file_record);
+    buffer->insert(buffer->end(), record, record + sizeof file_record);
+    if (sparse) {
+      AppendSparseMap(file.sparse, sparse_map_size, buffer);
     }
 
+    // The sparse map is a whole number of blocks, the padding only depends
+    // on the content.
+    const size_t padding =
+        (BLOCK_SIZE-1) - (content_size + BLOCK_SIZE - 1) % BLOCK_SIZE;
+    _stats.headers += sizeof file_record;
+    _stats.extended += buffer->size() - sizeof file_record;
+    _stats.content += content_size;
+    _stats.padding += padding;
     return {
-      .buffer = std::move(buffer),
-      .content_size = file.size,
-      .padding = (BLOCK_SIZE-1) - (file.size + BLOCK_SIZE - 1) % BLOCK_SIZE,
+      .header = buffer->data(),
+      .header_size = buffer->size(),
+      .content_size = content_size,
+      .padding = padding,
     };
   }
 
   Result Close() {
+    _stats.padding += BLOCK_SIZE * 2;
     return {
       .padding = BLOCK_SIZE * 2,
     };
   }
 
+  const Stats& stats() const {
+    return _stats;
+  }
+
  private:
-  size_t _pax_entry_counter = 0;
+  HeaderPolicy _policy;
+  size_t       _pax_entry_counter = 0;
+  Stats        _stats;
+
+  /* "././pax_entry_<counter>", formatted in place. */
+  static void SetPaxFilename(format::TextField<100>* field, size_t counter) {
+    static const char prefix[] = "././pax_entry_";
+    memcpy(field->raw, prefix, sizeof prefix - 1);
+    const size_t n = format::FormatDecimal(counter, field->raw
+                                           + sizeof prefix - 1);
+    memset(field->raw + sizeof prefix - 1 + n, '\0',
+           sizeof field->raw - (sizeof prefix - 1 + n));
+  }
 
-  template <typename T>
-    void AddPaxEntry(const char* key, T&& value, std::vector<char>* buffer) {
-      const tar::format::PaxEntry<T> pax_entry { key, std::forward<T>(value) };
-      pax_entry.Serialize(buffer);
+  /* Store `path` in the name field, or when `split` is set, split it at a '/'
+   * between the prefix and name fields like ustar allows. */
+  static format::FitResult SetPath(format::FileHeader* header,
+                                   const std::string& path, bool split) {
+    using format::FitResult;
+    if (header->filename.Set(path) != FitResult::FIT_OVERFLOW) {
+      return FitResult::FIT_ALL;
+    }
+    constexpr const size_t name_size = sizeof header->filename.raw;
+    constexpr const size_t prefix_size = sizeof header->filename_prefix.raw;
+    if (!split || path.size() > prefix_size + 1 + name_size) {
+      return FitResult::FIT_OVERFLOW;
+    }
+    // The first '/' leaving a name short enough, the prefix and the name
+    // must not be empty.
+    size_t i = path.size() > name_size + 1 ? path.size() - name_size - 1 : 1;
+    for (; i <= prefix_size && i + 1 < path.size(); ++i) {
+      if (path[i] == '/') {
+        header->filename_prefix.Set(path.data(), i);
+        header->filename.Set(path.data() + i + 1, path.size() - i - 1);
+        return FitResult::FIT_ALL;
+      }
     }
+    return FitResult::FIT_OVERFLOW;
+  }
+
+  /* "<directory>/GNUSparseFile.0/<name>", the name GNU tar gives to the
+   * ustar header of a sparse file, cut to what the name field holds. */
+  static void SetSparseName(format::FileHeader* header,
+                            const std::string& path) {
+    static const char sparse_directory[] = "GNUSparseFile.0/";
+    const size_t slash = path.rfind('/');
+    const size_t name_begin = slash == std::string::npos ? 0 : slash + 1;
+    char* out = header->filename.raw;
+    const size_t out_size = sizeof header->filename.raw;
+    size_t n = std::min(name_begin, out_size);
+    memcpy(out, path.data(), n);
+    const size_t directory_size = std::min(sizeof sparse_directory - 1,
+                                           out_size - n);
+    memcpy(out + n, sparse_directory, directory_size);
+    n += directory_size;
+    const size_t name_size = std::min(path.size() - name_begin, out_size - n);
+    memcpy(out + n, path.data() + name_begin, name_size);
+  }
+
+  /* Size of the sparse map of PAX format 1.0, padded to a block: the number
+   * of regions and then the offset and size of each, in decimal, one per
+   * line. */
+  static size_t SparseMapSize(const std::vector<SparseRegion>& regions) {
+    size_t size = format::DecimalDigits(regions.size()) + 1;
+    for (const auto& region : regions) {
+      size += format::DecimalDigits(region.offset) + 1
+            + format::DecimalDigits(region.size) + 1;
+    }
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+  }
+
+  static void AppendSparseMap(const std::vector<SparseRegion>& regions,
+                              size_t padded_size, std::vector<char>* buffer) {
+    const size_t offset = buffer->size();
+    buffer->resize(offset + padded_size);  // Zeroes for the padding.
+    char* out = &(*buffer)[offset];
+    out += format::FormatDecimal(regions.size(), out);
+    *out++ = '\n';
+    for (const auto& region : regions) {
+      out += format::FormatDecimal(region.offset, out);
+      *out++ = '\n';
+      out += format::FormatDecimal(region.size, out);
+      *out++ = '\n';
+    }
+  }
+
+  /* Append a GNU ././@LongLink entry holding `value`, and keep its first
+   * bytes in `field` like GNU tar does. */
+  static void AppendGnuLongName(format::FileHeader::Type type,
+                                const std::string& value,
+                                format::TextField<100>* field,
+                                std::vector<char>* buffer) {
+    using format::FileHeader;
+    static const char long_link[] = "././@LongLink";
+    const size_t size = value.size() + 1;
+    const size_t padded = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    const size_t offset = buffer->size();
+    buffer->resize(offset + sizeof (FileHeader) + padded);
+
+    auto& header = reinterpret_cast<FileHeader&>((*buffer)[offset]);
+    memcpy(header.filename.raw, long_link, sizeof long_link - 1);
+    header.perms = Permissions{ 0 };
+    header.uid = 0;
+    header.gid = 0;
+    header.size = size;
+    header.mtime = 0;
+    header.type = type;
+    header.Finalize(true);
+    memcpy(&(*buffer)[offset + sizeof (FileHeader)], value.data(),
+           value.size());
+
+    field->Set(value.data(), sizeof field->raw);
+  }
 };
 
 }  // namespace tar
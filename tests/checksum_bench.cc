@@ -0,0 +1,94 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Time of the checksum kernels on a dump record (1 KiB) and a tar header
+ * (512 bytes), spread over 1 MiB of random data so that the sums do not all
+ * hit the same cache lines. */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "../checksum.h"
+
+namespace {
+
+const size_t DATA_SIZE = 1 << 20;
+const size_t ITERATIONS = 1 << 20;
+
+volatile uint64_t sink;
+
+template <typename Sum>
+double NanosecondsPerSum(const std::vector<char>& data, size_t size,
+                         Sum sum) {
+  double best = 0;
+  for (int run = 0; run < 5; ++run) {
+    const auto start = std::chrono::steady_clock::now();
+    uint64_t total = 0;
+    size_t offset = 0;
+    for (size_t i = 0; i < ITERATIONS; ++i) {
+      total += sum(data.data() + offset, size);
+      offset += size;
+      if (offset + size > data.size()) {
+        offset = 0;
+      }
+    }
+    sink = total;
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const double ns = elapsed.count() / ITERATIONS;
+    if (run == 0 || ns < best) {
+      best = ns;
+    }
+  }
+  return best;
+}
+
+void Bench(const char* name, checksum::Kernel kernel,
+           const std::vector<char>& data) {
+  const double record = NanosecondsPerSum(data, 1024,
+      [kernel](const char* p, size_t size) {
+    return checksum::SumBigEndian32(p, size, kernel);
+  });
+  const double header = NanosecondsPerSum(data, 512,
+      [kernel](const char* p, size_t size) {
+    return checksum::SumBytes(p, size, kernel);
+  });
+  printf("%-8s  1 KiB record %7.1f ns  512 bytes header %7.1f ns\n", name,
+         record, header);
+}
+
+}  // namespace
+
+int main() {
+  std::vector<char> data(DATA_SIZE);
+  std::mt19937 random(1);
+  for (auto& byte : data) {
+    byte = char(random());
+  }
+  Bench("scalar", checksum::Kernel::SCALAR, data);
+#ifdef DUMP2TAR_CHECKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.1")) {
+    Bench("sse4.1", checksum::Kernel::SSE41, data);
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    Bench("avx2", checksum::Kernel::AVX2, data);
+  }
+#endif
+  return 0;
+}
@@ -0,0 +1,95 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Compares the SSE4.1 and AVX2 checksum kernels to the scalar ones, which
+ * are the reference: every size up to a few records, at every misalignment
+ * of a 32 bytes vector, over random bytes, all 0xFF and all zero bytes.
+ * Kernels the CPU does not have are skipped. */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "../checksum.h"
+
+namespace {
+
+const size_t MAX_SIZE = 2 * 1024 + 100;
+const size_t MAX_MISALIGNMENT = 32;
+
+int failures = 0;
+
+void Check(const char* kernel_name, checksum::Kernel kernel,
+           const std::vector<uint8_t>& buffer, const char* fill) {
+  for (size_t misalignment = 0; misalignment < MAX_MISALIGNMENT;
+       ++misalignment) {
+    const uint8_t* data = buffer.data() + misalignment;
+    for (size_t size = 0; size <= MAX_SIZE; ++size) {
+      const uint32_t words = checksum::SumBigEndian32Scalar(data, size);
+      const uint64_t bytes = checksum::SumBytesScalar(data, size);
+      const uint32_t vector_words =
+          checksum::SumBigEndian32(data, size, kernel);
+      const uint64_t vector_bytes = checksum::SumBytes(data, size, kernel);
+      if (vector_words != words || vector_bytes != bytes) {
+        if (++failures <= 10) {
+          fprintf(stderr, "FAIL %s, %s data, size %zu, misalignment %zu: "
+                  "words %08x != %08x, bytes %llu != %llu\n", kernel_name,
+                  fill, size, misalignment, vector_words, words,
+                  (unsigned long long) vector_bytes,
+                  (unsigned long long) bytes);
+        }
+      }
+    }
+  }
+}
+
+void CheckKernel(const char* kernel_name, checksum::Kernel kernel) {
+  std::vector<uint8_t> buffer(MAX_SIZE + MAX_MISALIGNMENT);
+  std::mt19937 random(42);
+  for (int round = 0; round < 8; ++round) {
+    for (auto& byte : buffer) {
+      byte = uint8_t(random());
+    }
+    Check(kernel_name, kernel, buffer, "random");
+  }
+  std::fill(buffer.begin(), buffer.end(), 0xFF);
+  Check(kernel_name, kernel, buffer, "0xFF");
+  std::fill(buffer.begin(), buffer.end(), 0);
+  Check(kernel_name, kernel, buffer, "zero");
+  printf("%s: %s\n", kernel_name, failures ? "FAIL" : "ok");
+}
+
+}  // namespace
+
+int main() {
+#ifdef DUMP2TAR_CHECKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.1")) {
+    CheckKernel("sse4.1", checksum::Kernel::SSE41);
+  } else {
+    printf("sse4.1: skipped, not supported by this CPU\n");
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    CheckKernel("avx2", checksum::Kernel::AVX2);
+  } else {
+    printf("avx2: skipped, not supported by this CPU\n");
+  }
+#else
+  printf("no vector kernels on this architecture\n");
+#endif
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+# Copyright 2016 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Throughput of -z with 1 worker up to one per CPU.
+
+The dump is half text and half random data, 32 MiB each. Prints the best
+of 3 runs for each worker count, and the speedup over one worker.
+"""
+
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import dumpgen  # noqa: E402
+
+DUMP2TAR = os.environ.get('DUMP2TAR', './dump2tar')
+RUNS = 3
+
+
+def best_time(args):
+    best = None
+    for _ in range(RUNS):
+        start = time.monotonic()
+        subprocess.run([DUMP2TAR] + args, stdout=subprocess.DEVNULL,
+                       stderr=subprocess.DEVNULL, check=True)
+        elapsed = time.monotonic() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+def main():
+    cpus = os.cpu_count() or 1
+    workers = sorted(set([1, 2, 4, 8, 16, 32, 64, cpus]))
+    workers = [w for w in workers if w <= cpus] or [1]
+    with tempfile.TemporaryDirectory() as tmp:
+        dump = os.path.join(tmp, 'mixed.dump')
+        with open(dump, 'wb') as f:
+            f.write(dumpgen.build(dumpgen.mixed_tree(files=32)))
+        size = os.path.getsize(dump) / 1e6
+        print('%d CPUs, %.0f MB dump' % (cpus, size))
+        for codec in ('gzip', 'zstd'):
+            if subprocess.run([DUMP2TAR, '-z', codec, dump],
+                              stdout=subprocess.DEVNULL,
+                              stderr=subprocess.DEVNULL).returncode != 0:
+                continue
+            base = None
+            for count in workers:
+                elapsed = best_time(['-z', codec, '-j', str(count), dump])
+                base = base or elapsed
+                print('%s -j %-3d %8.1f MB/s  x%.2f'
+                      % (codec, count, size / elapsed, base / elapsed))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+# Copyright 2016 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""-z output decompressed by gzip and zstd.
+
+The archive written with -z, with 1 to 4 workers, must decompress with the
+command line tools to the archive written without it. zstd is skipped when
+dump2tar is built without it, or the zstd tool is missing.
+"""
+
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import dumpgen  # noqa: E402
+
+DUMP2TAR = os.environ.get('DUMP2TAR', './dump2tar')
+DECOMPRESS = {'gzip': ['gzip', '-dc'], 'zstd': ['zstd', '-dcq']}
+
+
+def run(args):
+    return subprocess.run([DUMP2TAR] + args, stdout=subprocess.PIPE,
+                          stderr=subprocess.DEVNULL)
+
+
+def main():
+    failures = 0
+    with tempfile.TemporaryDirectory() as tmp:
+        dump = os.path.join(tmp, 'mixed.dump')
+        tree = dumpgen.mixed_tree(files=3)
+        tree.update(dumpgen.sample_tree())
+        with open(dump, 'wb') as f:
+            f.write(dumpgen.build(tree))
+        expected = run([dump]).stdout
+        for codec in ('gzip', 'zstd'):
+            if not shutil.which(DECOMPRESS[codec][0]):
+                print('%s: no %s tool, skipped' % (codec, codec))
+                continue
+            if run(['-z', codec, dump]).returncode != 0:
+                print('%s: not built in, skipped' % codec)
+                continue
+            for spec in (codec, codec + ':1'):
+                for workers in (1, 2, 4):
+                    compressed = run(['-z', spec, '-j', str(workers), dump])
+                    output = subprocess.run(
+                        DECOMPRESS[codec], input=compressed.stdout,
+                        stdout=subprocess.PIPE).stdout
+                    ok = compressed.returncode == 0 and output == expected
+                    failures += not ok
+                    print('%s -j %d: %s' % (spec, workers,
+                                            'ok' if ok else 'FAIL'))
+    print('compress_test: %s' % ('FAIL' if failures else 'ok'))
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+# Copyright 2016 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""-D links copies of a file only when extracting them gives the same files.
+
+Copies with the owner and permissions of the first one become hardlinks to
+it, others are written with their content. Extracted with GNU tar, every
+file has its content. On a pipe, where the content cannot be compared
+again, -D needs -S sha256.
+"""
+
+import os
+import random
+import subprocess
+import sys
+import tarfile
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import dumpgen  # noqa: E402
+
+DUMP2TAR = os.environ.get('DUMP2TAR', './dump2tar')
+
+CONTENT = random.Random(1).randbytes(100 * 1024)
+# The same size and first 4 KiB, another end.
+OTHER = CONTENT[:-1] + bytes([CONTENT[-1] ^ 1])
+TREE = {
+    'a_first': ('file', CONTENT, 0o644, 1000, 1000),
+    'b_copy': ('file', CONTENT, 0o644, 1000, 1000),
+    'c_perms': ('file', CONTENT, 0o600, 1000, 1000),
+    'd_uid': ('file', CONTENT, 0o644, 1001, 1000),
+    'e_gid': ('file', CONTENT, 0o644, 1000, 1001),
+    'f_other': ('file', OTHER, 0o644, 1000, 1000),
+    'g_copy': ('file', CONTENT, 0o644, 1000, 1000),
+}
+LINKED = {'/b_copy', '/g_copy'}
+
+
+def main():
+    failures = []
+    with tempfile.TemporaryDirectory() as tmp:
+        dump = os.path.join(tmp, 'dedup.dump')
+        with open(dump, 'wb') as f:
+            f.write(dumpgen.build(TREE))
+        for stdin in (False, True):
+            how = 'stdin' if stdin else 'path'
+            archive = os.path.join(tmp, how + '.tar')
+            with open(dump, 'rb') as f, open(archive, 'wb') as out:
+                result = subprocess.run(
+                    [DUMP2TAR, '-D', '1M'] + ([] if stdin else [dump]),
+                    stdin=f if stdin else subprocess.DEVNULL, stdout=out,
+                    stderr=subprocess.DEVNULL)
+            if result.returncode != 0:
+                failures.append('%s: exit status' % how)
+                continue
+            with tarfile.open(archive) as tar:
+                links = {m.name for m in tar if m.islnk()}
+            if links != LINKED:
+                failures.append('%s: linked %s' % (how, sorted(links)))
+            directory = os.path.join(tmp, how)
+            os.mkdir(directory)
+            subprocess.check_call(['tar', '-x', '-f', archive, '-C',
+                                   directory], stderr=subprocess.DEVNULL)
+            for name, spec in TREE.items():
+                with open(os.path.join(directory, name), 'rb') as f:
+                    if f.read() != spec[1]:
+                        failures.append('%s: %s content' % (how, name))
+
+        with open(dump, 'rb') as f:
+            result = subprocess.run(
+                ['sh', '-c', 'cat | "$0" -D 1M', DUMP2TAR], stdin=f,
+                stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        if result.returncode == 0 or b'needs -S sha256' not in result.stderr:
+            failures.append('-D with xxh64 accepted on a pipe')
+    for failure in failures:
+        print('FAIL ' + failure)
+    print('dedup_test: %s' % ('FAIL' if failures else 'ok'))
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
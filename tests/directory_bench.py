@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+# Copyright 2016 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Stage 3 inline, and with -P on 1 thread up to one per CPU.
+
+The dump has 400k names: 2000 directories of 200 hardlinks each, to 40k
+empty files, so that stage 3 is most of the work. Its inodes are past the
+BITS map, for the tree to grow as it is filled. A filter matching nothing
+leaves out stage 4. Prints the best of 3 runs for each thread count, and the
+speedup over parsing inline. The archive must first be the same with -P.
+"""
+
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import dumpgen  # noqa: E402
+
+DUMP2TAR = os.environ.get('DUMP2TAR', './dump2tar')
+RUNS = 3
+DIRECTORIES = 2000
+NAMES = 200
+FILES = 40000
+
+
+def file_path(i):
+    return '/by_id/%03d/f%05d' % (i // 1000, i)
+
+
+def names_tree():
+    # Directories of up to 1000 names, well within one INODE record.
+    tree = {'by_id': {}}
+    for i in range(FILES):
+        tree['by_id'].setdefault('%03d' % (i // 1000), {})['f%05d' % i] = b''
+    for d in range(DIRECTORIES):
+        tree['d%04d' % d] = {
+            'name_of_a_file_%03d' % n:
+                ('link', file_path((d * NAMES + n) * 7919 % FILES))
+            for n in range(NAMES)}
+    return tree
+
+
+def best_time(args):
+    best = None
+    for _ in range(RUNS):
+        start = time.monotonic()
+        subprocess.run([DUMP2TAR] + args, stdout=subprocess.DEVNULL,
+                       stderr=subprocess.DEVNULL, check=True)
+        elapsed = time.monotonic() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+def main():
+    cpus = os.cpu_count() or 1
+    threads = sorted(set([1, 2, 4, 8, 16, 32, 64, cpus]))
+    threads = [t for t in threads if t <= cpus] or [1]
+    with tempfile.TemporaryDirectory() as tmp:
+        dump = os.path.join(tmp, 'names.dump')
+        with open(dump, 'wb') as f:
+            f.write(dumpgen.build(names_tree()))
+        print('%d CPUs, %d names' % (cpus, DIRECTORIES * NAMES + FILES))
+        expected = subprocess.run([DUMP2TAR, dump], stdout=subprocess.PIPE,
+                                  stderr=subprocess.DEVNULL).stdout
+        # Also with more threads than CPUs, for the shards to interleave.
+        for count in sorted(set(threads + [2, 4])):
+            archive = subprocess.run([DUMP2TAR, '-P', '-j', str(count), dump],
+                                     stdout=subprocess.PIPE,
+                                     stderr=subprocess.DEVNULL).stdout
+            if archive != expected:
+                print('-P -j %d: not the archive written inline' % count)
+                return 1
+        base = best_time(['-i', '/nothing', dump])
+        print('inline    %8.3f s' % base)
+        for count in threads:
+            args = ['-P', '-j', str(count)]
+            elapsed = best_time(args + ['-i', '/nothing', dump])
+            print('-P -j %-3d %8.3f s  x%.2f' % (count, elapsed,
+                                                base / elapsed))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
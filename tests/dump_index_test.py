@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+# Copyright 2016 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""-R with an index written by -X.
+
+The archive must be the one written with the same filters without -R, with
+the dump given as a path and on a pipe. An index must be refused with
+another dump, of another date or volume.
+"""
+
+import os
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import dumpgen  # noqa: E402
+
+DUMP2TAR = os.environ.get('DUMP2TAR', './dump2tar')
+FILTERS = [['-i', '/d0'], ['-i', '/big.bin', '-i', '/d1/d0'],
+           ['-i', '/sparse.img'], ['-e', '*.bin'], ['-i', '/nothing']]
+DATE = 1500000000
+
+
+def run(args, dump, pipe=False):
+    with open(dump, 'rb') as f:
+        return subprocess.run([DUMP2TAR] + args + ([] if pipe else [dump]),
+                              stdin=f if pipe else subprocess.DEVNULL,
+                              stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+
+
+def main():
+    failures = []
+    with tempfile.TemporaryDirectory() as tmp:
+        dumps = {}
+        for name, date, volume in (('dump', DATE, 1), ('later', DATE + 1, 1),
+                                   ('volume', DATE, 2)):
+            dumps[name] = os.path.join(tmp, name + '.dump')
+            with open(dumps[name], 'wb') as f:
+                f.write(dumpgen.build(dumpgen.sample_tree(), date=date,
+                                      volume=volume))
+        index = os.path.join(tmp, 'dump.idx')
+        if run(['-X', index], dumps['dump']).returncode != 0:
+            failures.append('-X')
+        for args in FILTERS:
+            expected = run(args, dumps['dump']).stdout
+            for pipe in (False, True):
+                result = run(['-R', index] + args, dumps['dump'], pipe)
+                if result.returncode != 0 or result.stdout != expected:
+                    failures.append('-R %s%s' % (' '.join(args),
+                                                 ' on a pipe' if pipe else ''))
+        for name in ('later', 'volume'):
+            result = run(['-R', index, '-i', '/d0'], dumps[name])
+            if (result.returncode == 0
+                    or b'is of another dump' not in result.stderr):
+                failures.append('index accepted with the %s dump' % name)
+    for failure in failures:
+        print('FAIL ' + failure)
+    print('dump_index_test: %s' % ('FAIL' if failures else 'ok'))
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,240 @@
+# Copyright 2016 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Writes small synthetic dumps for the tests.
+
+A tree is a dict of names to:
+  - a dict, for a directory,
+  - bytes, for a regular file,
+  - ('file', bytes, perms, uid, gid), for one with these permissions and
+    owner, instead of 0644 and 1000:1000,
+  - ('link', '/path'), for another name of a file already in the tree,
+  - ('sparse', size, [(offset, bytes), ...]), for a file with holes: only
+    the blocks with data are in the dump,
+  - ('fifo',) or ('symlink', target).
+
+Inodes are numbered in the order of the names, sorted, depth first.
+"""
+
+import random
+import struct
+
+BLOCK_SIZE = 1024
+MAGIC_NFS = 60012
+CHECKSUM = 84446
+MAP_SIZE = 512  # Blocks mapped by a record.
+
+TAPE, INODE, BITS, ADDR, END, CLRI = 1, 2, 3, 4, 5, 6
+
+TIMES = (1500000000.25, 1500000001.5, 1500000002)
+
+
+def record(record_type, inode=0, mode=0, nlink=0, size=0, uid=0, gid=0,
+           times=TIMES, count=0, blocks_map=None, corrupt=False, date=0,
+           volume=1):
+    """One record, with its checksum, or a wrong one if `corrupt`."""
+    block = bytearray(BLOCK_SIZE)
+    struct.pack_into('>iiiiIIii', block, 0, record_type, date, 0, volume, 0,
+                     inode, MAGIC_NFS, 0)
+
+    def timeval(t):
+        return struct.pack('>II', int(t), int(round((t - int(t)) * 1e6)))
+
+    fields = (struct.pack('>HHHHQ', mode, nlink, uid & 0xffff, gid & 0xffff,
+                          size)
+              + b''.join(timeval(t) for t in times))
+    block[32:32 + len(fields)] = fields
+    struct.pack_into('>II', block, 152, gid, uid)
+    struct.pack_into('>i', block, 160, count)
+    if blocks_map is not None:
+        block[164:164 + len(blocks_map)] = bytes(blocks_map)
+    total = sum(struct.unpack('>256i', bytes(block))) & 0xffffffff
+    checksum = (CHECKSUM - total) & 0xffffffff
+    if corrupt:
+        checksum ^= 1
+    struct.pack_into('>I', block, 28, checksum)
+    return bytes(block)
+
+
+def directory_blocks(entries):
+    """The blocks of a directory with `entries`, (inode, name) pairs."""
+    blocks = []
+    pending = []
+    used = 0
+
+    def flush():
+        block = bytearray()
+        for i, (inode, name) in enumerate(pending):
+            length = (8 + len(name) + 3) & ~3
+            if i == len(pending) - 1:
+                length = BLOCK_SIZE - len(block)
+            block += struct.pack('>IHBB', inode, length, 0, len(name)) + name
+            block += b'\0' * (length - 8 - len(name))
+        blocks.append(bytes(block))
+
+    for inode, name in entries:
+        name = name.encode()
+        length = (8 + len(name) + 3) & ~3
+        if used + length > BLOCK_SIZE:
+            flush()
+            pending = []
+            used = 0
+        pending.append((inode, name))
+        used += length
+    if pending:
+        flush()
+    return blocks
+
+
+def inode_records(inode, mode, nlink, size, data_blocks, blocks_map,
+                  corrupt_addr=False, uid=1000, gid=1000):
+    """The INODE record of a file, its ADDR records every MAP_SIZE blocks,
+    and its data blocks after the record mapping them."""
+    out = []
+    data = iter(data_blocks)
+    position = 0
+    while position == 0 or position < len(blocks_map):
+        chunk = blocks_map[position:position + MAP_SIZE]
+        record_type = INODE if position == 0 else ADDR
+        out.append(record(record_type, inode, mode, nlink, size, uid, gid,
+                          count=len(chunk), blocks_map=chunk,
+                          corrupt=corrupt_addr and record_type == ADDR))
+        out.extend(next(data) for present in chunk if present)
+        position += MAP_SIZE
+    return out
+
+
+def build(tree, corrupt_addr=False, date=0, volume=1):
+    """The dump of `tree`, of `date` and `volume` in its TAPE record. With
+    `corrupt_addr`, the ADDR records have a wrong checksum."""
+    next_inode = [3]
+    directories = []
+    files = []
+    inodes = {}
+    nlinks = {}
+
+    def walk(node, inode, path):
+        entries = [(inode, '.'), (inode, '..')]
+        for name, child in sorted(node.items()):
+            child_path = path + '/' + name
+            if isinstance(child, tuple) and child[0] == 'link':
+                target = inodes[child[1]]
+                nlinks[target] += 1
+                entries.append((target, name))
+                continue
+            child_inode = next_inode[0]
+            next_inode[0] += 1
+            inodes[child_path] = child_inode
+            entries.append((child_inode, name))
+            if isinstance(child, dict):
+                walk(child, child_inode, child_path)
+            else:
+                nlinks[child_inode] = 1
+                files.append((child_inode, child))
+        directories.append((inode, entries))
+
+    walk(tree, 2, '')
+    directories.sort()
+    out = [record(TAPE, date=date, volume=volume),
+           record(CLRI, count=1), b'\0' * BLOCK_SIZE,
+           record(BITS, count=1), b'\0' * BLOCK_SIZE]
+    for inode, entries in directories:
+        blocks = directory_blocks(entries)
+        out += inode_records(inode, 0o40755, 2, len(blocks) * BLOCK_SIZE,
+                             blocks, [1] * len(blocks))
+    for inode, spec in files:
+        nlink = nlinks[inode]
+        if isinstance(spec, bytes):
+            blocks = Image(len(spec), [(0, spec)]).blocks()
+            out += inode_records(inode, 0o100644, nlink, len(spec), blocks,
+                                 [1] * len(blocks), corrupt_addr)
+        elif spec[0] == 'file':
+            _, data, perms, uid, gid = spec
+            blocks = Image(len(data), [(0, data)]).blocks()
+            out += inode_records(inode, 0o100000 | perms, nlink, len(data),
+                                 blocks, [1] * len(blocks), uid=uid, gid=gid)
+        elif spec[0] == 'sparse':
+            # The blocks of zeroes are holes.
+            blocks = Image(spec[1], spec[2]).blocks()
+            out += inode_records(inode, 0o100644, nlink, spec[1],
+                                 [block for block in blocks if any(block)],
+                                 [int(any(block)) for block in blocks],
+                                 corrupt_addr)
+        elif spec[0] == 'fifo':
+            out += inode_records(inode, 0o10644, nlink, 0, [], [])
+        elif spec[0] == 'symlink':
+            target = spec[1].encode()
+            out += inode_records(inode, 0o120777, nlink, len(target),
+                                 [target.ljust(BLOCK_SIZE, b'\0')], [1])
+    out.append(record(END))
+    return b''.join(out)
+
+
+class Image(object):
+    """The content of a sparse file: `size` bytes, zero but for `segments`."""
+
+    def __init__(self, size, segments):
+        self.size = size
+        self.segments = segments
+
+    def content(self):
+        data = bytearray(self.size)
+        for offset, segment in self.segments:
+            data[offset:offset + len(segment)] = segment
+        return bytes(data)
+
+    def blocks(self):
+        data = self.content()
+        data += b'\0' * (-len(data) % BLOCK_SIZE)
+        return [data[i:i + BLOCK_SIZE] for i in range(0, len(data), BLOCK_SIZE)]
+
+
+def random_tree(rnd, depth, width, files, max_size):
+    tree = {}
+    for i in range(files):
+        tree['f%d.bin' % i] = rnd.randbytes(rnd.randint(0, max_size))
+    if depth:
+        for i in range(width):
+            tree['d%d' % i] = random_tree(rnd, depth - 1, width, files,
+                                          max_size)
+    return tree
+
+
+def sample_tree(seed=42):
+    """A bit of everything: directories, small and larger files, an empty
+    file and directory, hardlinks, a sparse file and a fifo."""
+    rnd = random.Random(seed)
+    tree = random_tree(rnd, 2, 2, 3, 5000)
+    tree['big.bin'] = rnd.randbytes(600 * 1024 + 17)
+    tree['empty'] = b''
+    tree['emptydir'] = {}
+    tree['zz_link'] = ('link', '/big.bin')
+    tree['d1']['hl'] = ('link', '/d0/f0.bin')
+    tree['sparse.img'] = ('sparse', 3 * 1024 * 1024 + 100,
+                          [(0, b'head' * 100), (700 * 1024, b'mid' * 2000),
+                           (3 * 1024 * 1024 + 50, b'tail')])
+    tree['fifo'] = ('fifo',)
+    return tree
+
+
+def mixed_tree(seed=42, files=8, file_size=1024 * 1024):
+    """Text like files, which compress, and random ones, which do not."""
+    rnd = random.Random(seed)
+    words = [bytes(rnd.choice(b'abcdefghijklmnop')
+                   for _ in range(rnd.randint(2, 9))) for _ in range(2000)]
+    tree = {}
+    for i in range(files):
+        text = b' '.join(rnd.choice(words) for _ in range(file_size // 5))
+        tree['text_%02d.txt' % i] = text[:file_size]
+        tree['data_%02d.bin' % i] = rnd.randbytes(file_size)
+    return tree
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+# Copyright 2016 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""-x against tar -x of the archive.
+
+The dumps are restored with -x, with one and several -j threads and on a
+pipe, and the archive of the same dumps is extracted with tar -x. Both trees
+must have the same paths, content, permissions, link counts and hardlinks,
+and the same owners when run as root. Times are only compared for regular
+files: tar -x sets the times of a directory before the files the archive
+has further down in it, which change them again.
+"""
+
+import os
+import random
+import stat
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import dumpgen  # noqa: E402
+
+DUMP2TAR = os.environ.get('DUMP2TAR', './dump2tar')
+OWNERS = os.geteuid() == 0
+
+
+def owners_tree(seed=42):
+    """Files of other permissions and owners, some with two names."""
+    rnd = random.Random(seed)
+    tree = {'home': {}}
+    for i, (perms, uid, gid) in enumerate(((0o600, 1001, 1001),
+                                           (0o640, 1002, 100),
+                                           (0o755, 0, 0),
+                                           (0o444, 65534, 65534))):
+        tree['home']['f%d' % i] = ('file', rnd.randbytes(3000 + i), perms,
+                                   uid, gid)
+    tree['z_link'] = ('link', '/home/f0')
+    tree['home']['z_link'] = ('link', '/home/f3')
+    return tree
+
+
+def attributes(root):
+    """path: (type, perms, uid, gid, size, nlink, mtime in us, content) of
+    every entry under `root`, with the size, time and content of regular
+    files only, and the groups of hardlinked paths."""
+    entries = {}
+    links = {}
+    for directory, names, files in os.walk(root):
+        for name in names + files:
+            path = os.path.join(directory, name)
+            st = os.lstat(path)
+            relative = os.path.relpath(path, root)
+            content = None
+            if stat.S_ISREG(st.st_mode):
+                with open(path, 'rb') as f:
+                    content = f.read()
+                links.setdefault(st.st_ino, set()).add(relative)
+            entries[relative] = (stat.S_IFMT(st.st_mode),
+                                 stat.S_IMODE(st.st_mode),
+                                 st.st_uid if OWNERS else None,
+                                 st.st_gid if OWNERS else None,
+                                 st.st_size if content is not None else None,
+                                 st.st_nlink,
+                                 st.st_mtime_ns // 1000
+                                 if content is not None else None,
+                                 content)
+    return entries, sorted(sorted(group) for group in links.values())
+
+
+def compare(expected, result):
+    """The differences between two results of attributes()."""
+    fields = ('type', 'permissions', 'owner', 'group', 'size', 'link count',
+              'mtime', 'content')
+    differences = []
+    for path in sorted(set(expected[0]) ^ set(result[0])):
+        differences.append('%s only in one tree' % path)
+    for path in sorted(set(expected[0]) & set(result[0])):
+        for field, a, b in zip(fields, expected[0][path], result[0][path]):
+            if a != b:
+                differences.append('%s: %s' % (path, field))
+    if expected[1] != result[1]:
+        differences.append('hardlinks')
+    return differences
+
+
+def main():
+    failures = []
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, tree in (('sample', dumpgen.sample_tree()),
+                           ('owners', owners_tree())):
+            dump = os.path.join(tmp, name + '.dump')
+            with open(dump, 'wb') as f:
+                f.write(dumpgen.build(tree))
+            untarred = os.path.join(tmp, name + '.tar.d')
+            os.mkdir(untarred)
+            archive = subprocess.run([DUMP2TAR, dump], stdout=subprocess.PIPE,
+                                     stderr=subprocess.DEVNULL)
+            extract = subprocess.run(['tar', '-x', '-p', '--numeric-owner',
+                                      '-C', untarred],
+                                     input=archive.stdout,
+                                     stderr=subprocess.DEVNULL)
+            if archive.returncode != 0 or extract.returncode != 0:
+                failures.append('%s: tar -x' % name)
+                continue
+            expected = attributes(untarred)
+            for args, pipe in ((['-j', '1'], False), (['-j', '4'], False),
+                               (['-j', '2'], True)):
+                restored = os.path.join(
+                    tmp, '%s.x%s%s' % (name, args[1], '.pipe' if pipe else ''))
+                os.mkdir(restored)
+                with open(dump, 'rb') as f:
+                    result = subprocess.run(
+                        [DUMP2TAR, '-x', restored] + args
+                        + ([] if pipe else [dump]),
+                        stdin=f if pipe else subprocess.DEVNULL,
+                        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+                label = '%s: -x %s%s' % (name, ' '.join(args),
+                                         ' on a pipe' if pipe else '')
+                if result.returncode != 0:
+                    failures.append(label)
+                    continue
+                failures += ['%s: %s' % (label, difference) for difference
+                             in compare(expected, attributes(restored))]
+    for failure in failures:
+        print('FAIL ' + failure)
+    print('extract_test: %s%s' % ('FAIL' if failures else 'ok',
+                                  '' if OWNERS else ', owners not checked'))
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
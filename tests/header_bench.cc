@@ -0,0 +1,123 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Time of StreamWriter::AddFile() per header, and the heap allocations it
+ * makes, counted by replacing operator new. The header buffer is reused like
+ * in dump2tar, the first call that grows it is left out. */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "../tar_writer.h"
+
+namespace {
+
+const size_t ITERATIONS = 1 << 20;
+
+uint64_t allocations = 0;
+
+volatile size_t sink;
+
+struct Case {
+  const char*       name;
+  tar::HeaderPolicy policy;
+  tar::File         file;
+};
+
+tar::File MakeFile(size_t path_size) {
+  tar::File file = {};
+  file.type = tar::FileType::REGULAR;
+  file.perms.raw = 0644;
+  file.filename = "/home/user/projects/dump2tar/tests/";
+  file.filename.resize(path_size, 'x');
+  file.uid = 1000;
+  file.gid = 1000;
+  file.size = 123456;
+  file.mtime_us = 1500000001500000;
+  file.atime_us = 1500000000250000;
+  file.ctime_us = 1500000002000000;
+  return file;
+}
+
+/* Best of 5 runs, in ns per call, and the allocations per call. */
+void Bench(const Case& c) {
+  tar::StreamWriter tar(c.policy);
+  std::vector<char> buffer;
+  tar.AddFile(c.file, &buffer);
+  double best = 0;
+  const uint64_t allocations_before = allocations;
+  for (int run = 0; run < 5; ++run) {
+    const auto start = std::chrono::steady_clock::now();
+    size_t total = 0;
+    for (size_t i = 0; i < ITERATIONS; ++i) {
+      total += tar.AddFile(c.file, &buffer).header_size;
+    }
+    sink = total;
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const double ns = elapsed.count() / ITERATIONS;
+    if (run == 0 || ns < best) {
+      best = ns;
+    }
+  }
+  const double per_call = double(allocations - allocations_before)
+                          / (5 * ITERATIONS);
+  printf("%-16s %7.1f ns  %4.2f allocations per header\n", c.name, best,
+         per_call);
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  ++allocations;
+  void* p = malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+int main() {
+  std::vector<Case> cases;
+  cases.push_back(Case{ "pax, times", tar::HeaderPolicy(), MakeFile(45) });
+  cases.push_back(Case{ "pax, long path", tar::HeaderPolicy(),
+                        MakeFile(150) });
+  cases.push_back(Case{ "pax, sparse", tar::HeaderPolicy(), MakeFile(45) });
+  cases.back().file.sparse = { { 0, 4096 }, { 1 << 20, 8192 },
+                               { 123456, 0 } };
+  tar::HeaderPolicy ustar;
+  ustar.format = tar::HeaderFormat::USTAR;
+  cases.push_back(Case{ "ustar", ustar, MakeFile(45) });
+  tar::HeaderPolicy gnu;
+  gnu.format = tar::HeaderFormat::GNU;
+  cases.push_back(Case{ "gnu, long path", gnu, MakeFile(150) });
+  for (const auto& c : cases) {
+    Bench(c);
+  }
+  return 0;
+}
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+# Copyright 2016 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Files with holes, written as pax sparse entries, extracted by GNU tar.
+
+Every file must come back with its content, and its holes must not be
+allocated. The dump is given both as a path, mapped, and on a pipe, where
+the block maps of the ADDR records are peeked from the input buffer. A
+corrupted ADDR record must stop dump2tar.
+"""
+
+import os
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import dumpgen  # noqa: E402
+
+DUMP2TAR = os.environ.get('DUMP2TAR', './dump2tar')
+KIB = 1024
+MIB = 1024 * KIB
+# Holes are checked with this granularity, the blocks of the filesystem the
+# files are extracted to may be larger than the blocks of the dump.
+GRANULE = 64 * KIB
+
+TREE = {
+    'middle': ('sparse', 1 * MIB, [(0, b'a' * 4096), (512 * KIB, b'b' * 4096)]),
+    'leading': ('sparse', 1 * MIB + 10, [(1 * MIB, b'end' * 3)]),
+    'trailing': ('sparse', 5 * MIB, [(0, b'x' * 3000)]),
+    'all_hole': ('sparse', 2 * MIB, []),
+    'unaligned': ('sparse', 300 * KIB + 7,
+                  [(100, b'u' * 50), (200 * KIB + 3, b'v' * 5000)]),
+    # Over the 512 blocks of a record: the map goes on in ADDR records.
+    'addr_records': ('sparse', 3 * MIB + 100,
+                     [(0, b'head' * 100), (700 * KIB, b'mid' * 2000),
+                      (1536 * KIB, b'q' * 70000), (3 * MIB + 50, b'tail')]),
+    'dense': bytes(range(256)) * 1000,
+}
+
+failures = []
+
+
+def check(condition, message):
+    if not condition:
+        failures.append(message)
+        print('FAIL ' + message)
+
+
+def allocated_bound(segments):
+    """Bytes the data of `segments` may take on disk, at most."""
+    granules = set()
+    for offset, data in segments:
+        for g in range(offset // GRANULE, (offset + len(data) - 1) // GRANULE + 1):
+            granules.add(g)
+    return (len(granules) + 1) * GRANULE
+
+
+def check_extracted(directory, how):
+    for name, spec in sorted(TREE.items()):
+        path = os.path.join(directory, name)
+        if isinstance(spec, bytes):
+            with open(path, 'rb') as f:
+                check(f.read() == spec, '%s: %s content' % (how, name))
+            continue
+        image = dumpgen.Image(spec[1], spec[2])
+        with open(path, 'rb') as f:
+            check(f.read() == image.content(), '%s: %s content' % (how, name))
+        allocated = os.stat(path).st_blocks * 512
+        check(allocated <= allocated_bound(spec[2]),
+              '%s: %s has %d bytes allocated, holes not kept'
+              % (how, name, allocated))
+
+
+def extract(dump, directory, pipe):
+    with open(dump, 'rb') as f:
+        producer = subprocess.Popen(
+            [DUMP2TAR] + ([] if pipe else [dump]),
+            stdin=f if pipe else subprocess.DEVNULL,
+            stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    subprocess.check_call(['tar', '-x', '-C', directory],
+                          stdin=producer.stdout, stderr=subprocess.DEVNULL)
+    producer.stdout.close()
+    return producer.wait()
+
+
+def main():
+    with tempfile.TemporaryDirectory() as tmp:
+        dump = os.path.join(tmp, 'sparse.dump')
+        with open(dump, 'wb') as f:
+            f.write(dumpgen.build(TREE))
+        for pipe in (False, True):
+            how = 'pipe' if pipe else 'mapped'
+            directory = os.path.join(tmp, how)
+            os.mkdir(directory)
+            check(extract(dump, directory, pipe) == 0, '%s: exit status' % how)
+            check_extracted(directory, how)
+
+        corrupted = os.path.join(tmp, 'corrupted.dump')
+        with open(corrupted, 'wb') as f:
+            f.write(dumpgen.build(TREE, corrupt_addr=True))
+        for pipe in (False, True):
+            with open(corrupted, 'rb') as f:
+                result = subprocess.run(
+                    [DUMP2TAR] + ([] if pipe else [corrupted]),
+                    stdin=f if pipe else subprocess.DEVNULL,
+                    stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+            check(result.returncode != 0
+                  and b'Invalid checksum' in result.stderr,
+                  'corrupted ADDR record not rejected (%s)'
+                  % ('pipe' if pipe else 'mapped'))
+
+    print('sparse_test: %s' % ('FAIL' if failures else 'ok'))
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
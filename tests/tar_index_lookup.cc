@@ -0,0 +1,155 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* tar_index_lookup index archive path
+ *
+ * Finds `path` in an index written with -I, and writes the content of its
+ * member to stdout, read with a seek to it: to the content itself in a
+ * plain archive, to the gzip member to decompress from in a compressed one.
+ * The header the index points to must be a ustar header. Used by
+ * tar_index_test.py. */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../tar_index.h"
+
+namespace {
+
+/* Reads the archive from an offset: as is, or gunzipped from the start of
+ * a gzip member, across the next ones. */
+class ArchiveReader {
+ public:
+  ArchiveReader(int fd, bool compressed) : _fd(fd), _compressed(compressed) {
+    memset(&_stream, 0, sizeof _stream);
+  }
+
+  ~ArchiveReader() {
+    if (_compressed) {
+      inflateEnd(&_stream);
+    }
+  }
+
+  bool Seek(uint64_t offset) {
+    if (lseek(_fd, offset, SEEK_SET) < 0) {
+      return false;
+    }
+    return !_compressed || inflateInit2(&_stream, 16 + MAX_WBITS) == Z_OK;
+  }
+
+  /* Read exactly `size` bytes, or return false. */
+  bool Read(void* data, size_t size) {
+    if (!_compressed) {
+      return read(_fd, data, size) == ssize_t(size);
+    }
+    _stream.next_out = static_cast<Bytef*>(data);
+    _stream.avail_out = size;
+    while (_stream.avail_out > 0) {
+      if (_stream.avail_in == 0) {
+        const ssize_t r = read(_fd, _input, sizeof _input);
+        if (r <= 0) {
+          return false;
+        }
+        _stream.next_in = _input;
+        _stream.avail_in = r;
+      }
+      const int status = inflate(&_stream, Z_NO_FLUSH);
+      if (status == Z_STREAM_END) {
+        inflateReset(&_stream);  // The next gzip member.
+      } else if (status != Z_OK) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool Skip(uint64_t size) {
+    std::vector<char> buffer(64 * 1024);
+    while (size > 0) {
+      const size_t n = std::min<uint64_t>(size, buffer.size());
+      if (!Read(buffer.data(), n)) {
+        return false;
+      }
+      size -= n;
+    }
+    return true;
+  }
+
+ private:
+  int      _fd;
+  bool     _compressed;
+  z_stream _stream;
+  Bytef    _input[64 * 1024];
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s index archive path\n", argv[0]);
+    return 2;
+  }
+  tar::IndexReader index;
+  if (!index.Open(argv[1])) {
+    fprintf(stderr, "Cannot read the index %s\n", argv[1]);
+    return 1;
+  }
+  tar::index_format::Entry entry;
+  if (!index.Find(argv[3], &entry)) {
+    fprintf(stderr, "%s is not in the index\n", argv[3]);
+    return 1;
+  }
+  const int fd = open(argv[2], O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open %s\n", argv[2]);
+    return 1;
+  }
+  const bool compressed = entry.frame_offset != tar::index_format::NO_FRAME;
+  ArchiveReader archive(fd, compressed);
+  char header[512];
+  if (!archive.Seek(compressed ? entry.frame_offset : entry.header_offset)
+      || (compressed && !archive.Skip(entry.frame_skip))
+      || !archive.Read(header, sizeof header)) {
+    fprintf(stderr, "Cannot read the header of %s\n", argv[3]);
+    return 1;
+  }
+  if (memcmp(header + 257, "ustar", 5) != 0) {
+    fprintf(stderr, "No ustar header at the offset of %s\n", argv[3]);
+    return 1;
+  }
+  if (!archive.Skip(entry.data_offset - entry.header_offset - sizeof header)) {
+    fprintf(stderr, "Cannot get to the content of %s\n", argv[3]);
+    return 1;
+  }
+  std::vector<char> buffer(64 * 1024);
+  for (uint64_t left = entry.size; left > 0;) {
+    const size_t n = std::min<uint64_t>(left, buffer.size());
+    if (!archive.Read(buffer.data(), n)) {
+      fprintf(stderr, "Cannot read the content of %s\n", argv[3]);
+      return 1;
+    }
+    fwrite(buffer.data(), 1, n, stdout);
+    left -= n;
+  }
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+# Copyright 2016 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Members read through the -I index, compared to tar -x.
+
+Every regular file of the archive is looked up in the index with
+tar_index_lookup, which seeks to it, and its content must be the file GNU
+tar extracts. Checked on a plain archive and on one written with -z gzip,
+where the lookup decompresses from the gzip member the index gives.
+Members with holes are left out, their content is stored without them.
+Corrupted copies of the plain index must be refused, or make the lookup
+abort, instead of being read past their end.
+"""
+
+import os
+import signal
+import struct
+import subprocess
+import sys
+import tarfile
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import dumpgen  # noqa: E402
+
+DUMP2TAR = os.environ.get('DUMP2TAR', './dump2tar')
+LOOKUP = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                      'tar_index_lookup')
+
+
+def corrupted_lookups(index, archive, path, tmp):
+    """Look up `path` in copies of `index` with a huge entry count, and with
+    the first path out of the string table. Return the failures."""
+    with open(index, 'rb') as f:
+        data = f.read()
+    failures = []
+    # Header: magic, version, flags, entry_count, entries_offset, ...
+    huge_count = data[:16] + struct.pack('<Q', 1 << 60) + data[24:]
+    # Entry: 5 u64, 2 u32, path_offset at 48.
+    entries_offset = struct.unpack_from('<Q', data, 24)[0]
+    field = entries_offset + 48
+    bad_path = data[:field] + struct.pack('<Q', 1 << 40) + data[field + 8:]
+    for name, content, returncode in (('entry count', huge_count, 1),
+                                      ('path offset', bad_path,
+                                       -signal.SIGABRT)):
+        copy = os.path.join(tmp, 'corrupted.idx')
+        with open(copy, 'wb') as f:
+            f.write(content)
+        lookup = subprocess.run([LOOKUP, copy, archive, path],
+                                stdout=subprocess.DEVNULL,
+                                stderr=subprocess.DEVNULL)
+        if lookup.returncode != returncode:
+            failures.append('corrupted %s: exit status %d'
+                            % (name, lookup.returncode))
+    return failures
+
+
+def main():
+    failures = 0
+    with tempfile.TemporaryDirectory() as tmp:
+        dump = os.path.join(tmp, 'test.dump')
+        tree = dumpgen.mixed_tree(files=3)
+        tree.update(dumpgen.sample_tree())
+        with open(dump, 'wb') as f:
+            f.write(dumpgen.build(tree))
+        for name, args in (('plain', []), ('gzip', ['-z', 'gzip', '-j', '2'])):
+            archive = os.path.join(tmp, name + '.tar')
+            index = os.path.join(tmp, name + '.idx')
+            directory = os.path.join(tmp, name)
+            os.mkdir(directory)
+            with open(archive, 'wb') as f:
+                subprocess.check_call([DUMP2TAR, '-I', index] + args + [dump],
+                                      stdout=f, stderr=subprocess.DEVNULL)
+            subprocess.check_call(['tar', '-x', '-f', archive, '-C', directory],
+                                  stderr=subprocess.DEVNULL)
+            with tarfile.open(archive) as tar:
+                members = [m for m in tar if m.isreg() and not m.sparse]
+            for member in members:
+                with open(os.path.join(directory, member.name.lstrip('/')),
+                          'rb') as f:
+                    expected = f.read()
+                lookup = subprocess.run([LOOKUP, index, archive, member.name],
+                                        stdout=subprocess.PIPE)
+                if lookup.returncode != 0 or lookup.stdout != expected:
+                    failures += 1
+                    print('FAIL %s: %s' % (name, member.name))
+            print('%s: %d members looked up' % (name, len(members)))
+            if name == 'plain':
+                for failure in corrupted_lookups(index, archive,
+                                                 members[0].name, tmp):
+                    failures += 1
+                    print('FAIL ' + failure)
+    print('tar_index_test: %s' % ('FAIL' if failures else 'ok'))
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
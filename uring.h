@@ -0,0 +1,461 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_URING_H_
+#define CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_URING_H_
+
+#ifdef DUMP2TAR_IO_URING
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// <linux/fs.h>, pulled by <linux/io_uring.h>, defines a BLOCK_SIZE macro
+// which clashes with dump::BLOCK_SIZE and tar::BLOCK_SIZE.
+#undef BLOCK_SIZE
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "./spsc_ring.h"
+
+namespace io {
+
+/* Bare io_uring instance, driven through the raw system calls so there is no
+ * dependency on liburing. Only used from a single thread. */
+class Uring {
+ public:
+  ~Uring() {
+    if (_sqes) {
+      munmap(_sqes, _sqes_size);
+    }
+    if (_cq_ptr && _cq_ptr != _sq_ptr) {
+      munmap(_cq_ptr, _cq_size);
+    }
+    if (_sq_ptr) {
+      munmap(_sq_ptr, _sq_size);
+    }
+    if (_fd >= 0) {
+      close(_fd);
+    }
+  }
+
+  /* Return false if io_uring is not available on this kernel. */
+  bool Setup(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    _fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (_fd < 0) {
+      return false;
+    }
+    _sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    _cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    const bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+    }
+    _sq_ptr = Map(_sq_size, IORING_OFF_SQ_RING);
+    _cq_ptr = single_mmap ? _sq_ptr : Map(_cq_size, IORING_OFF_CQ_RING);
+    _sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+    _sqes = static_cast<struct io_uring_sqe*>(Map(_sqes_size, IORING_OFF_SQES));
+    if (!_sq_ptr || !_cq_ptr || !_sqes) {
+      return false;
+    }
+    _sq_head = Field<unsigned>(_sq_ptr, p.sq_off.head);
+    _sq_tail = Field<unsigned>(_sq_ptr, p.sq_off.tail);
+    _sq_mask = *Field<unsigned>(_sq_ptr, p.sq_off.ring_mask);
+    _sq_entries = p.sq_entries;
+    _sq_array = Field<unsigned>(_sq_ptr, p.sq_off.array);
+    _cq_head = Field<unsigned>(_cq_ptr, p.cq_off.head);
+    _cq_tail = Field<unsigned>(_cq_ptr, p.cq_off.tail);
+    _cq_mask = *Field<unsigned>(_cq_ptr, p.cq_off.ring_mask);
+    _cqes = Field<struct io_uring_cqe>(_cq_ptr, p.cq_off.cqes);
+    return true;
+  }
+
+  /* Register the buffers for the *_FIXED operations. Can fail when over the
+   * locked memory limit, plain operations must be used then. */
+  bool RegisterBuffers(const std::vector<struct iovec>& iovs) {
+    return syscall(__NR_io_uring_register, _fd, IORING_REGISTER_BUFFERS,
+                   iovs.data(), iovs.size()) == 0;
+  }
+
+  /* Return a zeroed submission entry, queued on the next Submit(). */
+  struct io_uring_sqe* GetSqe() {
+    const unsigned head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+    if (_sq_local_tail - head >= _sq_entries) {
+      return nullptr;
+    }
+    const unsigned index = _sq_local_tail++ & _sq_mask;
+    struct io_uring_sqe* sqe = &_sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    _sq_array[index] = index;
+    return sqe;
+  }
+
+  /* Submit queued entries and wait for at least `wait` completions. */
+  void Submit(unsigned wait) {
+    const unsigned to_submit = _sq_local_tail - *_sq_tail;
+    __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+    for (;;) {
+      const int r = syscall(__NR_io_uring_enter, _fd, to_submit, wait,
+                            wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+      if (r >= 0) {
+        return;
+      }
+      if (errno != EINTR) {
+        std::cerr << "io_uring_enter error: " << strerror(errno) << std::endl;
+        abort();
+      }
+    }
+  }
+
+  /* Pop one completion if any. */
+  bool PopCqe(struct io_uring_cqe* cqe) {
+    const unsigned head = *_cq_head;
+    if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    *cqe = _cqes[head & _cq_mask];
+    __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+ private:
+  void* Map(size_t size, off_t offset) {
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, _fd, offset);
+    return addr == MAP_FAILED ? nullptr : addr;
+  }
+
+  template <typename T>
+  static T* Field(void* base, size_t offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+  }
+
+  int                   _fd = -1;
+  void*                 _sq_ptr = nullptr;
+  void*                 _cq_ptr = nullptr;
+  size_t                _sq_size = 0;
+  size_t                _cq_size = 0;
+  struct io_uring_sqe*  _sqes = nullptr;
+  size_t                _sqes_size = 0;
+
+  unsigned*             _sq_head;
+  unsigned*             _sq_tail;
+  unsigned              _sq_mask;
+  unsigned              _sq_entries;
+  unsigned*             _sq_array;
+  unsigned              _sq_local_tail = 0;
+  unsigned*             _cq_head;
+  unsigned*             _cq_tail;
+  unsigned              _cq_mask;
+  struct io_uring_cqe*  _cqes;
+};
+
+/* Common part of the reader and writer: `depth` chunks of `chunk_size` bytes,
+ * each with at most one request in flight.
+ *
+ * Regular files and block devices are accessed at explicit offsets, so all
+ * the chunks can be in flight at once. Anything else (pipes, sockets,
+ * O_APPEND files) only has one request in flight, to keep the order. */
+class UringChunks {
+ protected:
+  struct Slot {
+    Chunk    chunk;
+    uint64_t offset;
+    size_t   target;     // Bytes to transfer in total.
+    bool     in_flight;
+  };
+
+  ~UringChunks() {
+    // The kernel might still be writing to the buffers of requests in flight
+    // on a pipe, they are leaked on purpose.
+    if (_in_flight) {
+      for (auto& buffer : _buffers) {
+        buffer.release();
+      }
+    }
+  }
+
+  bool Init(int fd, size_t depth, size_t chunk_size) {
+    _fd = fd;
+    _chunk_size = chunk_size;
+    if (!_ring.Setup(depth)) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      return false;
+    }
+    const int flags = fcntl(fd, F_GETFL);
+    _seekable = (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+                && flags >= 0 && !(flags & O_APPEND);
+    if (_seekable) {
+      const off_t offset = lseek(fd, 0, SEEK_CUR);
+      if (offset < 0) {
+        return false;
+      }
+      _offset = offset;
+    }
+    std::vector<struct iovec> iovs;
+    for (size_t i = 0; i < depth; ++i) {
+      _buffers.emplace_back(new char[chunk_size]);
+      _slots.push_back(Slot{ { _buffers.back().get(), 0 }, 0, 0, false });
+      iovs.push_back({ _buffers.back().get(), chunk_size });
+    }
+    _fixed = _ring.RegisterBuffers(iovs);
+    return true;
+  }
+
+  void Submit(size_t index, uint8_t opcode, uint8_t fixed_opcode) {
+    Slot& slot = _slots[index];
+    struct io_uring_sqe* sqe = _ring.GetSqe();
+    assert(sqe);
+    sqe->opcode = _fixed ? fixed_opcode : opcode;
+    sqe->fd = _fd;
+    sqe->off = _seekable ? slot.offset + slot.chunk.size : uint64_t(-1);
+    sqe->addr = reinterpret_cast<uint64_t>(slot.chunk.data + slot.chunk.size);
+    sqe->len = slot.target - slot.chunk.size;
+    sqe->buf_index = index;
+    sqe->user_data = index;
+    slot.in_flight = true;
+    ++_in_flight;
+    _ring.Submit(0);
+  }
+
+  /* Wait for one completion and return the slot index and result. */
+  size_t Complete(int* res) {
+    struct io_uring_cqe cqe;
+    while (!_ring.PopCqe(&cqe)) {
+      ++_waits;
+      _ring.Submit(1);
+    }
+    Slot& slot = _slots[cqe.user_data];
+    assert(slot.in_flight);
+    slot.in_flight = false;
+    --_in_flight;
+    *res = cqe.res;
+    return cqe.user_data;
+  }
+
+ public:
+  /* Number of times we had to wait for the kernel. */
+  uint64_t waits() const {
+    return _waits;
+  }
+
+ protected:
+  Uring                                _ring;
+  int                                  _fd;
+  size_t                               _chunk_size;
+  bool                                 _seekable;
+  bool                                 _fixed;
+  uint64_t                             _offset = 0;
+  std::vector<std::unique_ptr<char[]>> _buffers;
+  std::vector<Slot>                    _slots;
+  size_t                               _in_flight = 0;
+  uint64_t                             _waits = 0;
+};
+
+/* Keep several reads in flight ahead of the consumer. */
+class UringReader: public ChunkSource, public UringChunks {
+ public:
+  /* Return nullptr if io_uring cannot be used. */
+  static std::unique_ptr<UringReader> Create(int fd, size_t depth,
+                                             size_t chunk_size) {
+    std::unique_ptr<UringReader> r(new UringReader);
+    if (!r->Init(fd, depth, chunk_size)) {
+      return nullptr;
+    }
+    r->Pump();
+    return r;
+  }
+
+  bool AcquireFilled(Chunk* chunk) override {
+    Slot& slot = _slots[_consume];
+    while (slot.in_flight) {
+      int res;
+      const size_t index = Complete(&res);
+      Slot& done = _slots[index];
+      if (res == -EINTR || res == -EAGAIN) {
+        Submit(index, IORING_OP_READ, IORING_OP_READ_FIXED);
+      } else if (res < 0) {
+        std::cerr << "Read error: " << strerror(-res) << std::endl;
+        abort();
+      } else if (res == 0) {
+        _eof = true;
+      } else {
+        done.chunk.size += res;
+        if (done.chunk.size < done.target) {
+          Submit(index, IORING_OP_READ, IORING_OP_READ_FIXED);
+        }
+      }
+      Pump();
+    }
+    if (slot.chunk.size == 0) {
+      return false;
+    }
+    *chunk = slot.chunk;
+    _consume = (_consume + 1) % _slots.size();
+    return true;
+  }
+
+  void Release(const Chunk& chunk) override {
+    Slot& slot = _slots[_release];
+    assert(slot.chunk.data == chunk.data);
+    (void)chunk;
+    slot.target = 0;
+    _release = (_release + 1) % _slots.size();
+    Pump();
+  }
+
+ private:
+  UringReader() = default;
+
+  /* Start reading in every released slot, in order. */
+  void Pump() {
+    while (!_eof && (_seekable || _in_flight == 0)) {
+      Slot& slot = _slots[_submit];
+      if (slot.in_flight || slot.target) {
+        return;  // Not released yet.
+      }
+      slot.chunk.size = 0;
+      slot.target = _chunk_size;
+      slot.offset = _offset;
+      _offset += _chunk_size;
+      Submit(_submit, IORING_OP_READ, IORING_OP_READ_FIXED);
+      _submit = (_submit + 1) % _slots.size();
+    }
+  }
+
+  size_t _submit = 0;
+  size_t _consume = 0;
+  size_t _release = 0;
+  bool   _eof = false;
+};
+
+/* Keep several writes in flight behind the producer. */
+class UringWriter: public ChunkSink, public UringChunks {
+ public:
+  /* Return nullptr if io_uring cannot be used. */
+  static std::unique_ptr<UringWriter> Create(int fd, size_t depth,
+                                             size_t chunk_size) {
+    std::unique_ptr<UringWriter> r(new UringWriter);
+    if (!r->Init(fd, depth, chunk_size)) {
+      return nullptr;
+    }
+    for (size_t i = 0; i < r->_slots.size(); ++i) {
+      r->_free.push_back(i);
+    }
+    return r;
+  }
+
+  ~UringWriter() {
+    Close();
+  }
+
+  bool AcquireFree(Chunk* chunk) override {
+    while (_free.empty()) {
+      Reap();
+    }
+    Slot& slot = _slots[_free.front()];
+    _free.pop_front();
+    slot.chunk.size = 0;
+    *chunk = slot.chunk;
+    return true;
+  }
+
+  void Publish(const Chunk& chunk) override {
+    const size_t index = Find(chunk);
+    Slot& slot = _slots[index];
+    slot.target = chunk.size;
+    slot.chunk.size = 0;
+    slot.offset = _offset;
+    _offset += chunk.size;
+    _queued.push_back(index);
+    Pump();
+  }
+
+  void Close() override {
+    while (_in_flight || !_queued.empty()) {
+      Reap();
+    }
+    if (_seekable) {
+      // Leave the file position where plain writes would have.
+      lseek(_fd, _offset, SEEK_SET);
+    }
+  }
+
+ private:
+  UringWriter() = default;
+
+  size_t Find(const Chunk& chunk) const {
+    for (size_t i = 0; i < _slots.size(); ++i) {
+      if (_slots[i].chunk.data == chunk.data) {
+        return i;
+      }
+    }
+    std::cerr << "Unknown chunk" << std::endl;
+    abort();
+  }
+
+  void Pump() {
+    while (!_queued.empty() && (_seekable || _in_flight == 0)) {
+      Submit(_queued.front(), IORING_OP_WRITE, IORING_OP_WRITE_FIXED);
+      _queued.pop_front();
+    }
+  }
+
+  void Reap() {
+    int res;
+    const size_t index = Complete(&res);
+    Slot& slot = _slots[index];
+    if (res == -EINTR || res == -EAGAIN) {
+      _queued.push_front(index);
+    } else if (res <= 0) {
+      std::cerr << "Write error: " << strerror(res ? -res : EIO) << std::endl;
+      abort();
+    } else {
+      slot.chunk.size += res;
+      if (slot.chunk.size < slot.target) {
+        _queued.push_front(index);
+      } else {
+        _free.push_back(index);
+      }
+    }
+    Pump();
+  }
+
+  std::deque<size_t> _free;
+  std::deque<size_t> _queued;
+};
+
+}  // namespace io
+
+#endif  // DUMP2TAR_IO_URING
+
+#endif  // CORP_STORAGE_SHREC_MOIRA_DUMP2TAR_URING_H_